@@ -0,0 +1,103 @@
+/*  Checks the quality of the block compression (bcn.h): synthetic images are compressed and decompressed and
+	their PSNR has to stay over a minimum for every format. Also measures the time of the encoder.
+	Run from the repo folder: bench/bench_bcn (exit code 1 if any is under its minimum)
+*/
+
+#include "../src/bcn.h"
+#include "../src/texture.h"
+#include "../src/utils.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+
+const int image_size = 256;
+
+//gradients with some waves and a bit of noise, like a photo more or less
+static void makeColorImage(Image& image, bool alpha)
+{
+	image.resize(image_size, image_size, alpha ? 4 : 3);
+	srand(1);
+	for (int y = 0; y < image_size; ++y)
+		for (int x = 0; x < image_size; ++x)
+		{
+			float u = x / (float)image_size, v = y / (float)image_size;
+			float color[4] = {
+				255 * u,
+				255 * (0.5f + 0.5f * sin(u * 12.0f) * cos(v * 7.0f)),
+				255 * v,
+				255 * (0.5f + 0.5f * cos(u * 5.0f + v * 3.0f))
+			};
+			uint8* pixel = &image.data[(y * image_size + x) * image.num_channels];
+			for (int c = 0; c < image.num_channels; ++c)
+				pixel[c] = (uint8)clamp(color[c] + (rand() % 9) - 4, 0.0f, 255.0f);
+		}
+}
+
+//the normals of a bumpy height field, in the 0..255 range
+static void makeNormalMap(Image& image)
+{
+	image.resize(image_size, image_size, 3);
+	for (int y = 0; y < image_size; ++y)
+		for (int x = 0; x < image_size; ++x)
+		{
+			float u = x / (float)image_size * 20.0f, v = y / (float)image_size * 14.0f;
+			Vector3 normal(-0.5f * cos(u) * cos(v), 0.5f * sin(u) * sin(v), 1.0f);
+			normal.normalize();
+			uint8* pixel = &image.data[(y * image_size + x) * 3];
+			pixel[0] = (uint8)(normal.x * 127.5f + 127.5f);
+			pixel[1] = (uint8)(normal.y * 127.5f + 127.5f);
+			pixel[2] = (uint8)(normal.z * 127.5f + 127.5f);
+		}
+}
+
+//only the first channels, BC5 has no blue
+static float computePSNR(Image& original, Image& decoded, int channels)
+{
+	double error = 0;
+	for (int i = 0; i < (int)(original.width * original.height); ++i)
+		for (int c = 0; c < channels; ++c)
+		{
+			double diff = (double)original.data[i * original.num_channels + c] - decoded.data[i * decoded.num_channels + c];
+			error += diff * diff;
+		}
+	error /= (double)original.width * original.height * channels;
+	if (error == 0)
+		return 99.0f;
+	return (float)(10.0 * log10(255.0 * 255.0 / error));
+}
+
+static bool check(const char* name, Image& image, bool normal_map, int channels, float min_psnr)
+{
+	static const char* names[] = { "BC1", "BC3", "BC4", "BC5" };
+	eBlockFormat format = chooseBlockFormat(&image, normal_map);
+
+	double time = getTime();
+	CompressedImage compressed;
+	compressed.compress(&image, format, false);
+	double compress_time = getTime() - time;
+
+	Image decoded;
+	compressed.decompress(&decoded);
+	float psnr = computePSNR(image, decoded, channels);
+	bool ok = psnr >= min_psnr;
+	std::cout << (ok ? "[PASS] " : "[FAIL] ") << name << " " << names[format] << ": PSNR " << psnr << "dB (min " << min_psnr << "dB), " << compress_time << "ms" << std::endl;
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	bool passed = true;
+	Image image;
+
+	makeColorImage(image, false);
+	passed = check("color", image, false, 3, 36) && passed;
+
+	makeColorImage(image, true);
+	passed = check("color and alpha", image, false, 4, 37) && passed;
+
+	makeNormalMap(image);
+	passed = check("normal map", image, true, 2, 48) && passed;
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+/*  Load time of the MBIN reader (Mesh::readBin) on a synthetic mesh of two million triangles: the file is mapped
+	and its streams used from the mapping, loadStreams copies them to the vectors only when the CPU needs them.
+	Also checks the streams read match the ones written, with the chunks raw and compressed.
+	Run from the repo folder: bench/bench_mbin (exit code 1 if the mesh read is different)
+*/
+
+#include "../src/mesh.h"
+#include "../src/utils.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+const int grid_size = 1000; //quads per side
+const char* bench_name = "bench/bench_mesh"; //writeBin adds the extension
+const char* bench_filename = "bench/bench_mesh.mbin";
+
+//a bumpy indexed grid
+static void createGridMesh(Mesh& mesh)
+{
+	int side = grid_size + 1;
+	for (int z = 0; z < side; ++z)
+		for (int x = 0; x < side; ++x)
+		{
+			float u = x / (float)grid_size, v = z / (float)grid_size;
+			mesh.vertices.push_back(Vector3(u * 100.0f, sin(u * 40.0f) * cos(v * 30.0f), v * 100.0f));
+			mesh.normals.push_back(Vector3(0, 1, 0));
+			mesh.uvs.push_back(Vector2(u, v));
+		}
+	for (int z = 0; z < grid_size; ++z)
+		for (int x = 0; x < grid_size; ++x)
+		{
+			unsigned int a = z * side + x, b = a + 1, c = a + side, d = c + 1;
+			unsigned int quad[6] = { a, c, b, b, c, d };
+			mesh.m_indices.insert(mesh.m_indices.end(), quad, quad + 6);
+		}
+
+	sSubmeshInfo submesh;
+	memset(&submesh, 0, sizeof(submesh));
+	submesh.length = (int)mesh.m_indices.size();
+	mesh.submeshes.push_back(submesh);
+	mesh.updateBoundingBox();
+}
+
+//writes the mesh and reads it back, false if what is read is different
+static bool benchMBIN(Mesh& source)
+{
+	if (!source.writeBin(bench_name))
+	{
+		std::cout << "[FAIL] cannot write " << bench_filename << std::endl;
+		return false;
+	}
+	//what a reader that copies has to do at least, read the whole file to memory
+	double time = getTime();
+	std::vector<unsigned char> buffer;
+	readFileBin(bench_filename, buffer);
+	double read_time = getTime() - time;
+	size_t file_size = buffer.size();
+	buffer = std::vector<unsigned char>();
+
+	time = getTime();
+	Mesh* mesh = new Mesh();
+	bool ok = mesh->readBin(bench_filename, false);
+	double bin_time = getTime() - time;
+	bool mapped = mesh->mapped_file != NULL;
+
+	time = getTime();
+	mesh->loadStreams();
+	double streams_time = getTime() - time;
+
+	ok = ok && mesh->vertices.size() == source.vertices.size() && mesh->m_indices.size() == source.m_indices.size() &&
+		memcmp(&mesh->vertices[0], &source.vertices[0], source.vertices.size() * sizeof(Vector3)) == 0 &&
+		memcmp(&mesh->m_indices[0], &source.m_indices[0], source.m_indices.size() * sizeof(unsigned int)) == 0;
+	delete mesh;
+	remove(bench_filename);
+
+	std::cout << (ok ? "[PASS] " : "[FAIL] ") << (Mesh::bin_compress ? "compressed" : "raw") << " " << file_size / (1024 * 1024) << "MB: read file " << read_time <<
+		"ms, readBin " << bin_time << "ms" << (mapped ? " (mapped)" : "") << ", loadStreams " << streams_time << "ms" << std::endl;
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	//no GL context here
+	Mesh::auto_upload_to_vram = false;
+
+	Mesh source;
+	createGridMesh(source);
+	std::cout << "mesh: " << source.m_indices.size() / 3 << " triangles, " << source.vertices.size() << " vertices" << std::endl;
+
+	//raw chunks are used from the mapping, compressed ones are decoded
+	bool passed = true;
+	Mesh::bin_compress = false;
+	passed = benchMBIN(source) && passed;
+	Mesh::bin_compress = true;
+	passed = benchMBIN(source) && passed;
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+/*  Load time of the OBJ parser (Mesh::loadOBJ) on a synthetic file of a million vertices and two million triangles,
+	against the parser it replaced, that copied every line and tokenized it into strings.
+	Also checks both produce the same triangles.
+	Run from the repo folder: bench/bench_obj (exit code 1 if the meshes are different)
+*/
+
+#include "../src/mesh.h"
+#include "../src/utils.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+const int grid_size = 1000; //quads per side
+const char* bench_filename = "bench/bench_mesh.obj";
+
+//a bumpy grid with positions, uvs and normals
+static bool writeGridOBJ(const char* filename)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return false;
+	int side = grid_size + 1;
+	fprintf(f, "# bench grid\no grid\n");
+	for (int z = 0; z < side; ++z)
+		for (int x = 0; x < side; ++x)
+		{
+			float u = x / (float)grid_size, v = z / (float)grid_size;
+			fprintf(f, "v %f %f %f\n", u * 100.0f, sin(u * 40.0f) * cos(v * 30.0f), v * 100.0f);
+		}
+	for (int z = 0; z < side; ++z)
+		for (int x = 0; x < side; ++x)
+			fprintf(f, "vt %f %f\n", x / (float)grid_size, z / (float)grid_size);
+	for (int z = 0; z < side; ++z)
+		for (int x = 0; x < side; ++x)
+			fprintf(f, "vn %f %f %f\n", 0.0f, 1.0f, 0.0f);
+	fprintf(f, "usemtl bench\n");
+	for (int z = 0; z < grid_size; ++z)
+		for (int x = 0; x < grid_size; ++x)
+		{
+			int a = z * side + x + 1, b = a + 1, c = a + side, d = c + 1;
+			fprintf(f, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, c, c, c, b, b, b);
+			fprintf(f, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", b, b, b, c, c, c, d, d, d);
+		}
+	fclose(f);
+	return true;
+}
+
+//the parser loadOBJ replaced, only the v, vt, vn and f lines
+static bool loadOBJTokenized(const char* filename, Mesh& mesh)
+{
+	std::string data;
+	if (!readFile(filename, data))
+		return false;
+	char* pos = &data[0];
+	char line[255];
+
+	std::vector<Vector3> indexed_positions;
+	std::vector<Vector3> indexed_normals;
+	std::vector<Vector2> indexed_uvs;
+
+	while (*pos != 0)
+	{
+		if (*pos == '\n') pos++;
+		if (*pos == '\r') pos++;
+
+		int i = 0;
+		while (i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
+		memcpy(line, pos, i);
+		line[i] = 0;
+		pos = pos + i;
+		if (*line == '#' || *line == 0)
+			continue;
+
+		std::vector<std::string> tokens = tokenize(line, " ");
+		if (tokens.empty())
+			continue;
+
+		if (tokens[0] == "v" && tokens.size() == 4)
+			indexed_positions.push_back(Vector3((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str())));
+		else if (tokens[0] == "vt" && tokens.size() >= 3)
+			indexed_uvs.push_back(Vector2((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str())));
+		else if (tokens[0] == "vn" && tokens.size() == 4)
+			indexed_normals.push_back(Vector3((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str())));
+		else if (tokens[0] == "f" && tokens.size() >= 4)
+		{
+			Vector3 v1, v2, v3;
+			v1.parseFromText(tokens[1].c_str(), '/');
+			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
+			{
+				v2.parseFromText(tokens[iPoly].c_str(), '/');
+				v3.parseFromText(tokens[iPoly + 1].c_str(), '/');
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v1.x) - 1]);
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v2.x) - 1]);
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v3.x) - 1]);
+				mesh.uvs.push_back(indexed_uvs[(unsigned int)(v1.y) - 1]);
+				mesh.uvs.push_back(indexed_uvs[(unsigned int)(v2.y) - 1]);
+				mesh.uvs.push_back(indexed_uvs[(unsigned int)(v3.y) - 1]);
+				mesh.normals.push_back(indexed_normals[(unsigned int)(v1.z) - 1]);
+				mesh.normals.push_back(indexed_normals[(unsigned int)(v2.z) - 1]);
+				mesh.normals.push_back(indexed_normals[(unsigned int)(v3.z) - 1]);
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	//only the parser: no GL context, no MBIN, and the triangles as they are in the file
+	Mesh::auto_upload_to_vram = false;
+	Mesh::use_binary = false;
+	Mesh::interleave_meshes = false;
+	Mesh::weld_meshes = false;
+	Mesh::optimize_meshes = false;
+
+	if (!writeGridOBJ(bench_filename))
+	{
+		std::cout << "[FAIL] cannot write " << bench_filename << std::endl;
+		return 1;
+	}
+	size_t file_size = 0;
+	if (FILE* f = fopen(bench_filename, "rb"))
+	{
+		fseek(f, 0, SEEK_END);
+		file_size = ftell(f);
+		fclose(f);
+	}
+
+	double time = getTime();
+	Mesh reference;
+	bool ok = loadOBJTokenized(bench_filename, reference);
+	double reference_time = getTime() - time;
+
+	time = getTime();
+	Mesh* mesh = Mesh::Get(bench_filename, false);
+	double load_time = getTime() - time;
+	remove(bench_filename);
+
+	//the float parsers can differ in the last bit
+	ok = ok && mesh && mesh->vertices.size() == reference.vertices.size() && mesh->uvs.size() == reference.uvs.size();
+	float max_error = 0;
+	for (int i = 0; ok && i < reference.vertices.size(); ++i)
+	{
+		max_error = std::max(max_error, (float)(mesh->vertices[i] - reference.vertices[i]).length());
+		max_error = std::max(max_error, (float)(mesh->uvs[i] - reference.uvs[i]).length());
+	}
+	ok = ok && max_error < 1e-4;
+
+	std::cout << "file: " << file_size / (1024 * 1024) << "MB, " << reference.vertices.size() / 3 << " triangles" << std::endl;
+	std::cout << "tokenized parser: " << reference_time << "ms, loadOBJ: " << load_time << "ms, " << reference_time / std::max(load_time, 1.0) << "x" << std::endl;
+	std::cout << (ok ? "[PASS]" : "[FAIL]") << " both parsers produce the same triangles (max difference " << max_error << ")" << std::endl;
+	return ok ? 0 : 1;
+}
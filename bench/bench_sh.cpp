@@ -0,0 +1,71 @@
+/*  Checks the SH projection of computeSH against the scalar computeSHReference and measures both.
+	Run from the repo folder: bench/bench_sh (exit code 1 if they don't match)
+*/
+
+#include "../src/sphericalharmonics.h"
+#include "../src/utils.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
+const float sh_tolerance = 1e-5; //relative to the biggest coefficient
+
+//random HDR faces, the same for a given size
+static void randomFaces(FloatImage images[6], int size)
+{
+	srand(size);
+	for (int i = 0; i < 6; ++i)
+	{
+		images[i].resize(size, size, 3);
+		for (int j = 0; j < size * size * 3; ++j)
+			images[i].data[j] = rand() / (float)RAND_MAX * 4.0f;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 16, 32, 64, 128, 256 };
+	bool passed = true;
+	FloatImage images[6];
+
+	for (int s = 0; s < 5; ++s)
+	{
+		int size = sizes[s];
+		randomFaces(images, size);
+		for (int degamma = 0; degamma < 2; ++degamma)
+		{
+			int repeats = std::max(1, 4096 / size);
+			computeSH(images, degamma != 0); //the table of this size is built outside the timing
+
+			double time = getTime();
+			SphericalHarmonics reference;
+			for (int r = 0; r < repeats; ++r)
+				reference = computeSHReference(images, degamma != 0);
+			double reference_time = (getTime() - time) / repeats;
+
+			time = getTime();
+			SphericalHarmonics sh;
+			for (int r = 0; r < repeats; ++r)
+				sh = computeSH(images, degamma != 0);
+			double fast_time = (getTime() - time) / repeats;
+
+			float max_error = 0;
+			float max_value = 0;
+			for (int k = 0; k < 9; ++k)
+				for (int c = 0; c < 3; ++c)
+				{
+					max_error = std::max(max_error, (float)fabs(sh.coeffs[k].v[c] - reference.coeffs[k].v[c]));
+					max_value = std::max(max_value, (float)fabs(reference.coeffs[k].v[c]));
+				}
+			float error = max_value > 0 ? max_error / max_value : max_error;
+			bool ok = error <= sh_tolerance;
+			passed = passed && ok;
+
+			std::cout << (ok ? "[PASS]" : "[FAIL]") << " size " << size << (degamma ? " degamma" : "") <<
+				": reference " << reference_time << "ms, computeSH " << fast_time << "ms, relative error " << error << std::endl;
+		}
+	}
+
+	return passed ? 0 : 1;
+}
@@ -10,6 +10,8 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "glstate.h"
+#include "loader.h"
 #include "extra/hdre.h"
 
 #include <cmath>
@@ -69,6 +71,10 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//Example of loading a prefab
 	//prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
+	//assets are read in background threads, the environment is prefetched while the scene loads
+	Loader::init();
+	Loader::run([]() { HDRE::Get("data/night.hdre"); });
+
 	scene = new GTR::Scene();
 	if (!scene->load("data/scene.json"))
 		exit(1);
@@ -79,9 +85,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//This class will be the one in charge of rendering all 
 	renderer = new GTR::Renderer(); //here so we have opengl ready in constructor
 
-	HDRE* hdre = new HDRE();
-	if (hdre->load("data/night.hdre"));
-		scene->environment = GTR::CubemapFromHDRE("data/night.hdre");
+	scene->environment = GTR::CubemapFromHDRE("data/night.hdre");
 
 
 	//hide the cursor
@@ -94,14 +98,21 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the assets loaded meanwhile are uploaded a few every frame
+	Loader::processTasks();
+	Loader::processUploads(Loader::upload_budget);
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
+	//the GUI of the last frame changed the state without the cache
+	GLState::invalidate();
+
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, false);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_DEPTH_TEST, true);
+	GLState::setCapability(GL_CULL_FACE, true);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -118,12 +129,33 @@ void Application::render(void)
 	//if(render_debug && !renderer->depth_viewport)
 	//	drawGrid();
 
-    glDisable(GL_DEPTH_TEST);
+    GLState::setCapability(GL_DEPTH_TEST, false);
     //render anything in the gui after this
 
 	//the swap buffers is done in the main loop after this function
 }
 
+bool Application::checkSHProjection()
+{
+	//a frame once everything is loaded, so the renderer has the calls and the grid
+	Loader::finish();
+	render();
+	return renderer->compareProbeProjections(scene);
+}
+
+void Application::printFrameStats(int frames)
+{
+	//the first frames build the calls and fill the caches, the stats are reset every frame
+	Loader::finish();
+	for (int i = 0; i < frames; ++i)
+		render();
+
+	int total = GLState::num_issued + GLState::num_skipped;
+	std::cout << "Render calls: " << renderer->calls.size() << ", copied in the passes: " << GTR::sCopyCounter::count << std::endl;
+	std::cout << "GL calls: " << GLState::num_issued << " issued, " << GLState::num_skipped << " skipped (" <<
+		(total ? 100.0f * GLState::num_skipped / total : 0.0f) << "% of " << total << ")" << std::endl;
+}
+
 void Application::update(double seconds_elapsed)
 {
 	float speed = seconds_elapsed * cam_speed * 25; //the speed is defined by the seconds_elapsed so it goes constant
@@ -252,6 +284,11 @@ void Application::renderDebugGUI(void)
 
 	//System stats
 	ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
+	ImGui::Text("Render calls: %d (rebuilt: %d)", (int)renderer->calls.size(), renderer->num_calls_rebuilt);
+	ImGui::Text("Render call copies in the passes: %d", GTR::sCopyCounter::count);
+	ImGui::Text("BVH tests: %d nodes, %d calls", renderer->bvh.num_node_tests, renderer->bvh.num_item_tests);
+	ImGui::Text("GL calls: %d issued, %d skipped", GLState::num_issued, GLState::num_skipped);
+	ImGui::Text("Loading: %d jobs, %d uploads", Loader::numPendingJobs(), Loader::numPendingUploads());
 
 	//Changing quality
 	bool changed_quality = false;
@@ -281,24 +318,25 @@ void Application::renderDebugGUI(void)
 	bool changed_render_mode = false;
 	changed_render_mode |= ImGui::Combo("Render Mode", (int*)&renderer->render_mode, "FORWARD\0DEFERRED", 2);
 	if (changed_render_mode) {
-		if (renderer->render_mode == GTR::DEFERRED)
+		if (renderer->render_mode == GTR::DEFERRED && renderer->light_mode == GTR::SINGLE)
 			renderer->light_mode = GTR::MULTI;
 	}
 
-	if (renderer->render_mode == GTR::FORWARD)
+	//Changing light_mode (deferred has no single pass)
+	bool changed_light_mode = false;
+	changed_light_mode |= ImGui::Combo("Light Mode", (int*)&renderer->light_mode, "SINGLE\0MULTI\0CLUSTERED", 3);
+	if (changed_light_mode)
 	{
-		//Changing light_mode
-		bool changed_light_mode = false;
-		changed_light_mode |= ImGui::Combo("Light Mode", (int*)&renderer->light_mode, "SINGLE\0MULTI", 2);
-		if (changed_light_mode)
+		if (renderer->render_mode == GTR::DEFERRED && renderer->light_mode == GTR::SINGLE)
+			renderer->light_mode = GTR::MULTI;
+		if (renderer->atlas)
 		{
-			if (renderer->light_mode == GTR::MULTI || renderer->atlas)
-			{
-				renderer->atlas->~FBO();
-				renderer->atlas = NULL;
-			}
+			renderer->atlas->~FBO();
+			renderer->atlas = NULL;
 		}
 	}
+	if (renderer->light_mode == GTR::CLUSTERED)
+		ImGui::Text("Clusters: %d lights, %d items", renderer->clusters.num_lights, renderer->clusters.num_items);
 
 	//Changing light_eq
 	bool changed_light_eq = false;
@@ -326,6 +364,7 @@ void Application::renderDebugGUI(void)
 
 	//Enabling PCF
 	ImGui::Checkbox("PCF", &renderer->pcf);
+	ImGui::Checkbox("Instancing", &renderer->instancing);
 
 	//Enabling HDR
 	ImGui::Checkbox("HDR", &renderer->hdr_active);
@@ -368,18 +407,27 @@ void Application::renderDebugGUI(void)
 		changed_irradiance |= ImGui::Checkbox("Irradiance", &renderer->activate_irr);
 		if (renderer->activate_irr)
 		{
-			//update probes if they have never been updated
-			if (!renderer->probes_texture || changed_irradiance)
+			//update probes if they have never been updated or irradiance has just been enabled,
+			//except the ones just read from the bake file, baking them again would make the file useless
+			if (!renderer->probes_texture || (changed_irradiance && !renderer->probes_from_bake))
 				renderer->updateProbes(scene);
 			ImGui::Checkbox("Trilinear", &renderer->irr_3lerp);
 			ImGui::Checkbox("Show Irradiance Probes", &renderer->show_probes);
+			ImGui::SliderInt("Probes per frame", &renderer->probes_per_frame, 1, 32);
+			ImGui::Checkbox("GPU SH projection", &renderer->gpu_sh_projection);
+			if (ImGui::Button("Compare SH with CPU"))
+				renderer->compareProbeProjections(scene);
 		}
 
 		bool changed_reflections = false;
 		changed_reflections |= ImGui::Checkbox("Reflections", &renderer->reflections);
 		if (renderer->reflections)
 		{
-			if (changed_reflections)
+			//the probes read from the bake file don't need to be rendered again
+			bool baked = true;
+			for (int i = 0; i < renderer->reflection_probes.size(); ++i)
+				baked = baked && renderer->reflection_probes[i]->baked;
+			if (changed_reflections && !baked)
 			{
 				renderer->reflections_calculated = true;
 				renderer->updateReflectionProbes(scene);
@@ -442,7 +490,7 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 		case SDLK_f: camera->center.set(0, 0, 0); camera->updateViewMatrix(); break;
 		case SDLK_F5: Shader::ReloadAll(); break;
 		case SDLK_1: if (renderer->lights.size() > 0) { renderer->depth_light = (renderer->depth_light + 1) % renderer->lights.size(); } break; //Changing the light selected for the depth viewport
-		case SDLK_F6: scene->clear(); scene->load(scene->filename.c_str()); selected_entity = NULL;  break;
+		case SDLK_F6: scene->clear(); renderer->invalidateCalls(); scene->load(scene->filename.c_str()); selected_entity = NULL;  break;
 		case SDLK_2: renderer->show_gbuffers = (renderer->show_gbuffers + 1) % 2; break;
 		case SDLK_3: renderer->show_omr = !renderer->show_omr; break;
 		case SDLK_4: renderer->updateProbes(scene); break;
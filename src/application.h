@@ -50,6 +50,8 @@ public:
 	void update( double dt );
 
 	void renderDebugGUI(void);
+	bool checkSHProjection(); //without the main loop, true if the GPU and CPU projections of the probes match
+	void printFrameStats(int frames); //without the main loop, renders some frames and prints the GL calls of the last one
 	void renderDebugGizmo();
 
 	//events
@@ -0,0 +1,497 @@
+#include "bcn.h"
+#include "includes.h"
+#include "texture.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <iostream>
+
+#define COMPRESSED_IMAGE_VERSION 2
+
+struct sCompressedImageInfo {
+	int version;
+	int header_bytes; //sizeof this struct, to detect files from builds where it was different
+	uint64 source_time;
+	uint64 source_size;
+	int normal_map; //the use it was cooked for, it decides the format
+	int format;
+	int width;
+	int height;
+	int num_levels;
+	int bytes;
+};
+
+int blockBytes(eBlockFormat format)
+{
+	return format == BC1 || format == BC4 ? 8 : 16;
+}
+
+unsigned int blockGLFormat(eBlockFormat format)
+{
+	switch (format)
+	{
+		case BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case BC4: return GL_COMPRESSED_RED_RGTC1;
+		case BC5: return GL_COMPRESSED_RG_RGTC2;
+	}
+	return 0;
+}
+
+bool blockFormatFromGL(unsigned int internal_format, eBlockFormat& format)
+{
+	eBlockFormat formats[] = { BC1, BC3, BC4, BC5 };
+	for (int i = 0; i < 4; ++i)
+		if (blockGLFormat(formats[i]) == internal_format)
+		{
+			format = formats[i];
+			return true;
+		}
+	return false;
+}
+
+//BC1 color block *************************************************
+
+static uint16 packColor(const float* color)
+{
+	int r = (int)(clamp(color[0], 0.0f, 255.0f) * (31.0f / 255.0f) + 0.5f);
+	int g = (int)(clamp(color[1], 0.0f, 255.0f) * (63.0f / 255.0f) + 0.5f);
+	int b = (int)(clamp(color[2], 0.0f, 255.0f) * (31.0f / 255.0f) + 0.5f);
+	return (uint16)((r << 11) | (g << 5) | b);
+}
+
+static void unpackColor(uint16 v, float* color)
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+}
+
+//chooses the closest of the 4 colors of the palette for every pixel, returns the squared error
+static float fitIndices(const float pixels[16][3], uint16 c0, uint16 c1, uint32& indices)
+{
+	float palette[4][3];
+	unpackColor(c0, palette[0]);
+	unpackColor(c1, palette[1]);
+	for (int j = 0; j < 3; ++j)
+	{
+		palette[2][j] = (2 * palette[0][j] + palette[1][j]) / 3.0f;
+		palette[3][j] = (palette[0][j] + 2 * palette[1][j]) / 3.0f;
+	}
+
+	float error = 0;
+	indices = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int best = 0;
+		float best_dist = 1e20f;
+		for (int k = 0; k < 4; ++k)
+		{
+			float dr = pixels[i][0] - palette[k][0], dg = pixels[i][1] - palette[k][1], db = pixels[i][2] - palette[k][2];
+			float dist = dr * dr + dg * dg + db * db;
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = k;
+			}
+		}
+		indices |= best << (i * 2);
+		error += best_dist;
+	}
+	return error;
+}
+
+//the endpoints must be c0 > c1, otherwise the decoder uses the 3 colors mode
+static void orderEndpoints(uint16& c0, uint16& c1, uint32& indices)
+{
+	if (c0 >= c1)
+		return;
+	std::swap(c0, c1);
+	indices ^= 0x55555555; //0 <-> 1, 2 <-> 3
+}
+
+static void compressColorBlock(const uint8* rgba, uint8* dst)
+{
+	float pixels[16][3];
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+		for (int j = 0; j < 3; ++j)
+		{
+			pixels[i][j] = rgba[i * 4 + j];
+			mean[j] += pixels[i][j] / 16.0f;
+		}
+
+	//principal axis of the colors, by power iteration over the covariance
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = pixels[i][0] - mean[0], g = pixels[i][1] - mean[1], b = pixels[i][2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+	float axis[3] = { 1, 1, 1 };
+	for (int iter = 0; iter < 8; ++iter)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float length = std::max(std::max(fabs(x), fabs(y)), fabs(z));
+		if (length < 1e-6f)
+			break; //flat block, any axis works
+		axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+	}
+	float length2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+	//the extremes along the axis, inset a bit as the ends are rarely hit exactly
+	float min_t = 1e20f, max_t = -1e20f;
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = ((pixels[i][0] - mean[0]) * axis[0] + (pixels[i][1] - mean[1]) * axis[1] + (pixels[i][2] - mean[2]) * axis[2]) / length2;
+		min_t = std::min(min_t, t);
+		max_t = std::max(max_t, t);
+	}
+	float inset = (max_t - min_t) / 16.0f;
+	float end0[3], end1[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		end0[j] = mean[j] + axis[j] * (max_t - inset);
+		end1[j] = mean[j] + axis[j] * (min_t + inset);
+	}
+
+	uint16 c0 = packColor(end0), c1 = packColor(end1);
+	uint32 indices;
+	float error = fitIndices(pixels, c0, c1, indices);
+
+	//refit the endpoints by least squares to the indices chosen, and keep them if they are better
+	static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	float aa = 0, bb = 0, ab = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float a = weights[(indices >> (i * 2)) & 3], b = 1.0f - a;
+		aa += a * a; bb += b * b; ab += a * b;
+		for (int j = 0; j < 3; ++j)
+		{
+			ax[j] += a * pixels[i][j];
+			bx[j] += b * pixels[i][j];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (fabs(det) > 1e-6f)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			end0[j] = (ax[j] * bb - bx[j] * ab) / det;
+			end1[j] = (bx[j] * aa - ax[j] * ab) / det;
+		}
+		uint16 r0 = packColor(end0), r1 = packColor(end1);
+		uint32 refit_indices;
+		float refit_error = fitIndices(pixels, r0, r1, refit_indices);
+		if (refit_error < error)
+		{
+			c0 = r0;
+			c1 = r1;
+			indices = refit_indices;
+		}
+	}
+
+	if (c0 == c1)
+		indices = 0;
+	else
+		orderEndpoints(c0, c1, indices);
+
+	dst[0] = c0 & 0xFF; dst[1] = c0 >> 8;
+	dst[2] = c1 & 0xFF; dst[3] = c1 >> 8;
+	memcpy(dst + 4, &indices, 4);
+}
+
+//BC4 single channel block ****************************************
+
+static void compressChannelBlock(const uint8* rgba, int channel, uint8* dst)
+{
+	int min = 255, max = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		min = std::min(min, (int)rgba[i * 4 + channel]);
+		max = std::max(max, (int)rgba[i * 4 + channel]);
+	}
+
+	//max > min uses the 8 values mode: code 0 is max, 1 is min and 2..7 go from max to min
+	uint64 bits = 0;
+	if (max > min)
+		for (int i = 0; i < 16; ++i)
+		{
+			int step = (int)((max - rgba[i * 4 + channel]) * 7.0f / (max - min) + 0.5f);
+			int code = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+			bits |= (uint64)code << (i * 3);
+		}
+
+	dst[0] = (uint8)max;
+	dst[1] = (uint8)min;
+	for (int i = 0; i < 6; ++i)
+		dst[2 + i] = (uint8)(bits >> (i * 8));
+}
+
+void compressBlock(eBlockFormat format, const uint8* rgba, uint8* dst)
+{
+	switch (format)
+	{
+		case BC1: compressColorBlock(rgba, dst); break;
+		case BC3: compressChannelBlock(rgba, 3, dst); compressColorBlock(rgba, dst + 8); break;
+		case BC4: compressChannelBlock(rgba, 0, dst); break;
+		case BC5: compressChannelBlock(rgba, 0, dst); compressChannelBlock(rgba, 1, dst + 8); break;
+	}
+}
+
+static void decompressColorBlock(const uint8* src, uint8* rgba, bool three_colors)
+{
+	uint16 c0, c1;
+	uint32 indices;
+	memcpy(&c0, src, 2);
+	memcpy(&c1, src + 2, 2);
+	memcpy(&indices, src + 4, 4);
+
+	//BC1 with c0 <= c1 has 3 colors and transparent black, in BC3 the color block always has 4
+	float palette[4][4];
+	unpackColor(c0, palette[0]);
+	unpackColor(c1, palette[1]);
+	for (int c = 0; c < 3; ++c)
+	{
+		if (three_colors && c0 <= c1)
+		{
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2.0f;
+			palette[3][c] = 0;
+		}
+		else
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3.0f;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3.0f;
+		}
+	}
+	for (int i = 0; i < 4; ++i)
+		palette[i][3] = (three_colors && c0 <= c1 && i == 3) ? 0.0f : 255.0f;
+
+	for (int i = 0; i < 16; ++i)
+		for (int c = 0; c < 4; ++c)
+			rgba[i * 4 + c] = (uint8)(palette[(indices >> (i * 2)) & 3][c] + 0.5f);
+}
+
+static void decompressChannelBlock(const uint8* src, int channel, uint8* rgba)
+{
+	int r0 = src[0], r1 = src[1];
+	uint64 bits = 0;
+	for (int i = 0; i < 6; ++i)
+		bits |= (uint64)src[2 + i] << (i * 8);
+
+	//r0 > r1 has 8 values, otherwise 6 and 0 and 255
+	float values[8] = { (float)r0, (float)r1 };
+	for (int i = 2; i < 8; ++i)
+		if (r0 > r1)
+			values[i] = ((8 - i) * r0 + (i - 1) * r1) / 7.0f;
+		else
+			values[i] = i < 6 ? ((6 - i) * r0 + (i - 1) * r1) / 5.0f : (i == 6 ? 0.0f : 255.0f);
+
+	for (int i = 0; i < 16; ++i)
+		rgba[i * 4 + channel] = (uint8)(values[(bits >> (i * 3)) & 7] + 0.5f);
+}
+
+void decompressBlock(eBlockFormat format, const uint8* src, uint8* rgba)
+{
+	memset(rgba, 0, 16 * 4);
+	for (int i = 0; i < 16; ++i)
+		rgba[i * 4 + 3] = 255;
+	switch (format)
+	{
+		case BC1: decompressColorBlock(src, rgba, true); break;
+		case BC3: decompressColorBlock(src + 8, rgba, false); decompressChannelBlock(src, 3, rgba); break;
+		case BC4: decompressChannelBlock(src, 0, rgba); break;
+		case BC5: decompressChannelBlock(src, 0, rgba); decompressChannelBlock(src + 8, 1, rgba); break;
+	}
+}
+
+eBlockFormat chooseBlockFormat(Image* image, bool normal_map)
+{
+	if (normal_map)
+		return BC5;
+	if (image->num_channels == 4)
+		for (int i = 0; i < image->width * image->height; ++i)
+			if (image->data[i * 4 + 3] != 255)
+				return BC3;
+	return BC1;
+}
+
+//CompressedImage *************************************************
+
+int CompressedImage::levelBytes(int level) const
+{
+	return ((levelWidth(level) + 3) / 4) * ((levelHeight(level) + 3) / 4) * blockBytes(format);
+}
+
+int CompressedImage::levelOffset(int level) const
+{
+	int offset = 0;
+	for (int i = 0; i < level; ++i)
+		offset += levelBytes(i);
+	return offset;
+}
+
+//half the size, averaging every 2x2 pixels (the last row or column is repeated when the size is odd)
+static void downsample(const std::vector<uint8>& src, int width, int height, std::vector<uint8>& dst)
+{
+	int w = std::max(1, width / 2), h = std::max(1, height / 2);
+	dst.resize(w * h * 4);
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x)
+		{
+			int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+			int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for (int c = 0; c < 4; ++c)
+			{
+				int sum = src[(y0 * width + x0) * 4 + c] + src[(y0 * width + x1) * 4 + c] + src[(y1 * width + x0) * 4 + c] + src[(y1 * width + x1) * 4 + c];
+				dst[(y * w + x) * 4 + c] = (uint8)((sum + 2) / 4);
+			}
+		}
+}
+
+void CompressedImage::compress(Image* image, eBlockFormat format, bool mipmaps)
+{
+	assert(image && image->data && (image->num_channels == 3 || image->num_channels == 4));
+
+	this->format = format;
+	width = image->width;
+	height = image->height;
+	num_levels = 1;
+	if (mipmaps)
+		while ((std::max(width, height) >> num_levels) > 0)
+			num_levels++;
+	data.resize(levelOffset(num_levels));
+
+	//everything is RGBA to simplify the blocks
+	std::vector<uint8> level(width * height * 4);
+	for (int i = 0; i < width * height; ++i)
+		for (int c = 0; c < 4; ++c)
+			level[i * 4 + c] = c < image->num_channels ? image->data[i * image->num_channels + c] : 255;
+
+	std::vector<uint8> next;
+	uint8 block[16 * 4];
+	for (int l = 0; l < num_levels; ++l)
+	{
+		int w = levelWidth(l), h = levelHeight(l);
+		uint8* dst = &data[levelOffset(l)];
+		for (int by = 0; by < h; by += 4)
+			for (int bx = 0; bx < w; bx += 4)
+			{
+				//the blocks out of the image repeat the border
+				for (int y = 0; y < 4; ++y)
+					for (int x = 0; x < 4; ++x)
+						memcpy(block + (y * 4 + x) * 4, &level[(std::min(by + y, h - 1) * w + std::min(bx + x, w - 1)) * 4], 4);
+				compressBlock(format, block, dst);
+				dst += blockBytes(format);
+			}
+
+		if (l + 1 < num_levels)
+		{
+			downsample(level, w, h, next);
+			level.swap(next);
+		}
+	}
+}
+
+void CompressedImage::fromTexture(Texture* texture)
+{
+	assert(texture);
+	bool found = blockFormatFromGL(texture->internal_format, format);
+	assert(found && "the texture is not compressed");
+
+	width = (int)texture->width;
+	height = (int)texture->height;
+	num_levels = 1;
+	if (texture->mipmaps)
+		while ((std::max(width, height) >> num_levels) > 0)
+			num_levels++;
+	data.resize(levelOffset(num_levels));
+
+	texture->bind();
+	for (int l = 0; l < num_levels; ++l)
+		glGetCompressedTexImage(GL_TEXTURE_2D, l, &data[levelOffset(l)]);
+}
+
+void CompressedImage::decompress(Image* image, int level)
+{
+	int w = levelWidth(level), h = levelHeight(level);
+	image->resize(w, h, 4);
+
+	const uint8* src = &data[levelOffset(level)];
+	uint8 block[16 * 4];
+	for (int by = 0; by < h; by += 4)
+		for (int bx = 0; bx < w; bx += 4)
+		{
+			decompressBlock(format, src, block);
+			src += blockBytes(format);
+			for (int y = 0; y < 4 && by + y < h; ++y)
+				for (int x = 0; x < 4 && bx + x < w; ++x)
+					memcpy(&image->data[((by + y) * w + bx + x) * 4], block + (y * 4 + x) * 4, 4);
+		}
+}
+
+bool CompressedImage::save(const char* filename, uint64 source_time, uint64 source_size, bool normal_map)
+{
+	sCompressedImageInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = COMPRESSED_IMAGE_VERSION;
+	info.header_bytes = sizeof(sCompressedImageInfo);
+	info.source_time = source_time;
+	info.source_size = source_size;
+	info.normal_map = normal_map;
+	info.format = format;
+	info.width = width;
+	info.height = height;
+	info.num_levels = num_levels;
+	info.bytes = (int)data.size();
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write compressed texture: " << filename << std::endl;
+		return false;
+	}
+	fwrite("CTEX", sizeof(char), 4, f);
+	fwrite(&info, sizeof(info), 1, f);
+	fwrite(&data[0], 1, data.size(), f);
+	fclose(f);
+	return true;
+}
+
+bool CompressedImage::load(const char* filename, uint64 source_time, uint64 source_size, bool normal_map)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	char watermark[4];
+	sCompressedImageInfo info;
+	bool ok = fread(watermark, 1, 4, f) == 4 && memcmp(watermark, "CTEX", 4) == 0 && fread(&info, sizeof(info), 1, f) == 1 &&
+		info.version == COMPRESSED_IMAGE_VERSION && info.header_bytes == sizeof(sCompressedImageInfo);
+	//cooked from another version of the original
+	if (ok && (info.source_time != source_time || info.source_size != source_size))
+		ok = false;
+	//cooked for the other use, it has the wrong format
+	if (ok && info.normal_map != (int)normal_map)
+		ok = false;
+	if (ok)
+	{
+		format = (eBlockFormat)info.format;
+		width = info.width;
+		height = info.height;
+		num_levels = info.num_levels;
+		ok = info.format >= BC1 && info.format <= BC5 && width > 0 && height > 0 && num_levels > 0 && num_levels <= 32 && info.bytes == levelOffset(num_levels);
+	}
+	if (ok)
+	{
+		data.resize(info.bytes);
+		ok = fread(&data[0], 1, info.bytes, f) == info.bytes;
+	}
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,63 @@
+/*  Block compression of textures (S3TC/RGTC), so they take 4 to 8 times less VRAM: the image is split in 4x4 blocks
+	and every block stores two endpoints and an index per pixel. BC1 is used for RGB, BC3 for RGBA, BC5 for normal maps
+	(only X and Y, the shader rebuilds Z). The encoder runs on the CPU when a texture is imported and the result, with all
+	its mipmaps, is cooked to a .ctex file next to the original, see Texture::load.
+*/
+
+#ifndef BCN_H
+#define BCN_H
+
+#include <vector>
+#include <algorithm>
+#include "framework.h"
+
+class Image;
+class Texture;
+
+enum eBlockFormat {
+	BC1, //RGB, 8 bytes per block
+	BC3, //RGBA, 16 bytes per block (BC4 alpha + BC1 color)
+	BC4, //one channel, 8 bytes per block
+	BC5 //two channels, 16 bytes per block
+};
+
+int blockBytes(eBlockFormat format);
+unsigned int blockGLFormat(eBlockFormat format); //the internal format for glCompressedTexImage2D
+bool blockFormatFromGL(unsigned int internal_format, eBlockFormat& format);
+
+//encode one 4x4 block of RGBA pixels (rows of 4 pixels, 4 bytes each)
+void compressBlock(eBlockFormat format, const uint8* rgba, uint8* dst);
+//and back, like the GPU does (BC4 and BC5 leave the channels they don't have at 0, alpha at 255)
+void decompressBlock(eBlockFormat format, const uint8* src, uint8* rgba);
+
+//BC5 for normal maps, BC3 if the image has transparent pixels and BC1 otherwise
+eBlockFormat chooseBlockFormat(Image* image, bool normal_map);
+
+class CompressedImage
+{
+public:
+	eBlockFormat format;
+	int width;
+	int height;
+	int num_levels;
+	std::vector<uint8> data; //all the levels, one after the other
+
+	CompressedImage() { format = BC1; width = height = num_levels = 0; }
+
+	int levelWidth(int level) const { return std::max(1, width >> level); }
+	int levelHeight(int level) const { return std::max(1, height >> level); }
+	int levelBytes(int level) const;
+	int levelOffset(int level) const;
+
+	//compresses the image (3 or 4 channels), the mipmaps are built with a box filter
+	void compress(Image* image, eBlockFormat format, bool mipmaps = true);
+	void fromTexture(Texture* texture); //reads it back from a compressed texture
+	void decompress(Image* image, int level = 0); //to RGBA, to check the quality of the encoder
+
+	//cooked files remember the size and time of the original, so they are cooked again when it changes,
+	//and if it was cooked as a normal map, the same image is BC5 as a normal map and BC1/BC3 otherwise
+	bool save(const char* filename, uint64 source_time, uint64 source_size, bool normal_map);
+	bool load(const char* filename, uint64 source_time, uint64 source_size, bool normal_map);
+};
+
+#endif
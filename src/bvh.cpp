@@ -0,0 +1,194 @@
+#include "bvh.h"
+#include "rendercall.h"
+#include "camera.h"
+
+#include <algorithm>
+#include <cfloat>
+
+using namespace GTR;
+
+//computes the min and max corners of a box
+inline void boxMinMax(const BoundingBox& box, Vector3& min, Vector3& max)
+{
+	min = box.center - box.halfsize;
+	max = box.center + box.halfsize;
+}
+
+inline void setNodeBox(BVH::sNode& node, const Vector3& min, const Vector3& max)
+{
+	node.min = min;
+	node.max = max;
+	node.box.center = (min + max) * 0.5;
+	node.box.halfsize = (max - min) * 0.5;
+}
+
+BVH::BVH()
+{
+	leaf_size = 4;
+	num_node_tests = 0;
+	num_item_tests = 0;
+}
+
+void BVH::build(const std::vector<RenderCall>& calls)
+{
+	nodes.clear();
+	items.resize(calls.size());
+	boxes.resize(calls.size());
+
+	if (calls.empty())
+		return;
+
+	for (int i = 0; i < calls.size(); ++i)
+	{
+		items[i] = i;
+		boxes[i] = calls[i].world_bounding;
+	}
+
+	//a binary tree has at most 2n-1 nodes, reserve so references stay valid
+	nodes.reserve(calls.size() * 2);
+	nodes.resize(1);
+	buildNode(0, 0, calls.size());
+}
+
+void BVH::buildNode(int node_index, int first, int count)
+{
+	//compute the box of all the items and the box of their centers
+	Vector3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	Vector3 cmin = min, cmax = max;
+	for (int i = first; i < first + count; ++i)
+	{
+		Vector3 bmin, bmax;
+		boxMinMax(boxes[items[i]], bmin, bmax);
+		const Vector3& c = boxes[items[i]].center;
+		for (int k = 0; k < 3; ++k)
+		{
+			min.v[k] = std::min(min.v[k], bmin.v[k]);
+			max.v[k] = std::max(max.v[k], bmax.v[k]);
+			cmin.v[k] = std::min(cmin.v[k], c.v[k]);
+			cmax.v[k] = std::max(cmax.v[k], c.v[k]);
+		}
+	}
+	setNodeBox(nodes[node_index], min, max);
+
+	//small enough, make it a leaf
+	if (count <= leaf_size)
+	{
+		nodes[node_index].first = first;
+		nodes[node_index].count = count;
+		return;
+	}
+
+	//split by the median along the longest axis of the centers
+	Vector3 extent = cmax - cmin;
+	int axis = 0;
+	if (extent.y > extent.v[axis]) axis = 1;
+	if (extent.z > extent.v[axis]) axis = 2;
+
+	int half = count / 2;
+	std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+		[this, axis](int a, int b) { return boxes[a].center.v[axis] < boxes[b].center.v[axis]; });
+
+	int left = nodes.size();
+	nodes.resize(left + 2);
+	nodes[node_index].first = left;
+	nodes[node_index].count = 0;
+
+	buildNode(left, first, half);
+	buildNode(left + 1, first + half, count - half);
+}
+
+void BVH::refit(const std::vector<RenderCall>& calls)
+{
+	if (nodes.empty() || items.size() != calls.size())
+		return build(calls);
+
+	for (int i = 0; i < calls.size(); ++i)
+		boxes[i] = calls[i].world_bounding;
+	refitNode(0);
+}
+
+void BVH::refitNode(int node_index)
+{
+	sNode& node = nodes[node_index];
+	Vector3 min, max;
+
+	if (node.count)
+	{
+		boxMinMax(boxes[items[node.first]], min, max);
+		for (int i = node.first + 1; i < node.first + node.count; ++i)
+		{
+			Vector3 bmin, bmax;
+			boxMinMax(boxes[items[i]], bmin, bmax);
+			for (int k = 0; k < 3; ++k)
+			{
+				min.v[k] = std::min(min.v[k], bmin.v[k]);
+				max.v[k] = std::max(max.v[k], bmax.v[k]);
+			}
+		}
+	}
+	else
+	{
+		refitNode(node.first);
+		refitNode(node.first + 1);
+		const sNode& a = nodes[node.first];
+		const sNode& b = nodes[node.first + 1];
+		for (int k = 0; k < 3; ++k)
+		{
+			min.v[k] = std::min(a.min.v[k], b.min.v[k]);
+			max.v[k] = std::max(a.max.v[k], b.max.v[k]);
+		}
+	}
+	setNodeBox(node, min, max);
+}
+
+void BVH::cull(Camera* camera, std::vector<int>& result)
+{
+	result.clear();
+
+	if (nodes.empty())
+		return;
+
+	cullNode(camera, 0, result);
+}
+
+void BVH::addItems(int node_index, std::vector<int>& result)
+{
+	const sNode& node = nodes[node_index];
+	if (node.count)
+	{
+		result.insert(result.end(), items.begin() + node.first, items.begin() + node.first + node.count);
+		return;
+	}
+	addItems(node.first, result);
+	addItems(node.first + 1, result);
+}
+
+void BVH::cullNode(Camera* camera, int node_index, std::vector<int>& result)
+{
+	const sNode& node = nodes[node_index];
+
+	num_node_tests++;
+	char clip = camera->testBoxInFrustum(node.box.center, node.box.halfsize);
+	if (clip == CLIP_OUTSIDE)
+		return;
+
+	//fully inside, no need to test the children
+	if (clip == CLIP_INSIDE)
+		return addItems(node_index, result);
+
+	if (node.count)
+	{
+		//partially inside, test every item of the leaf
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			num_item_tests++;
+			const BoundingBox& box = boxes[items[i]];
+			if (camera->testBoxInFrustum(box.center, box.halfsize))
+				result.push_back(items[i]);
+		}
+		return;
+	}
+
+	cullNode(camera, node.first, result);
+	cullNode(camera, node.first + 1, result);
+}
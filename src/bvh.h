@@ -0,0 +1,53 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+
+namespace GTR {
+
+	class RenderCall;
+
+	//bounding volume hierarchy over the world space boxes of the render calls
+	//used to cull the calls against any camera (main, lights, cubemap faces) without testing them all
+	class BVH
+	{
+	public:
+		struct sNode {
+			Vector3 min;
+			Vector3 max;
+			BoundingBox box;	//same as min/max but in the format the camera expects
+			int first;			//first child (the second is first + 1) or first item if it is a leaf
+			int count;			//number of items if it is a leaf, 0 otherwise
+		};
+
+		std::vector<sNode> nodes;
+		std::vector<int> items;	//indices to the calls, grouped by leaf
+		std::vector<BoundingBox> boxes; //world box of every call
+		int leaf_size;			//max items per leaf
+
+		//stats of the queries, accumulated until resetStats
+		int num_node_tests;
+		int num_item_tests;
+
+		BVH();
+
+		//builds the tree from scratch
+		void build(const std::vector<RenderCall>& calls);
+		//updates the boxes keeping the same topology (use it when calls move but are the same ones)
+		void refit(const std::vector<RenderCall>& calls);
+		//fills result with the indices of the calls whose box is inside the camera frustum
+		void cull(Camera* camera, std::vector<int>& result);
+
+		bool empty() { return nodes.empty(); }
+		void resetStats() { num_node_tests = num_item_tests = 0; }
+
+	private:
+		void buildNode(int node_index, int first, int count);
+		void refitNode(int node_index);
+		void addItems(int node_index, std::vector<int>& result);
+		void cullNode(Camera* camera, int node_index, std::vector<int>& result);
+	};
+
+};
@@ -360,30 +360,15 @@ char Camera::testBoxInFrustum(const Vector3& center, const Vector3& halfsize)
 {
 	int flag = 0, o = 0;
 
-	flag = planeBoxOverlap( (Vector4&)frustum[0], center,halfsize );
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4&)frustum[1], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4&)frustum[2], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4&)frustum[3], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4&)frustum[4], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
-	flag = planeBoxOverlap((Vector4&)frustum[5], center, halfsize);
-	if (flag == CLIP_OUTSIDE)
-		return CLIP_OUTSIDE;
-	o += flag;
+	//o counts the planes crossed by the box, if none the box is fully inside
+	for (int i = 0; i < 6; ++i)
+	{
+		flag = planeBoxOverlap((Vector4&)frustum[i], center, halfsize);
+		if (flag == CLIP_OUTSIDE)
+			return CLIP_OUTSIDE;
+		if (flag == CLIP_OVERLAP)
+			o++;
+	}
 	return o == 0 ? CLIP_INSIDE : CLIP_OVERLAP;
 }
 
@@ -0,0 +1,180 @@
+#include "clusters.h"
+#include "camera.h"
+#include "shader.h"
+#include "scene.h"
+#include "glstate.h"
+
+#include <algorithm>
+#include <cfloat>
+
+using namespace GTR;
+
+LightClusters::LightClusters()
+{
+	dim_x = 16;
+	dim_y = 9;
+	dim_z = 24;
+	num_lights = 0;
+	num_items = 0;
+	camera = NULL;
+	z_scale = z_bias = 0;
+	grid_buffer = grid_texture = 0;
+	items_buffer = items_texture = 0;
+}
+
+void LightClusters::build(Camera* camera, const std::vector<LightEntity*>& lights, int max_lights)
+{
+	this->camera = camera;
+
+	//exponential slices, so the clusters close to the camera are as deep as they are wide
+	float near_plane = std::max(camera->near_plane, 0.001f);
+	float far_plane = std::max(camera->far_plane, near_plane * 2.0f);
+	z_scale = dim_z / log(far_plane / near_plane);
+	z_bias = -log(near_plane) * z_scale;
+
+	int num_clusters = numClusters();
+	grid.assign(num_clusters * 2, 0);
+
+	//first count the lights of every cluster, the shader reads them from the light block so the rest are left out
+	int count = std::min((int)lights.size(), max_lights);
+	std::vector<sRange> ranges(count);
+	std::vector<bool> visible(count);
+	num_lights = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		visible[i] = computeRange(lights[i], ranges[i]);
+		if (!visible[i])
+			continue;
+		num_lights++;
+		const sRange& r = ranges[i];
+		for (int z = r.min_z; z <= r.max_z; ++z)
+			for (int y = r.min_y; y <= r.max_y; ++y)
+				for (int x = r.min_x; x <= r.max_x; ++x)
+					grid[((z * dim_y + y) * dim_x + x) * 2 + 1]++;
+	}
+
+	//then the offsets, and the counts are used again as write cursors
+	num_items = 0;
+	for (int i = 0; i < num_clusters; ++i)
+	{
+		grid[i * 2] = num_items;
+		num_items += grid[i * 2 + 1];
+		grid[i * 2 + 1] = 0;
+	}
+
+	items.resize(std::max(num_items, 1)); //texture buffers can't be empty
+	for (int i = 0; i < count; ++i)
+	{
+		if (!visible[i])
+			continue;
+		const sRange& r = ranges[i];
+		for (int z = r.min_z; z <= r.max_z; ++z)
+			for (int y = r.min_y; y <= r.max_y; ++y)
+				for (int x = r.min_x; x <= r.max_x; ++x)
+				{
+					uint32* cluster = &grid[((z * dim_y + y) * dim_x + x) * 2];
+					items[cluster[0] + cluster[1]++] = i;
+				}
+	}
+
+	upload();
+}
+
+bool LightClusters::computeRange(LightEntity* light, sRange& range)
+{
+	//directional lights reach every cluster
+	if (light->light_type == DIRECTIONAL)
+	{
+		range.min_x = range.min_y = range.min_z = 0;
+		range.max_x = dim_x - 1;
+		range.max_y = dim_y - 1;
+		range.max_z = dim_z - 1;
+		return true;
+	}
+
+	//point and spot lights are bounded by the sphere of their max distance
+	Vector3 center = light->model.getTranslation();
+	float radius = light->max_distance;
+
+	//depth range
+	Vector3 view_center = camera->view_matrix * center;
+	float min_depth = -view_center.z - radius;
+	float max_depth = -view_center.z + radius;
+	if (max_depth < camera->near_plane || min_depth > camera->far_plane)
+		return false;
+	min_depth = std::max(min_depth, camera->near_plane);
+	range.min_z = (int)clamp(log(min_depth) * z_scale + z_bias, 0, dim_z - 1);
+	range.max_z = (int)clamp(log(max_depth) * z_scale + z_bias, 0, dim_z - 1);
+
+	//screen range, projecting the corners of the box around the sphere
+	Vector2 min(FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX);
+	bool behind = false;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner = center + Vector3(i & 1 ? radius : -radius, i & 2 ? radius : -radius, i & 4 ? radius : -radius);
+		Vector4 clip = camera->viewprojection_matrix * Vector4(corner.x, corner.y, corner.z, 1.0);
+		//a corner behind the camera can project anywhere, so use the whole screen
+		if (clip.w <= 0.0)
+		{
+			behind = true;
+			break;
+		}
+		min.x = std::min(min.x, clip.x / clip.w);
+		min.y = std::min(min.y, clip.y / clip.w);
+		max.x = std::max(max.x, clip.x / clip.w);
+		max.y = std::max(max.y, clip.y / clip.w);
+	}
+	if (behind)
+	{
+		min.set(-1, -1);
+		max.set(1, 1);
+	}
+	if (min.x > 1 || min.y > 1 || max.x < -1 || max.y < -1)
+		return false;
+
+	range.min_x = (int)clamp((min.x * 0.5 + 0.5) * dim_x, 0, dim_x - 1);
+	range.max_x = (int)clamp((max.x * 0.5 + 0.5) * dim_x, 0, dim_x - 1);
+	range.min_y = (int)clamp((min.y * 0.5 + 0.5) * dim_y, 0, dim_y - 1);
+	range.max_y = (int)clamp((max.y * 0.5 + 0.5) * dim_y, 0, dim_y - 1);
+	return true;
+}
+
+void LightClusters::upload()
+{
+	//first time we create the texture buffers
+	if (!grid_buffer)
+	{
+		glGenBuffers(1, &grid_buffer);
+		glGenBuffers(1, &items_buffer);
+		glGenTextures(1, &grid_texture);
+		glGenTextures(1, &items_texture);
+
+		glBindTexture(GL_TEXTURE_BUFFER, grid_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, grid_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, items_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, items_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		GLState::forgetActiveTexture();
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, grid_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid.size() * sizeof(uint32), &grid[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, items_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, items.size() * sizeof(uint32), &items[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void LightClusters::bind(Shader* shader, int grid_slot, int items_slot)
+{
+	assert(camera && "build the clusters before binding them");
+
+	GLState::bindTexture(grid_slot, GL_TEXTURE_BUFFER, grid_texture);
+	GLState::bindTexture(items_slot, GL_TEXTURE_BUFFER, items_texture);
+	shader->setUniform(U_CLUSTER_GRID, grid_slot);
+	shader->setUniform(U_CLUSTER_ITEMS, items_slot);
+	shader->setUniform(U_CLUSTER_DIMS, Vector3(dim_x, dim_y, dim_z));
+	shader->setUniform(U_CLUSTER_ZPARAMS, Vector2(z_scale, z_bias));
+	shader->setUniform(U_VIEWPROJECTION, camera->viewprojection_matrix);
+	shader->setUniform(U_VIEWMATRIX, camera->view_matrix);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "framework.h"
+#include "includes.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+class Shader;
+
+namespace GTR {
+
+	class LightEntity;
+
+	//view space froxel grid with the list of lights that touch every cell
+	//the grid is split in tiles in screen space and in exponential slices in depth
+	class LightClusters
+	{
+	public:
+		int dim_x, dim_y, dim_z;	//number of clusters in every axis
+
+		std::vector<uint32> grid;	//first item and number of lights of every cluster
+		std::vector<uint32> items;	//light indices (in the order of the lights vector), grouped by cluster
+
+		//stats of the last build
+		int num_lights;
+		int num_items;
+
+		LightClusters();
+
+		//assigns the lights to the clusters of the camera frustum and uploads the lists to the GPU
+		//only the first max_lights are used, the ones that fit in the light block
+		void build(Camera* camera, const std::vector<LightEntity*>& lights, int max_lights);
+		//passes the lists and the grid parameters to a shader that includes "cluster_functions"
+		void bind(Shader* shader, int grid_slot, int items_slot);
+
+		int numClusters() { return dim_x * dim_y * dim_z; }
+
+	private:
+		struct sRange {
+			int min_x, max_x;
+			int min_y, max_y;
+			int min_z, max_z;
+		};
+
+		Camera* camera;
+		float z_scale, z_bias;	//slice = log(depth) * z_scale + z_bias
+
+		GLuint grid_buffer, grid_texture;
+		GLuint items_buffer, items_texture;
+
+		bool computeRange(LightEntity* light, sRange& range);
+		void upload();
+	};
+
+};
@@ -21,6 +21,7 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 inline float clamp(float v, float a, float b) { return v < a ? a : (v > b ? b : v); }
 inline float lerp(float a, float b, float v ) { return a*(1.0f-v) + b*v; }
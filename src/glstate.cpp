@@ -0,0 +1,163 @@
+#include "glstate.h"
+#include "shader.h"
+#include "texture.h"
+
+int GLState::num_issued = 0;
+int GLState::num_skipped = 0;
+
+int GLState::active_slot = GLState::UNKNOWN;
+int GLState::textures[GLState::max_texture_slots];
+int GLState::texture_types[GLState::max_texture_slots];
+int GLState::blend = GLState::UNKNOWN;
+int GLState::cull_face = GLState::UNKNOWN;
+int GLState::depth_test = GLState::UNKNOWN;
+int GLState::blend_src = GLState::UNKNOWN;
+int GLState::blend_dst = GLState::UNKNOWN;
+int GLState::depth_func = GLState::UNKNOWN;
+int GLState::vertex_array = GLState::UNKNOWN;
+int GLState::pass = 0;
+
+void GLState::invalidate()
+{
+	active_slot = UNKNOWN;
+	for (int i = 0; i < max_texture_slots; ++i)
+		textures[i] = texture_types[i] = UNKNOWN;
+	blend = cull_face = depth_test = UNKNOWN;
+	blend_src = blend_dst = UNKNOWN;
+	depth_func = UNKNOWN;
+	vertex_array = UNKNOWN;
+}
+
+void GLState::forgetActiveTexture()
+{
+	if (active_slot == UNKNOWN)
+		return;
+	textures[active_slot] = texture_types[active_slot] = UNKNOWN;
+}
+
+void GLState::forgetTexture(GLuint id)
+{
+	for (int i = 0; i < max_texture_slots; ++i)
+		if (textures[i] == (int)id)
+			textures[i] = texture_types[i] = UNKNOWN;
+}
+
+void GLState::bindTexture(int slot, Texture* texture)
+{
+	assert(texture);
+	//textures still streaming in are drawn white until their pixels are uploaded
+	if (texture->upload_pending)
+		texture = Texture::getWhiteTexture();
+	bindTexture(slot, texture->texture_type, texture->texture_id);
+}
+
+void GLState::bindTexture(int slot, GLenum type, GLuint id)
+{
+	assert(slot >= 0);
+
+	//slots out of range are not cached
+	if (slot >= max_texture_slots)
+	{
+		glActiveTexture(GL_TEXTURE0 + slot);
+		glBindTexture(type, id);
+		active_slot = UNKNOWN;
+		num_issued += 2;
+		return;
+	}
+
+	if (textures[slot] == id && texture_types[slot] == type)
+	{
+		num_skipped++;
+		return;
+	}
+
+	if (active_slot != slot)
+	{
+		glActiveTexture(GL_TEXTURE0 + slot);
+		active_slot = slot;
+		num_issued++;
+	}
+
+	glBindTexture(type, id);
+	textures[slot] = id;
+	texture_types[slot] = type;
+	num_issued++;
+}
+
+void GLState::setCapability(GLenum cap, bool enabled)
+{
+	int* state = NULL;
+	switch (cap)
+	{
+		case GL_BLEND: state = &blend; break;
+		case GL_CULL_FACE: state = &cull_face; break;
+		case GL_DEPTH_TEST: state = &depth_test; break;
+	}
+
+	if (state && *state == (int)enabled)
+	{
+		num_skipped++;
+		return;
+	}
+
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+	if (state)
+		*state = enabled;
+	num_issued++;
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+	if (blend_src == src && blend_dst == dst)
+	{
+		num_skipped++;
+		return;
+	}
+
+	glBlendFunc(src, dst);
+	blend_src = src;
+	blend_dst = dst;
+	num_issued++;
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (depth_func == func)
+	{
+		num_skipped++;
+		return;
+	}
+
+	glDepthFunc(func);
+	depth_func = func;
+	num_issued++;
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+	if (vertex_array == (int)vao)
+	{
+		num_skipped++;
+		return;
+	}
+
+	glBindVertexArray(vao);
+	vertex_array = vao;
+	num_issued++;
+}
+
+void GLState::nextPass()
+{
+	pass++;
+}
+
+bool GLState::needsPassUniforms(Shader* shader)
+{
+	if (shader->last_pass == pass)
+		return false;
+	shader->last_pass = pass;
+	return true;
+}
@@ -0,0 +1,57 @@
+/*  This caches the OpenGL state to skip redundant calls when submitting many draws.
+	The cache only knows what was set through it, call invalidate() after code that changes the state directly.
+*/
+
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+class Shader;
+class Texture;
+
+class GLState
+{
+public:
+	static const int max_texture_slots = 16;
+
+	//stats, reset every frame
+	static int num_issued;	//gl calls done
+	static int num_skipped;	//gl calls avoided because the state was already set
+	static void resetStats() { num_issued = num_skipped = 0; }
+
+	//forget everything, next calls will always reach GL
+	static void invalidate();
+	//the binding of the active texture unit was changed outside the cache
+	static void forgetActiveTexture();
+	//the texture is going to be deleted, GL unbinds it from every unit and may give its id to the next new one
+	static void forgetTexture(GLuint id);
+
+	static void bindTexture(int slot, Texture* texture);
+	static void bindTexture(int slot, GLenum type, GLuint id); //for textures not owned by a Texture (buffer textures, etc)
+	static void setCapability(GLenum cap, bool enabled); //only GL_BLEND, GL_CULL_FACE and GL_DEPTH_TEST are cached
+	static void blendFunc(GLenum src, GLenum dst);
+	static void depthFunc(GLenum func);
+	static void bindVertexArray(GLuint vao);
+
+	//per pass uniforms (camera, etc) only need to be uploaded once per program and pass
+	static void nextPass();
+	static bool needsPassUniforms(Shader* shader);
+
+	//used by Shader::enable
+	static void programChanged(bool changed) { changed ? num_issued++ : num_skipped++; }
+
+private:
+	enum { UNKNOWN = -1 };
+
+	static int active_slot;
+	static int textures[max_texture_slots];		//texture_id bound in every slot
+	static int texture_types[max_texture_slots];
+	static int blend, cull_face, depth_test;
+	static int blend_src, blend_dst;
+	static int depth_func;
+	static int vertex_array;
+	static int pass;
+};
+
+#endif
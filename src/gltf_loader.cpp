@@ -10,11 +10,13 @@
 #include "material.h"
 #include "prefab.h"
 #include "utils.h"
+#include "bcn.h"
 
 #include <iostream>
+#include <atomic>
 
 //** PARSING GLTF IS UGLY
-std::string base_folder;
+thread_local std::string base_folder; //per thread, prefabs can be loaded by several Loader threads at once
 
 #ifdef _DEBUG2
 	bool load_textures = false; //must textures be loadead?
@@ -22,122 +24,102 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//reads the elements of an accessor as floats into dst, one element every dst_stride bytes
+//float accessors are copied as they are, normalized and integer ones are converted, sparse values are applied at the end
+bool parseGLTFBufferFloats(cgltf_accessor* acc, int num_components, void* dst, int dst_stride)
 {
-	int i = 0;
-
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
+	if (cgltf_num_components(acc->type) != num_components)
 	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector3> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
-	if (acc->stride == sizeof(Vector3))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector3));
-			data += acc->stride;
-		}
+		std::cout << "accessor with " << cgltf_num_components(acc->type) << " components, expected " << num_components << std::endl;
+		return false;
 	}
 
-	if (!indices_acc)
+	int num_elements = (int)acc->count;
+	int element_size = num_components * sizeof(float);
+	unsigned char* output = (unsigned char*)dst;
+
+	//sparse accessors can have no buffer view, then the base values are zero
+	if (!acc->buffer_view)
 	{
-		container = unindexed;
-		return;
+		for (int i = 0; i < num_elements; ++i)
+			memset(output + i * dst_stride, 0, element_size);
 	}
-
-	container.resize(indices_acc->count);
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+	else
 	{
-		int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		assert(acc->buffer_view->buffer->data);
+		unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
+		if (acc->component_type == cgltf_component_type_r_32f)
 		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
+			if (acc->stride == element_size && dst_stride == element_size)
+				memcpy(output, data, num_elements * element_size);
+			else
+				for (int i = 0; i < num_elements; ++i)
+					memcpy(output + i * dst_stride, data + i * acc->stride, element_size);
 		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
 		else
-			std::cout << "index out of bounds:" << index << std::endl;
-	}
-}
-
-void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
-{
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector2> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
-	if (acc->stride == sizeof(Vector2))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector2));
-			data += acc->stride;
+			cgltf_accessor dense = *acc;
+			dense.is_sparse = false;
+			for (int i = 0; i < num_elements; ++i)
+				cgltf_accessor_read_float(&dense, i, (float*)(output + i * dst_stride), num_components);
 		}
 	}
 
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
-
-	container.resize(indices_acc->count);
-
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+	if (!acc->is_sparse)
+		return true;
+
+	//the sparse values are tightly packed, with the component type of the accessor
+	cgltf_accessor_sparse& sparse = acc->sparse;
+	unsigned char* indices = (unsigned char*)sparse.indices_buffer_view->buffer->data + sparse.indices_buffer_view->offset + sparse.indices_byte_offset;
+	cgltf_accessor values = *acc;
+	values.is_sparse = false;
+	values.buffer_view = sparse.values_buffer_view;
+	values.offset = sparse.values_byte_offset;
+	values.stride = cgltf_calc_size(acc->type, acc->component_type);
+	for (int i = 0; i < sparse.count; ++i)
 	{
 		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		switch (sparse.indices_component_type)
 		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+		case cgltf_component_type_r_8u: index = indices[i]; break;
+		case cgltf_component_type_r_16u: index = ((unsigned short*)indices)[i]; break;
+		case cgltf_component_type_r_32u: index = ((unsigned int*)indices)[i]; break;
+		default:
+			std::cout << "sparse indices with an invalid component type" << std::endl;
+			return false;
 		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
+		if (index < num_elements)
+			cgltf_accessor_read_float(&values, i, (float*)(output + index * dst_stride), num_components);
 		else
-			std::cout << "index out of bounds:" << index << std::endl;
+			std::cout << "sparse index out of bounds:" << index << std::endl;
 	}
+	return true;
+}
 
+template<typename T> void parseGLTFBuffer(std::vector<T>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (!acc->count || !parseGLTFBufferFloats(acc, sizeof(T) / sizeof(float), &container[0], sizeof(T)))
+		container.clear();
 }
 
 void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
 {
 	container.resize(acc->count);
+	if (!acc->count)
+		return;
 	unsigned int *final_indices = (unsigned int*)&container[0];
 
-	assert(acc->sparse.count == 0); //sparse not supported yet
+	assert(acc->sparse.count == 0); //sparse indices are not allowed by the spec
 
 	unsigned char* indices = (unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
 	int stride = acc->stride;
+	if (acc->component_type == cgltf_component_type_r_32u && stride == sizeof(unsigned int))
+	{
+		memcpy(final_indices, indices, acc->count * sizeof(unsigned int));
+		return;
+	}
+
 	for (int i = 0; i < acc->count; ++i)
 	{
 		unsigned int index = 0;
@@ -180,40 +162,90 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 		mesh = new Mesh();
 
         //streams
+		cgltf_accessor* positions = NULL;
+		cgltf_accessor* normals = NULL;
+		cgltf_accessor* uvs = NULL;
+		cgltf_accessor* uvs1 = NULL;
 		for (int j = 0; j < primitive->attributes_count; ++j)
 		{
 			cgltf_attribute* attr = &primitive->attributes[j];
-
-            //std::string attrname = attr->name;
 			if (attr->type == cgltf_attribute_type_position)
+				positions = attr->data;
+			else if (attr->type == cgltf_attribute_type_normal)
+				normals = attr->data;
+			else if (attr->type == cgltf_attribute_type_texcoord)
 			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+				if (strcmp(attr->name, "TEXCOORD_1") == 0) //secondary UV set
+					uvs1 = attr->data;
 				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
+					uvs = attr->data;
 			}
+		}
+
+		//nothing to render, the slot is kept so the results match the primitives
+		if (!positions)
+		{
+			delete mesh;
+			result.push_back(NULL);
+			continue;
+		}
+
+		//when the mesh will be interleaved anyway the streams are read straight into the interleaved layout
+		bool interleaved = false;
+		if (Mesh::interleave_meshes && normals && uvs && normals->count == positions->count && uvs->count == positions->count &&
+			cgltf_num_components(positions->type) == 3 && cgltf_num_components(normals->type) == 3 && cgltf_num_components(uvs->type) == 2)
+		{
+			mesh->interleaved.resize(positions->count);
+			Mesh::tInterleaved* dst = &mesh->interleaved[0];
+			interleaved = parseGLTFBufferFloats(positions, 3, &dst->vertex, sizeof(Mesh::tInterleaved)) &&
+				parseGLTFBufferFloats(normals, 3, &dst->normal, sizeof(Mesh::tInterleaved)) &&
+				parseGLTFBufferFloats(uvs, 2, &dst->uv, sizeof(Mesh::tInterleaved));
+			//a malformed accessor, the streams are read apart and the ones that fail are left empty
+			if (!interleaved)
+				mesh->interleaved.clear();
+		}
+		if (!interleaved)
+		{
+			parseGLTFBuffer(mesh->vertices, positions);
+			if (normals)
+				parseGLTFBuffer(mesh->normals, normals);
+			if (uvs)
+				parseGLTFBuffer(mesh->uvs, uvs);
+		}
+		if (uvs1)
+			parseGLTFBuffer(mesh->m_uvs1, uvs1);
+
+		//the positions could not be read
+		if (mesh->interleaved.empty() && mesh->vertices.empty())
+		{
+			delete mesh;
+			result.push_back(NULL);
+			continue;
+		}
+
+		if (positions->has_min && positions->has_max)
+		{
+			mesh->aabb_min = positions->min;
+			mesh->aabb_max = positions->max;
+			mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+			mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+		}
+		else
+			mesh->updateBoundingBox();
 
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+		//the index buffer is kept as it is, 16 bits indices are restored when uploading
+		if (primitive->indices && primitive->indices->count)
+			parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+
+		//exporters often split vertices that are equal
+		if (Mesh::weld_meshes)
+		{
+			int num_vertices = mesh->getNumVertices();
+			int num_welded = mesh->weldVertices();
+			stdlog(std::string("\t\tWELD ") + std::to_string(num_vertices) + " -> " + std::to_string(num_welded));
 		}
-		mesh->uploadToVRAM();
+		//the mesh is not modified after this, so it can be uploaded later by the main thread
+		mesh->streamToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -222,9 +254,9 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 	return result;
 }
 
-int GLTF_TEXTURE_LAST_ID = 1;
+std::atomic<int> GLTF_TEXTURE_LAST_ID(1);
 
-Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+Texture* parseGLTFTexture(cgltf_image* image, const char* filename, bool normal_map = false)
 {
 	if (!load_textures || !image )
 		return NULL;
@@ -232,7 +264,7 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return Texture::Get((std::string(base_folder) + "/" + image->uri).c_str());
+		return Texture::Get((std::string(base_folder) + "/" + image->uri).c_str(), true, true, normal_map);
 	else
 	if (filename)
 	{
@@ -250,27 +282,38 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 
 	if (image->buffer_view)
 	{
-		Image img;
+		Image* img = new Image();
 		std::vector<unsigned char> buffer;
 		buffer.resize(image->buffer_view->size);
 		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
 
 		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
+			img->loadPNG(buffer);
 		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
+			img->loadJPG(buffer);
 		else
 		{
 			stdlog(std::string("image format not supported: ") + image->mime_type);
+			delete img;
 			return NULL;
 		}
-		if (!img.width)
+		if (!img->width)
 		{
 			stdlog(std::string("image encoding has error: ") + image->mime_type);
+			delete img;
 			return NULL;
 		}
 		Texture* tex = new Texture();
-		tex->loadFromImage(&img);
+		//embedded images have no file to cook, they are compressed here (and kept compressed in the .pbin)
+		if (Texture::compress_textures)
+		{
+			CompressedImage* compressed = new CompressedImage();
+			compressed->compress(img, chooseBlockFormat(img, normal_map));
+			delete img;
+			tex->streamFromCompressed(compressed);
+		}
+		else
+			tex->streamFromImage(img);
 		if (filename)
 		{
 			tex->setName(fullpath.c_str());
@@ -293,8 +336,6 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 		return material;
 
 	material = new GTR::Material();
-	if (matdata->name)
-		material->registerMaterial(matdata->name);
 
 	material->alpha_mode = (GTR::eAlphaMode)matdata->alpha_mode;
 	material->alpha_cutoff = matdata->alpha_cutoff;
@@ -303,7 +344,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	//normalmap
 	if (matdata->normal_texture.texture)
 	{
-		material->normal_texture.texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
+		material->normal_texture.texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name, true);
 		material->normal_texture.uv_channel = matdata->normal_texture.texcoord;
 	}
 
@@ -349,6 +390,9 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 		material->occlusion_texture.uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
+	//registered once filled, other threads could be parsing the same material
+	if (matdata->name)
+		material = GTR::Material::GetOrRegister(matdata->name, material);
 	return material;
 }
 
@@ -442,7 +486,7 @@ cgltf_result internalOpenFile(const struct cgltf_memory_options* memory_options,
     return cgltf_result_success;
 }
 
-std::vector<unsigned char> g_buffer;
+thread_local std::vector<unsigned char> g_buffer;
 
 cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_options, const struct cgltf_file_options* file_options, const char* path, cgltf_size* size, void** data)
 {
@@ -566,3 +610,28 @@ GTR::Prefab* loadGLTF(const char* filename)
 	return loadGLTF(filename, data, options);
 }
 
+bool getGLTFDependencies(const char* filename, std::vector<std::string>& files)
+{
+	cgltf_options options;
+	memset(&options, 0, sizeof(cgltf_options));
+	cgltf_data *data = NULL;
+
+	//only the json is parsed, buffers and images are not loaded
+	if (cgltf_parse_file(&options, filename, &data) != cgltf_result_success)
+		return false;
+
+	std::string folder = filename;
+	size_t pos = folder.rfind('/');
+	folder = pos == std::string::npos ? std::string(".") : folder.substr(0, pos);
+
+	//embedded data uris and the glb own chunk (no uri) are covered by the source file itself
+	for (int i = 0; i < data->buffers_count; ++i)
+		if (data->buffers[i].uri && strncmp(data->buffers[i].uri, "data:", 5) != 0)
+			files.push_back(folder + "/" + data->buffers[i].uri);
+	for (int i = 0; i < data->images_count; ++i)
+		if (data->images[i].uri && strncmp(data->images[i].uri, "data:", 5) != 0)
+			files.push_back(folder + "/" + data->images[i].uri);
+
+	cgltf_free(data);
+	return true;
+}
@@ -5,3 +5,6 @@
 GTR::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+
+//external files (buffers and images) referenced by the gltf, to know when a cached version is outdated
+bool getGLTFDependencies(const char* filename, std::vector<std::string>& files);
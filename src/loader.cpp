@@ -0,0 +1,218 @@
+#include "loader.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+static std::vector<std::thread> workers;
+static std::thread::id main_thread_id;
+static bool initialized = false;
+static bool stopping = false;
+
+static std::mutex mutex; //protects everything below
+static std::condition_variable jobs_available;
+static std::condition_variable main_wakeup; //a job finished or a task was queued
+static std::deque< std::function<void()> > jobs;
+static std::deque< std::function<void()> > tasks;
+static std::deque< std::pair<int, std::function<void()> > > uploads;
+static int num_running = 0;
+
+int Loader::upload_budget = 16 << 20;
+
+static void workerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		jobs_available.wait(lock, [] { return stopping || !jobs.empty(); });
+		if (jobs.empty())
+			return; //stopping
+
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		num_running++;
+		lock.unlock();
+
+		job();
+
+		lock.lock();
+		num_running--;
+		main_wakeup.notify_all();
+	}
+}
+
+void Loader::init(int num_threads)
+{
+	if (initialized)
+		return;
+
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+	main_thread_id = std::this_thread::get_id();
+	stopping = false;
+	initialized = true;
+	for (int i = 0; i < num_threads; ++i)
+		workers.push_back(std::thread(workerLoop));
+}
+
+void Loader::release()
+{
+	if (!initialized)
+		return;
+
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	jobs_available.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+	initialized = false;
+
+	//the uploads left are dropped, this is only called when closing
+	std::lock_guard<std::mutex> lock(mutex);
+	uploads.clear();
+}
+
+void Loader::run(const std::function<void()>& job)
+{
+	if (!initialized)
+	{
+		job();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	jobs.push_back(job);
+	jobs_available.notify_one();
+}
+
+bool Loader::isMainThread()
+{
+	return !initialized || std::this_thread::get_id() == main_thread_id;
+}
+
+void Loader::onMainThread(const std::function<void()>& task)
+{
+	if (isMainThread())
+	{
+		task();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	tasks.push_back(task);
+	main_wakeup.notify_all();
+}
+
+int Loader::processTasks()
+{
+	assert(isMainThread());
+
+	//only the tasks queued so far, the ones they queue wait for the next call
+	std::deque< std::function<void()> > pending;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.swap(tasks);
+	}
+	for (int i = 0; i < pending.size(); ++i)
+		pending[i]();
+	return (int)pending.size();
+}
+
+void Loader::wait()
+{
+	assert(isMainThread());
+	while (true)
+	{
+		processTasks();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (jobs.empty() && !num_running && tasks.empty())
+			return;
+		main_wakeup.wait(lock, [] { return !tasks.empty() || (jobs.empty() && !num_running); });
+	}
+}
+
+int Loader::numPendingJobs()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (int)jobs.size() + num_running;
+}
+
+void Loader::stream(int bytes, const std::function<void()>& upload)
+{
+	if (!initialized)
+	{
+		upload();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	uploads.push_back(std::make_pair(bytes, upload));
+}
+
+int Loader::processUploads(int max_bytes)
+{
+	assert(isMainThread());
+
+	int total = 0;
+	while (true)
+	{
+		std::pair<int, std::function<void()> > upload;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			//an upload bigger than the budget is done alone, otherwise it would never be done
+			if (uploads.empty() || (total && total + uploads.front().first > max_bytes))
+				break;
+			upload = uploads.front();
+			uploads.pop_front();
+		}
+		upload.second();
+		total += upload.first;
+	}
+	return total;
+}
+
+int Loader::numPendingUploads()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (int)uploads.size();
+}
+
+void Loader::finish()
+{
+	//an upload can start jobs and a job can queue uploads
+	wait();
+	while (numPendingUploads())
+	{
+		processUploads(INT_MAX);
+		wait();
+	}
+}
+
+bool LoadingSet::claim(std::unique_lock<std::mutex>& lock, const std::string& name)
+{
+	if (!names.count(name))
+	{
+		names.insert(name);
+		return true;
+	}
+	released.wait(lock, [this, &name] { return !names.count(name); });
+	return false;
+}
+
+void LoadingSet::release(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	names.erase(name);
+	released.notify_all();
+}
@@ -0,0 +1,57 @@
+/*  Loading of assets in background threads. The workers read and decode the files, everything that needs
+	OpenGL is sent to the main thread with onMainThread and done when it calls processTasks or wait.
+	Uploads to the GPU are streamed: they are queued with stream and the main thread does some every frame with
+	processUploads, within a budget of bytes, so loading a big scene doesn't stall a frame for hundreds of ms.
+	Without init everything runs in the calling thread, as before.
+*/
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <string>
+
+class Loader
+{
+public:
+	static void init(int num_threads = 0); //0 uses one thread per core, leaving one for the main thread
+	static void release(); //waits for the jobs and stops the threads
+
+	static void run(const std::function<void()>& job); //in a worker
+	static void onMainThread(const std::function<void()>& task); //now if called from the main thread, otherwise queued
+	static bool isMainThread();
+
+	//main thread only
+	static int processTasks(); //runs the tasks queued, returns how many
+	static void wait(); //until every job has finished, running the tasks they queue meanwhile
+	static int numPendingJobs();
+
+	//uploads, in the order they are queued
+	static int upload_budget; //bytes per frame
+	static void stream(int bytes, const std::function<void()>& upload); //any thread
+	static int processUploads(int max_bytes); //main thread, returns the bytes uploaded (at least one is done if any is queued)
+	static int numPendingUploads();
+	static void finish(); //main thread, waits for the jobs and does every upload, so everything queued is loaded
+};
+
+//names being loaded, so when several threads ask for the same asset only one loads it and the rest wait for it
+//the registry of loaded assets must be protected with the same mutex
+class LoadingSet
+{
+public:
+	std::mutex mutex;
+
+	//called with the mutex locked after checking the registry: true if the caller must load it,
+	//false if another thread was loading it (it waits until it is done, then check the registry again)
+	bool claim(std::unique_lock<std::mutex>& lock, const std::string& name);
+	void release(const std::string& name); //once it is loaded (or failed) and registered
+
+private:
+	std::set<std::string> names;
+	std::condition_variable released;
+};
+
+#endif
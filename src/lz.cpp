@@ -0,0 +1,140 @@
+#include "lz.h"
+
+#include <cstring>
+
+//every sequence is: token (literals length << 4 | match length - 4), [more literals length], literals, offset (2 bytes), [more match length]
+//lengths of 15 or more continue in the next bytes, adding them until one is not 255
+//the last sequence only has literals
+
+const int hash_bits = 14;
+const int min_match = 4;
+const int last_literals = 5; //the end of the data is always copied as literals
+const int max_offset = 65535;
+
+static void writeLength(std::vector<uint8>& dst, int length)
+{
+	while (length >= 255)
+	{
+		dst.push_back(255);
+		length -= 255;
+	}
+	dst.push_back((uint8)length);
+}
+
+static void writeSequence(std::vector<uint8>& dst, const uint8* literals, int num_literals, int offset, int match_length)
+{
+	int match_code = match_length ? match_length - min_match : 0;
+	dst.push_back((uint8)(((num_literals < 15 ? num_literals : 15) << 4) | (match_code < 15 ? match_code : 15)));
+	if (num_literals >= 15)
+		writeLength(dst, num_literals - 15);
+	dst.insert(dst.end(), literals, literals + num_literals);
+
+	if (!match_length)
+		return;
+	dst.push_back((uint8)(offset & 0xFF));
+	dst.push_back((uint8)(offset >> 8));
+	if (match_code >= 15)
+		writeLength(dst, match_code - 15);
+}
+
+int lzCompress(const uint8* src, int size, std::vector<uint8>& dst)
+{
+	dst.clear();
+	dst.reserve(size + size / 255 + 16);
+
+	//last position where every 4 bytes were seen
+	std::vector<int> table(1 << hash_bits, -1);
+
+	int anchor = 0; //first byte not written yet
+	int i = 0;
+	int limit = size - last_literals - min_match;
+	while (i < limit)
+	{
+		uint32 sequence;
+		memcpy(&sequence, src + i, 4);
+		uint32 hash = (sequence * 2654435761u) >> (32 - hash_bits);
+		int ref = table[hash];
+		table[hash] = i;
+
+		if (ref < 0 || i - ref > max_offset || memcmp(src + ref, src + i, min_match) != 0)
+		{
+			i++;
+			continue;
+		}
+
+		int length = min_match;
+		while (i + length < size - last_literals && src[ref + length] == src[i + length])
+			length++;
+
+		writeSequence(dst, src + anchor, i - anchor, i - ref, length);
+		i += length;
+		anchor = i;
+	}
+
+	writeSequence(dst, src + anchor, size - anchor, 0, 0);
+	return (int)dst.size();
+}
+
+static bool readLength(const uint8*& ip, const uint8* iend, int& length)
+{
+	int b;
+	do
+	{
+		if (ip >= iend)
+			return false;
+		b = *ip++;
+		//corrupt data could overflow it, a valid length is never near this
+		if (length > (1 << 30))
+			return false;
+		length += b;
+	} while (b == 255);
+	return true;
+}
+
+bool lzDecompress(const uint8* src, int size, uint8* dst, int dst_size)
+{
+	const uint8* ip = src;
+	const uint8* iend = src + size;
+	uint8* op = dst;
+	uint8* oend = dst + dst_size;
+
+	while (ip < iend)
+	{
+		int token = *ip++;
+
+		int num_literals = token >> 4;
+		if (num_literals == 15 && !readLength(ip, iend, num_literals))
+			return false;
+		if (num_literals > iend - ip || num_literals > oend - op)
+			return false;
+		memcpy(op, ip, num_literals);
+		op += num_literals;
+		ip += num_literals;
+
+		//last sequence
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - dst)
+			return false;
+
+		int length = token & 15;
+		if (length == 15 && !readLength(ip, iend, length))
+			return false;
+		length += min_match;
+		if (length > oend - op)
+			return false;
+
+		//byte by byte, the match can overlap the bytes it is writing
+		const uint8* match = op - offset;
+		for (int i = 0; i < length; ++i)
+			op[i] = match[i];
+		op += length;
+	}
+
+	return op == oend;
+}
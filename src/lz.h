@@ -0,0 +1,18 @@
+/*  Fast LZ77 compression, in the style of LZ4: runs of literals followed by matches of 4 bytes or more
+	inside a 64KB window. It is used by the MBIN chunks, it favours decompression speed over ratio.
+*/
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <vector>
+#include "framework.h"
+
+//compresses size bytes of src into dst, returns the compressed size (it can be bigger than size)
+int lzCompress(const uint8* src, int size, std::vector<uint8>& dst);
+
+//decompresses src into dst, that must have the exact size of the original data
+//returns false if the data is corrupt
+bool lzDecompress(const uint8* src, int size, uint8* dst, int dst_size);
+
+#endif
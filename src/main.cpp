@@ -15,8 +15,10 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "loader.h"
 
 #include <iostream> //to output
+#include <cstring>
 
 long last_time = 0; //this is used to calcule the elapsed time between frames
 
@@ -244,14 +246,33 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
+	//cook options of the MBIN files (see Mesh::bin_quantize and Mesh::bin_compress), anywhere in the command line,
+	//the bins and prefab bins written with other options are cooked again when the scene is loaded
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--bin-quantize") == 0)
+			Mesh::bin_quantize = true;
+		else if (strcmp(argv[i], "--bin-compress") == 0)
+			Mesh::bin_compress = true;
+	}
+
 	//launch the application (app is a global variable)
 	app = new Application(window_width, window_height, window);
 
 	//main loop, application gets inside here till user closes it
-	mainLoop(window);
+	//--check-sh only compares the projections of the irradiance probes, the exit code tells the result
+	//--frame-stats renders a few frames and prints the GL calls issued and skipped by the state cache
+	int exit_code = 0;
+	if (argc > 1 && strcmp(argv[1], "--check-sh") == 0)
+		exit_code = app->checkSHProjection() ? 0 : 1;
+	else if (argc > 1 && strcmp(argv[1], "--frame-stats") == 0)
+		app->printFrameStats(10);
+	else
+		mainLoop(window);
 
 	//save state and free memory
 	// Cleanup
+	Loader::release(); //before the GL context is gone, the jobs left may queue uploads
 	#ifndef SKIP_IMGUI
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplSDL2_Shutdown();
@@ -262,5 +283,5 @@ int main(int argc, char **argv)
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 
-	return 0;
+	return exit_code;
 }
@@ -4,38 +4,73 @@
 #include "includes.h"
 #include "texture.h"
 
+#include <mutex>
+
 using namespace GTR;
 
+std::atomic<int> Material::s_MaterialID(0);
 std::map<std::string, Material*> Material::sMaterials;
+static std::mutex materials_mutex; //materials are created also from the Loader threads
 
 Material* Material::Get(const char* name)
 {
 	assert(name);
+	std::lock_guard<std::mutex> lock(materials_mutex);
 	std::map<std::string, Material*>::iterator it = sMaterials.find(name);
 	if (it != sMaterials.end())
 		return it->second;
 	return NULL;
 }
 
+//settings that depend on the name, set before the material is visible to other threads
+static void applyNameSettings(Material* material, const char* name)
+{
+	// Ugly Hack for clouds sorting problem
+	if (!strcmp(name, "Clouds"))
+	{
+		material->_zMin = 0.9f;
+		material->_zMax = 1.0f;
+	}
+}
+
 void Material::registerMaterial(const char* name)
 {
 	this->name = name;
+	applyNameSettings(this, name);
+	std::lock_guard<std::mutex> lock(materials_mutex);
 	sMaterials[name] = this;
+}
 
-	// Ugly Hack for clouds sorting problem
-	if (!strcmp(name, "Clouds"))
+Material* Material::GetOrRegister(const char* name, Material* material)
+{
+	assert(name && material);
+	Material* existing = NULL;
 	{
-		_zMin = 0.9f;
-		_zMax = 1.0f;
+		std::lock_guard<std::mutex> lock(materials_mutex);
+		std::map<std::string, Material*>::iterator it = sMaterials.find(name);
+		if (it == sMaterials.end())
+		{
+			material->name = name;
+			applyNameSettings(material, name);
+			sMaterials[name] = material;
+			return material;
+		}
+		existing = it->second;
 	}
+
+	//another thread registered it first, this one was never visible (and has no name, so it doesnt touch the map)
+	if (existing != material)
+		delete material;
+	return existing;
 }
 
 Material::~Material()
 {
 	if (name.size())
 	{
+		std::lock_guard<std::mutex> lock(materials_mutex);
 		auto it = sMaterials.find(name);
-		if (it != sMaterials.end())
+		if (it != sMaterials.end() && it->second == this)
 			sMaterials.erase(it);
 	}
 }
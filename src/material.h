@@ -4,6 +4,7 @@
 #include <cassert>
 #include <map>
 #include <string>
+#include <atomic>
 
 //forward declaration
 class Mesh;
@@ -37,11 +38,17 @@ namespace GTR {
 	//this class contains all info relevant of how something must be rendered
 	class Material {
 	public:
+		static std::atomic<int> s_MaterialID;
+		int m_Id;
+
 		//static manager to reuse materials
 		static std::map<std::string, Material*> sMaterials;
 		static Material* Get(const char* name);
 		std::string name;
 		void registerMaterial(const char* name);
+		//registers the material (already filled) with that name in one step, so the Loader threads cannot create it twice;
+		//if there was one already it is returned and the one passed is deleted
+		static Material* GetOrRegister(const char* name, Material* material);
 
 		//parameters to control transparency
 		eAlphaMode alpha_mode;	//could be NO_ALPHA, MASK (alpha cut) or BLEND (alpha blend)
@@ -66,6 +73,7 @@ namespace GTR {
 
 		//ctors
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+			m_Id = s_MaterialID++;
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
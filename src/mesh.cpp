@@ -8,10 +8,18 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <functional>
 #include <sys/stat.h>
 
 #include "camera.h"
 #include "texture.h"
+#include "glstate.h"
+#include "lz.h"
+#include "meshopt.h"
+#include "loader.h"
 //#include "animation.h"
 #include "extra/coldet/coldet.h"
 
@@ -20,8 +28,13 @@
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::bin_quantize = false;		//positions, normals and uvs are quantized in the MBIN files (lossy, see mesh.h)
+bool Mesh::bin_compress = false;		//MBIN chunks are compressed when it makes them smaller (they cannot be mapped then)
+bool Mesh::weld_meshes = true;			//loaded meshes are welded into unique vertices and indices
+bool Mesh::optimize_meshes = true;		//indexed meshes are reordered for the vertex cache when imported
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+static std::mutex meshes_mutex; //for sMeshesLoaded, the glTF meshes are registered from the Loader threads
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 
@@ -34,6 +47,11 @@ Mesh::Mesh()
 {
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	indices_type = GL_UNSIGNED_INT;
+	vao_id = 0;
+	vao_instanced = false;
+	upload_pending = false;
+	mapped_file = NULL;
 	collision_model = NULL;
 
 	clear();
@@ -87,10 +105,17 @@ void Mesh::clear()
 	if (uvs1_vbo_id)
 		glDeleteBuffers(1, &uvs1_vbo_id);
     #endif
-
+	if (vao_id)
+	{
+		GLState::bindVertexArray(0);
+		glDeleteVertexArrays(1, &vao_id);
+	}
 
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	indices_type = GL_UNSIGNED_INT;
+	vao_id = 0;
+	vao_instanced = false;
 
 	//buffers
 	vertices.clear();
@@ -103,6 +128,10 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
+	unmapFile(mapped_file);
+	mapped_file = NULL;
+	memset(&mapped, 0, sizeof(mapped));
+
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
 }
@@ -117,6 +146,9 @@ int weights_location = -1;
 
 void Mesh::enableBuffers(Shader* sh)
 {
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
 	vertex_location = sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
@@ -265,7 +297,19 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert(getNumVertices() && "No vertices in this mesh");
+
+	//the attributes are already in the VAO, so it is just a bind and the draw
+	if (bindVAO())
+	{
+		drawCall(primitive, submesh_id, num_instances);
+		checkGLErrors();
+		return;
+	}
+
+	//not in VRAM, the arrays are sent every time (it must not change the state of another mesh VAO)
+	GLState::bindVertexArray(0);
+	loadStreams();
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -280,62 +324,104 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	checkGLErrors();
 }
 
-void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
+bool Mesh::bindVAO()
 {
-	int start = 0; //in primitives
-	int size = (int)vertices.size();
-	if (m_indices.size())
-		size = (int)m_indices.size();
+	if (!vertices_vbo_id && !interleaved_vbo_id)
+		return false;
+	if (!vao_id)
+		createVAO();
+	GLState::bindVertexArray(vao_id);
+	return true;
+}
+
+//sets one attribute reading from a VBO, the VAO must be bound
+static void setVAOAttribute(int location, unsigned int vbo, int size, GLenum type, int stride, int offset)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, size, type, GL_FALSE, stride, (void*)(size_t)offset);
+}
+
+void Mesh::createVAO()
+{
+	glGenVertexArrays(1, &vao_id);
+	GLState::bindVertexArray(vao_id);
+
+	//same layouts enableBuffers uses, but in the fixed locations of eAttribute
+	if (interleaved_vbo_id)
+	{
+		int spacing = sizeof(tInterleaved);
+		setVAOAttribute(A_VERTEX, interleaved_vbo_id, 3, GL_FLOAT, spacing, 0);
+		setVAOAttribute(A_NORMAL, interleaved_vbo_id, 3, GL_FLOAT, spacing, sizeof(Vector3));
+		setVAOAttribute(A_COORD, interleaved_vbo_id, 2, GL_FLOAT, spacing, sizeof(Vector3) + sizeof(Vector3));
+	}
 	else
-	if (interleaved.size())
-		size = (int)interleaved.size();
+	{
+		setVAOAttribute(A_VERTEX, vertices_vbo_id, 3, GL_FLOAT, 0, 0);
+		if (normals_vbo_id)
+			setVAOAttribute(A_NORMAL, normals_vbo_id, 3, GL_FLOAT, 0, 0);
+		if (uvs_vbo_id)
+			setVAOAttribute(A_COORD, uvs_vbo_id, 2, GL_FLOAT, 0, 0);
+	}
+	if (uvs1_vbo_id)
+		setVAOAttribute(A_COORD1, uvs1_vbo_id, 2, GL_FLOAT, 0, 0);
+	if (colors_vbo_id)
+		setVAOAttribute(A_COLOR, colors_vbo_id, 4, GL_FLOAT, 0, 0);
+	if (bones_vbo_id)
+		setVAOAttribute(A_BONES, bones_vbo_id, 4, GL_UNSIGNED_BYTE, 0, 0);
+	if (weights_vbo_id)
+		setVAOAttribute(A_WEIGHTS, weights_vbo_id, 4, GL_FLOAT, 0, 0);
+
+	//the index buffer binding is part of the VAO
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	vao_instanced = false;
+	checkGLErrors();
+}
+
+void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
+{
+	int start = 0; //in vertices, or in indices if the mesh is indexed
+	int size = (int)getNumVertices();
+	if (getNumIndices())
+		size = (int)getNumIndices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 
 	//DRAW
-	if (m_indices.size())
+	if (getNumIndices())
 	{
+		//the index buffer is bound by the VAO (or by enableBuffers)
+		size_t index_size = indices_type == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(unsigned int);
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			glDrawElementsInstanced(primitive, size, indices_type, (void*)(start * index_size), num_instances);
 		}
 		else
 		{
 			if (indices_vbo_id)
 			{
-				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-				}
+				glDrawElements(primitive, size, indices_type, (void *) (start * index_size));
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its an unsigned int pointer
 		}
 	}
 	else
 	{
 		if (num_instances > 0)
 		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		}
 		else
 			glDrawArrays(primitive, start, size);
@@ -355,53 +441,51 @@ void Mesh::disableBuffers(Shader* shader)
 	if (bones_location != -1) glDisableVertexAttribArray(bones_location);
 	if (weights_location != -1) glDisableVertexAttribArray(weights_location);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	checkGLErrors();
 }
 
 GLuint instances_buffer_id = 0;
 
-//should be faster but in some system it is slower
+//one draw for all the models, the shader must declare "in mat4 u_model" instead of the uniform
 void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
 {
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
+	assert(shader->getAttribLocation("u_model") == A_INSTANCE_MODEL && "shader must have attribute mat4 u_model (not a uniform)");
 
-		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
+	if (!bindVAO())
+	{
+		assert(0 && "instanced meshes must be uploaded to VRAM");
+		return;
+	}
 
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+	if (instances_buffer_id == 0)
+		glGenBuffers(1, &instances_buffer_id);
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	glBufferData(GL_ARRAY_BUFFER, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW);
 
+	//the VAO keeps pointing to the same buffer, so the attributes are only set once
+	//they stay enabled, programs without the attribute just ignore them
+	if (!vao_instanced)
+	{
 		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
 		for (int k = 0; k < 4; ++k)
 		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
+			glEnableVertexAttribArray(A_INSTANCE_MODEL + k);
+			glVertexAttribPointer(A_INSTANCE_MODEL + k, 4, GL_FLOAT, false, sizeof(Matrix44), (void*)(sizeof(float) * 4 * k));
+			glVertexAttribDivisor(A_INSTANCE_MODEL + k, 1); // This makes it instanced!
 		}
+		vao_instanced = true;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		//regular render
-		render(primitive, 0, num_instances);
-
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisor(attribLocation + k, 0);
-		}
-    #else
-		assert(0 && "not supported");
-    #endif
+	//the whole mesh
+	drawCall(primitive, -1, num_instances);
+	checkGLErrors();
 }
 
 //super obsolete rendering method, do not use
@@ -499,9 +583,17 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 #define GL_ARRAY_BUFFER_ARB GL_ARRAY_BUFFER
 #define GL_STATIC_DRAW_ARB GL_STATIC_DRAW
 
+//the data of a stream, straight from the file mapping or from the vector (the encoded chunks are decoded to them)
+template<class T> const T* streamData(const std::vector<T>& v, const T* mapped_stream, bool is_mapped)
+{
+	if (is_mapped && mapped_stream)
+		return mapped_stream;
+	return v.size() ? &v[0] : NULL;
+}
+
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	assert(getNumVertices());
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -509,13 +601,35 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	//the index buffer binding below would end up in the VAO that is bound
+	GLState::bindVertexArray(0);
+	//the buffers may change, the VAO is created again on the next render
+	if (vao_id)
+	{
+		glDeleteVertexArrays(1, &vao_id);
+		vao_id = 0;
+	}
+
+	bool is_mapped = mapped_file != NULL;
+	int num_vertices = getNumVertices();
+	int num_indices = getNumIndices();
+	const tInterleaved* interleaved_data = streamData(interleaved, mapped.interleaved, is_mapped);
+	const Vector3* vertices_data = streamData(vertices, mapped.vertices, is_mapped);
+	const Vector3* normals_data = streamData(normals, mapped.normals, is_mapped);
+	const Vector2* uvs_data = streamData(uvs, mapped.uvs, is_mapped);
+	const Vector2* uvs1_data = streamData(m_uvs1, mapped.uvs1, is_mapped);
+	const Vector4* colors_data = streamData(colors, mapped.colors, is_mapped);
+	const Vector4ub* bones_data = streamData(bones, mapped.bones, is_mapped);
+	const Vector4* weights_data = streamData(weights, mapped.weights, is_mapped);
+	const unsigned int* indices_data = streamData(m_indices, mapped.indices, is_mapped);
+
+	if (interleaved_data)
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
 			glGenBuffersARB(1, &interleaved_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(tInterleaved), interleaved_data, GL_STATIC_DRAW_ARB);
 	}
 	else
 	{
@@ -523,81 +637,139 @@ void Mesh::uploadToVRAM()
 		if (vertices_vbo_id == 0)
 			glGenBuffersARB(1, &vertices_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3), &vertices[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector3), vertices_data, GL_STATIC_DRAW_ARB);
 
 		// UVs
-		if (uvs.size())
+		if (uvs_data)
 		{
 			if (uvs_vbo_id == 0)
 				glGenBuffersARB(1, &uvs_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector2), uvs_data, GL_STATIC_DRAW_ARB);
 		}
 
 		// Normals
-		if (normals.size())
+		if (normals_data)
 		{
 			if (normals_vbo_id == 0)
 				glGenBuffersARB(1, &normals_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector3), normals_data, GL_STATIC_DRAW_ARB);
 		}
 	}
 
 	// UVs
-	if (m_uvs1.size())
+	if (uvs1_data)
 	{
 		if (uvs1_vbo_id == 0)
 			glGenBuffersARB(1, &uvs1_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, m_uvs1.size() * sizeof(Vector2), &m_uvs1[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector2), uvs1_data, GL_STATIC_DRAW_ARB);
 	}
 
 	// Colors
-	if (colors.size())
+	if (colors_data)
 	{
 		if (colors_vbo_id == 0)
 			glGenBuffersARB(1, &colors_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4), &colors[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector4), colors_data, GL_STATIC_DRAW_ARB);
 	}
 
-	if (bones.size())
+	if (bones_data)
 	{
 		if (bones_vbo_id == 0)
 			glGenBuffersARB(1, &bones_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector4ub), bones_data, GL_STATIC_DRAW_ARB);
 	}
-	if (weights.size())
+	if (weights_data)
 	{
 		if (weights_vbo_id == 0)
 			glGenBuffersARB(1, &weights_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4), &weights[0], GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_vertices * sizeof(Vector4), weights_data, GL_STATIC_DRAW_ARB);
 	}
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
-	if (m_indices.size())
+	if (indices_data)
 	{
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+		//16 bits are enough for most meshes and take half the memory
+		if (num_vertices <= 65536)
+		{
+			std::vector<uint16> indices16(indices_data, indices_data + num_indices);
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(uint16), &indices16[0], GL_STATIC_DRAW_ARB);
+			indices_type = GL_UNSIGNED_SHORT;
+		}
+		else
+		{
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(unsigned int), indices_data, GL_STATIC_DRAW_ARB);
+			indices_type = GL_UNSIGNED_INT;
+		}
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
+	upload_pending = false;
 
 	checkGLErrors();
 	//clear buffers to save memory
 }
 
+void Mesh::streamToVRAM()
+{
+	assert(!mapped_file && "mapped meshes are uploaded directly");
+
+	//the renderer skips it until the main thread uploads it, within the budget of a frame
+	upload_pending = true;
+	int bytes = (int)(interleaved.size() * sizeof(tInterleaved) + vertices.size() * sizeof(Vector3) + normals.size() * sizeof(Vector3) +
+		uvs.size() * sizeof(Vector2) + m_uvs1.size() * sizeof(Vector2) + colors.size() * sizeof(Vector4) +
+		bones.size() * sizeof(Vector4ub) + weights.size() * sizeof(Vector4) + m_indices.size() * sizeof(unsigned int));
+	Loader::stream(bytes, [this]() { uploadToVRAM(); });
+}
+
+void Mesh::loadStreams()
+{
+	if (!mapped_file)
+		return;
+
+	int n = mapped.num_vertices;
+	if (mapped.interleaved)
+		interleaved.assign(mapped.interleaved, mapped.interleaved + n);
+	if (mapped.vertices)
+		vertices.assign(mapped.vertices, mapped.vertices + n);
+	if (mapped.normals)
+		normals.assign(mapped.normals, mapped.normals + n);
+	if (mapped.uvs)
+		uvs.assign(mapped.uvs, mapped.uvs + n);
+	if (mapped.uvs1)
+		m_uvs1.assign(mapped.uvs1, mapped.uvs1 + n);
+	if (mapped.colors)
+		colors.assign(mapped.colors, mapped.colors + n);
+	if (mapped.bones)
+		bones.assign(mapped.bones, mapped.bones + n);
+	if (mapped.weights)
+		weights.assign(mapped.weights, mapped.weights + n);
+	if (mapped.indices)
+		m_indices.assign(mapped.indices, mapped.indices + mapped.num_indices);
+
+	//the vectors own the data now
+	unmapFile(mapped_file);
+	mapped_file = NULL;
+	memset(&mapped, 0, sizeof(mapped));
+}
+
 bool Mesh::createCollisionModel(bool is_static)
 {
 	if (collision_model)
 		return true;
 
+	//it needs the triangles in the CPU
+	loadStreams();
+
 	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
 
 	if (m_indices.size()) //indexed
@@ -714,6 +886,10 @@ bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vec
 
 bool Mesh::interleaveBuffers()
 {
+	if (mapped_file && mapped.interleaved)
+		return true; //already interleaved in the file
+	loadStreams();
+
 	if (!vertices.size() || !normals.size() || !uvs.size())
 		return false;
 
@@ -735,6 +911,186 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+//a vertex stream seen as raw bytes, to hash and compare vertices whatever their attributes
+struct sWeldStream {
+	uint8* data;
+	int stride;
+};
+
+template<typename T> static void addWeldStream(std::vector<sWeldStream>& streams, std::vector<T>& stream, int num_vertices)
+{
+	if (stream.size() != num_vertices)
+		return;
+	sWeldStream s = { (uint8*)&stream[0], (int)sizeof(T) };
+	streams.push_back(s);
+}
+
+template<typename T> static void resizeWeldStream(std::vector<T>& stream, int num_vertices, int num_unique)
+{
+	if (stream.size() == num_vertices)
+		stream.resize(num_unique);
+}
+
+static inline uint32 hashWeldVertex(const std::vector<sWeldStream>& streams, int index)
+{
+	uint32 h = 2166136261u;
+	for (int i = 0; i < streams.size(); ++i)
+	{
+		const uint8* data = streams[i].data + index * streams[i].stride;
+		for (int j = 0; j < streams[i].stride; ++j)
+			h = (h ^ data[j]) * 16777619u;
+	}
+	return h;
+}
+
+static inline bool equalWeldVertex(const std::vector<sWeldStream>& streams, int a, int b)
+{
+	for (int i = 0; i < streams.size(); ++i)
+	{
+		int stride = streams[i].stride;
+		if (memcmp(streams[i].data + a * stride, streams[i].data + b * stride, stride) != 0)
+			return false;
+	}
+	return true;
+}
+
+int Mesh::weldVertices()
+{
+	loadStreams();
+
+	int num_vertices = (int)getNumVertices();
+	if (!num_vertices)
+		return 0;
+
+	std::vector<sWeldStream> streams;
+	addWeldStream(streams, interleaved, num_vertices);
+	addWeldStream(streams, vertices, num_vertices);
+	addWeldStream(streams, normals, num_vertices);
+	addWeldStream(streams, uvs, num_vertices);
+	addWeldStream(streams, m_uvs1, num_vertices);
+	addWeldStream(streams, colors, num_vertices);
+	addWeldStream(streams, bones, num_vertices);
+	addWeldStream(streams, weights, num_vertices);
+
+	//open addressing table with the welded index of every different value
+	int table_size = 1;
+	while (table_size < num_vertices * 2)
+		table_size <<= 1;
+	std::vector<int> table(table_size, -1);
+	std::vector<unsigned int> remap(num_vertices);
+	int num_unique = 0;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		uint32 slot = hashWeldVertex(streams, i) & (table_size - 1);
+		while (table[slot] != -1 && !equalWeldVertex(streams, table[slot], i))
+			slot = (slot + 1) & (table_size - 1);
+
+		if (table[slot] != -1)
+		{
+			remap[i] = table[slot];
+			continue;
+		}
+
+		//new vertex, moved to its final place (never after i, so it doesn't overwrite unread vertices)
+		table[slot] = num_unique;
+		remap[i] = num_unique;
+		if (num_unique != i)
+			for (int j = 0; j < streams.size(); ++j)
+				memcpy(streams[j].data + num_unique * streams[j].stride, streams[j].data + i * streams[j].stride, streams[j].stride);
+		num_unique++;
+	}
+
+	if (m_indices.size())
+	{
+		for (int i = 0; i < m_indices.size(); ++i)
+			m_indices[i] = remap[m_indices[i]];
+	}
+	else
+		m_indices.swap(remap);
+
+	resizeWeldStream(interleaved, num_vertices, num_unique);
+	resizeWeldStream(vertices, num_vertices, num_unique);
+	resizeWeldStream(normals, num_vertices, num_unique);
+	resizeWeldStream(uvs, num_vertices, num_unique);
+	resizeWeldStream(m_uvs1, num_vertices, num_unique);
+	resizeWeldStream(colors, num_vertices, num_unique);
+	resizeWeldStream(bones, num_vertices, num_unique);
+	resizeWeldStream(weights, num_vertices, num_unique);
+
+	//the collision model used the old vertices
+	if (collision_model)
+	{
+		delete (CollisionModel3D*)collision_model;
+		collision_model = NULL;
+	}
+
+	return num_unique;
+}
+
+template<typename T> static void remapStream(std::vector<T>& stream, const std::vector<unsigned int>& remap)
+{
+	if (stream.size() != remap.size())
+		return;
+	std::vector<T> result(stream.size());
+	for (int i = 0; i < stream.size(); ++i)
+		result[remap[i]] = stream[i];
+	stream.swap(result);
+}
+
+void Mesh::optimizeIndices()
+{
+	loadStreams();
+	int num_vertices = (int)getNumVertices();
+	if (!m_indices.size() || !num_vertices)
+		return;
+
+	std::vector<Vector3> positions;
+	if (interleaved.size())
+	{
+		positions.resize(interleaved.size());
+		for (int i = 0; i < interleaved.size(); ++i)
+			positions[i] = interleaved[i].vertex;
+	}
+	const Vector3* positions_data = vertices.size() ? &vertices[0] : &positions[0];
+
+	//every submesh on its own so their ranges stay the same
+	std::vector<sSubmeshInfo> ranges = submeshes;
+	int total = 0;
+	for (int i = 0; i < ranges.size(); ++i)
+		total += ranges[i].length;
+	if (!ranges.size() || total != m_indices.size())
+	{
+		ranges.resize(1);
+		ranges[0].start = 0;
+		ranges[0].length = (int)m_indices.size();
+	}
+
+	for (int i = 0; i < ranges.size(); ++i)
+	{
+		unsigned int* indices = &m_indices[0] + ranges[i].start;
+		int num_indices = ranges[i].length - ranges[i].length % 3;
+		optimizeVertexCache(indices, num_indices, num_vertices);
+		optimizeOverdraw(indices, num_indices, positions_data, num_vertices);
+	}
+
+	std::vector<unsigned int> remap;
+	optimizeVertexFetch(&m_indices[0], (int)m_indices.size(), num_vertices, remap);
+	remapStream(interleaved, remap);
+	remapStream(vertices, remap);
+	remapStream(normals, remap);
+	remapStream(uvs, remap);
+	remapStream(m_uvs1, remap);
+	remapStream(colors, remap);
+	remapStream(bones, remap);
+	remapStream(weights, remap);
+
+	if (collision_model)
+	{
+		delete (CollisionModel3D*)collision_model;
+		collision_model = NULL;
+	}
+}
+
 typedef struct 
 {
 	int version;
@@ -750,111 +1106,458 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int options; //eBinOptions it was written with, 0 in the older ones
+	char extra[28]; //unused
 } sMeshInfo;
 
-bool Mesh::readBin(const char* filename, bool bFromNetwork)
+//since v12 every stream goes in its own chunk after the header, readers skip the types they don't know
+typedef struct
 {
-	FILE *f;
-	assert(filename);
+	char type[4];
+	int encoding; //eChunkEncoding
+	int bytes; //size of the encoded data
+	int compressed_bytes; //size in the file if it is compressed with lzCompress, 0 if it is not
+} sMeshChunk;
+
+enum eChunkEncoding {
+	CHUNK_RAW,			//same as in memory
+	CHUNK_POSITION_Q16,	//aabb min and max (2 Vector3) followed by 3 uint16 per vertex relative to them
+	CHUNK_NORMAL_OCT16,	//2 int16 per vertex, octahedral encoding
+	CHUNK_HALF,			//every float as a half float
+	CHUNK_INDEX_U16		//uint16 indices
+};
+
+static uint16 floatToHalf(float f)
+{
+	uint32 x;
+	memcpy(&x, &f, 4);
+	uint32 sign = (x >> 16) & 0x8000;
+	int exponent = (int)((x >> 23) & 0xFF) - 127 + 15;
+	uint32 mantissa = x & 0x7FFFFF;
+
+	if (((x >> 23) & 0xFF) == 0xFF) //inf or nan
+		return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31) //too big
+		return sign | 0x7C00;
+	if (exponent <= 0) //subnormal
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32 half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+	uint32 half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //round, a carry to the exponent is still right
+		half++;
+	return half;
+}
 
-	struct stat stbuffer;
+static float halfToFloat(uint16 h)
+{
+	uint32 sign = (h & 0x8000) << 16;
+	int exponent = (h >> 10) & 0x1F;
+	uint32 mantissa = h & 0x3FF;
+	uint32 x;
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
-		return false;
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+			x = sign;
+		else //subnormal, normalize it
+		{
+			exponent = 1;
+			while (!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			mantissa &= 0x3FF;
+			x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+		}
+	}
+	else if (exponent == 31)
+		x = sign | 0x7F800000 | (mantissa << 13);
+	else
+		x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
 
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+static void encodeOctahedral(const Vector3& n, int16* out)
+{
+	float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 == 0)
 	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
-		return false;
+		out[0] = out[1] = 0;
+		return;
+	}
+	float x = n.x / l1;
+	float y = n.y / l1;
+	//the lower hemisphere is folded over the diagonals
+	if (n.z < 0)
+	{
+		float ox = x;
+		x = (1.0f - fabs(y)) * (ox >= 0 ? 1.0f : -1.0f);
+		y = (1.0f - fabs(ox)) * (y >= 0 ? 1.0f : -1.0f);
 	}
+	out[0] = (int16)floor(clamp(x, -1, 1) * 32767.0f + 0.5f);
+	out[1] = (int16)floor(clamp(y, -1, 1) * 32767.0f + 0.5f);
+}
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+static Vector3 decodeOctahedral(const int16* in)
+{
+	float x = std::max(in[0] / 32767.0f, -1.0f);
+	float y = std::max(in[1] / 32767.0f, -1.0f);
+	float z = 1.0f - fabs(x) - fabs(y);
+	if (z < 0)
+	{
+		float ox = x;
+		x = (1.0f - fabs(y)) * (ox >= 0 ? 1.0f : -1.0f);
+		y = (1.0f - fabs(ox)) * (y >= 0 ? 1.0f : -1.0f);
+	}
+	Vector3 n(x, y, z);
+	n.normalize();
+	return n;
+}
+
+static void writeChunk(FILE* f, const char* type, int encoding, const void* data, int bytes)
+{
+	sMeshChunk chunk;
+	memcpy(chunk.type, type, 4);
+	chunk.encoding = encoding;
+	chunk.bytes = bytes;
+	chunk.compressed_bytes = 0;
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+	//only kept compressed if it saves something
+	std::vector<uint8> compressed;
+	if (Mesh::bin_compress && bytes > 64)
 	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
-		return false;
+		int size = lzCompress((const uint8*)data, bytes, compressed);
+		if (size < bytes - bytes / 8)
+			chunk.compressed_bytes = size;
+	}
+
+	int stored = chunk.compressed_bytes ? chunk.compressed_bytes : bytes;
+	fwrite(&chunk, sizeof(sMeshChunk), 1, f);
+	fwrite(chunk.compressed_bytes ? (const void*)&compressed[0] : data, stored, 1, f);
+
+	//chunks are 4 bytes aligned
+	static const char padding[4] = { 0, 0, 0, 0 };
+	if (stored % 4)
+		fwrite(padding, 4 - stored % 4, 1, f);
+}
+
+//float streams stored raw or as half floats
+template<class T> static void writeFloatChunk(FILE* f, const char* type, const std::vector<T>& v, bool half)
+{
+	if (!half)
+	{
+		writeChunk(f, type, CHUNK_RAW, &v[0], (int)(v.size() * sizeof(T)));
+		return;
 	}
+	int num_floats = (int)(v.size() * sizeof(T) / sizeof(float));
+	const float* src = (const float*)&v[0];
+	std::vector<uint16> encoded(num_floats);
+	for (int i = 0; i < num_floats; ++i)
+		encoded[i] = floatToHalf(src[i]);
+	writeChunk(f, type, CHUNK_HALF, &encoded[0], num_floats * sizeof(uint16));
+}
+
+//decodes a chunk into its stream, false if the size or the encoding don't match
+static bool readChunk(Mesh* mesh, const sMeshChunk& chunk, const uint8* data, int num_vertices, int num_indices)
+{
+	std::string type(chunk.type, 4);
 
-	if (info.streams[0] == 'I')
+	if (type == "POS " || type == "NORM" || type == "UV0 " || type == "UV1 ")
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		bool uv = type == "UV0 " || type == "UV1 ";
+		std::vector<Vector3>& v3 = type == "POS " ? mesh->vertices : mesh->normals;
+		std::vector<Vector2>& v2 = type == "UV0 " ? mesh->uvs : mesh->m_uvs1;
+		int num_floats = num_vertices * (uv ? 2 : 3);
+		float* dst = NULL;
+		if (uv)
+		{
+			v2.resize(num_vertices);
+			dst = num_vertices ? &v2[0].x : NULL;
+		}
+		else
+		{
+			v3.resize(num_vertices);
+			dst = num_vertices ? &v3[0].x : NULL;
+		}
+
+		if (chunk.encoding == CHUNK_RAW && chunk.bytes == num_floats * (int)sizeof(float))
+			memcpy(dst, data, chunk.bytes);
+		else if (chunk.encoding == CHUNK_HALF && chunk.bytes == num_floats * (int)sizeof(uint16))
+		{
+			const uint16* src = (const uint16*)data;
+			for (int i = 0; i < num_floats; ++i)
+				dst[i] = halfToFloat(src[i]);
+		}
+		else if (type == "POS " && chunk.encoding == CHUNK_POSITION_Q16 && chunk.bytes == 2 * sizeof(Vector3) + num_floats * (int)sizeof(uint16))
+		{
+			Vector3 min, max;
+			memcpy(&min, data, sizeof(Vector3));
+			memcpy(&max, data + sizeof(Vector3), sizeof(Vector3));
+			Vector3 scale = (max - min) * (1.0f / 65535.0f);
+			const uint16* src = (const uint16*)(data + 2 * sizeof(Vector3));
+			for (int i = 0; i < num_vertices; ++i, src += 3)
+				v3[i].set(min.x + src[0] * scale.x, min.y + src[1] * scale.y, min.z + src[2] * scale.z);
+		}
+		else if (type == "NORM" && chunk.encoding == CHUNK_NORMAL_OCT16 && chunk.bytes == num_vertices * 2 * (int)sizeof(int16))
+		{
+			const int16* src = (const int16*)data;
+			for (int i = 0; i < num_vertices; ++i, src += 2)
+				v3[i] = decodeOctahedral(src);
+		}
+		else
+			return false;
 	}
-	else if (info.streams[0] == 'V')
+	else if (type == "IDX ")
 	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		mesh->m_indices.resize(num_indices);
+		if (chunk.encoding == CHUNK_RAW && chunk.bytes == num_indices * (int)sizeof(unsigned int))
+			memcpy(&mesh->m_indices[0], data, chunk.bytes);
+		else if (chunk.encoding == CHUNK_INDEX_U16 && chunk.bytes == num_indices * (int)sizeof(uint16))
+		{
+			const uint16* src = (const uint16*)data;
+			for (int i = 0; i < num_indices; ++i)
+				mesh->m_indices[i] = src[i];
+		}
+		else
+			return false;
 	}
-
-	if (info.streams[1] == 'N')
+	else if (type == "COL " && chunk.bytes == num_vertices * (int)sizeof(Vector4))
 	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		mesh->colors.resize(num_vertices);
+		memcpy(&mesh->colors[0], data, chunk.bytes);
 	}
-
-	if (info.streams[2] == 'U')
+	else if (type == "BONE" && chunk.bytes == num_vertices * (int)sizeof(Vector4ub))
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		mesh->bones.resize(num_vertices);
+		memcpy(&mesh->bones[0], data, chunk.bytes);
 	}
-
-	if (info.streams[3] == 'C')
+	else if (type == "WGHT" && chunk.bytes == num_vertices * (int)sizeof(Vector4))
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		mesh->weights.resize(num_vertices);
+		memcpy(&mesh->weights[0], data, chunk.bytes);
 	}
-
-	if (info.streams[4] == 'I')
+	else if (type == "BINF" && chunk.bytes % sizeof(BoneInfo) == 0)
 	{
-		m_indices.resize(info.num_indices);
-		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		mesh->bones_info.resize(chunk.bytes / sizeof(BoneInfo));
+		if (chunk.bytes)
+			memcpy(&mesh->bones_info[0], data, chunk.bytes);
 	}
+	else if (type == "SUBM" && chunk.bytes % sizeof(sSubmeshInfo) == 0)
+	{
+		mesh->submeshes.resize(chunk.bytes / sizeof(sSubmeshInfo));
+		if (chunk.bytes)
+			memcpy(&mesh->submeshes[0], data, chunk.bytes);
+	}
+	else if (type == "POS " || type == "NORM" || type == "UV0 " || type == "UV1 " || type == "IDX " || type == "COL " || type == "BONE" || type == "WGHT" || type == "BINF" || type == "SUBM")
+		return false; //known type with a wrong size
+	//unknown types are from newer writers, they are skipped
+
+	return true;
+}
 
-	if (info.streams[5] == 'B')
+//raw chunks of a file that stays mapped are not copied, their stream points to them
+static bool mapChunk(Mesh::sStreams& mapped, const sMeshChunk& chunk, const uint8* data, int num_vertices, int num_indices)
+{
+	std::string type(chunk.type, 4);
+	if (chunk.encoding != CHUNK_RAW || chunk.compressed_bytes)
+		return false;
+	if (type == "POS " && chunk.bytes == num_vertices * (int)sizeof(Vector3))
+		mapped.vertices = (const Vector3*)data;
+	else if (type == "NORM" && chunk.bytes == num_vertices * (int)sizeof(Vector3))
+		mapped.normals = (const Vector3*)data;
+	else if (type == "UV0 " && chunk.bytes == num_vertices * (int)sizeof(Vector2))
+		mapped.uvs = (const Vector2*)data;
+	else if (type == "UV1 " && chunk.bytes == num_vertices * (int)sizeof(Vector2))
+		mapped.uvs1 = (const Vector2*)data;
+	else if (type == "COL " && chunk.bytes == num_vertices * (int)sizeof(Vector4))
+		mapped.colors = (const Vector4*)data;
+	else if (type == "IDX " && chunk.bytes == num_indices * (int)sizeof(unsigned int))
+		mapped.indices = (const unsigned int*)data;
+	else if (type == "BONE" && chunk.bytes == num_vertices * (int)sizeof(Vector4ub))
+		mapped.bones = (const Vector4ub*)data;
+	else if (type == "WGHT" && chunk.bytes == num_vertices * (int)sizeof(Vector4))
+		mapped.weights = (const Vector4*)data;
+	else
+		return false;
+	return true;
+}
+
+static bool readChunks(Mesh* mesh, const sMeshInfo& info, const char* pos, const char* end, Mesh::sStreams* mapped = NULL)
+{
+	std::vector<uint8> buffer;
+	while (pos + sizeof(sMeshChunk) <= end)
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		sMeshChunk chunk;
+		memcpy(&chunk, pos, sizeof(sMeshChunk));
+		pos += sizeof(sMeshChunk);
+
+		int stored = chunk.compressed_bytes ? chunk.compressed_bytes : chunk.bytes;
+		if (chunk.bytes < 0 || stored < 0 || stored > end - pos)
+			return false;
+
+		const uint8* data = (const uint8*)pos;
+		if (chunk.compressed_bytes)
+		{
+			buffer.resize(chunk.bytes);
+			if (!lzDecompress(data, stored, buffer.size() ? &buffer[0] : NULL, chunk.bytes))
+				return false;
+			data = buffer.size() ? &buffer[0] : NULL;
+		}
+
+		if ((!mapped || !mapChunk(*mapped, chunk, data, info.size, info.num_indices)) && !readChunk(mesh, chunk, data, info.size, info.num_indices))
+			return false;
+
+		pos += stored + (stored % 4 ? 4 - stored % 4 : 0);
 	}
+	return true;
+}
 
-	if (info.streams[6] == 'W')
+bool Mesh::readBin(const char* filename, bool bFromNetwork, int* version, int* options)
+{
+	assert(filename);
+
+	//the file is mapped, not read, so the streams are used from the mapping without copying them
+	sMappedFile* file = mapFile(filename);
+	if (file == NULL)
+		return false;
+	const char* data = file->data;
+	const char* end = data + file->size;
+
+	//watermark
+	if ( file->size < 4 + sizeof(sMeshInfo) || memcmp(data,"MBIN",4) != 0 )
 	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		unmapFile(file);
+		return false;
 	}
 
-	if (info.streams[7] == 'u')
+	const char* pos = data + 4;
+	sMeshInfo info;
+	memcpy(&info,pos,sizeof(sMeshInfo));
+	pos += sizeof(sMeshInfo);
+
+	if ((info.version != MESH_BIN_VERSION && info.version != MESH_BIN_MAPPED_VERSION) || info.header_bytes != sizeof(sMeshInfo) )
 	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		unmapFile(file);
+		return false;
 	}
+	if (version)
+		*version = info.version;
+	if (options)
+		*options = info.options;
 
-	if (info.num_bones)
+	//the encoded streams are decoded to the vectors, the raw ones point to the mapping, which is kept while any does
+	if (info.version == MESH_BIN_VERSION)
+	{
+		memset(&mapped, 0, sizeof(mapped));
+		mapped.num_vertices = info.size;
+		mapped.num_indices = info.num_indices;
+		if (!readChunks(this, info, pos, end, &mapped) || (info.size && vertices.empty() && !mapped.vertices))
+		{
+			std::cout << "[ERROR] loading BIN: corrupt chunk: " << filename << std::endl;
+			clear();
+			unmapFile(file);
+			return false;
+		}
+		if (mapped.vertices || mapped.normals || mapped.uvs || mapped.uvs1 || mapped.colors || mapped.indices || mapped.bones || mapped.weights)
+			mapped_file = file;
+		else
+			unmapFile(file);
+	}
+	else
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
+		//raw streams point inside the mapping, they are checked against the end of the file below
+		memset(&mapped, 0, sizeof(mapped));
+		mapped.num_vertices = info.size;
+		mapped.num_indices = info.num_indices;
+
+		if (info.streams[0] == 'I')
+		{
+			mapped.interleaved = (const tInterleaved*)pos;
+			pos += sizeof(tInterleaved) * info.size;
+		}
+		else if (info.streams[0] == 'V')
+		{
+			mapped.vertices = (const Vector3*)pos;
+			pos += sizeof(Vector3) * info.size;
+		}
+
+		if (info.streams[1] == 'N')
+		{
+			mapped.normals = (const Vector3*)pos;
+			pos += sizeof(Vector3) * info.size;
+		}
+
+		if (info.streams[2] == 'U')
+		{
+			mapped.uvs = (const Vector2*)pos;
+			pos += sizeof(Vector2) * info.size;
+		}
+
+		if (info.streams[3] == 'C')
+		{
+			mapped.colors = (const Vector4*)pos;
+			pos += sizeof(Vector4) * info.size;
+		}
+
+		if (info.streams[4] == 'I')
+		{
+			mapped.indices = (const unsigned int*)pos;
+			pos += sizeof(unsigned int) * info.num_indices;
+		}
+
+		if (info.streams[5] == 'B')
+		{
+			mapped.bones = (const Vector4ub*)pos;
+			pos += sizeof(Vector4ub) * info.size;
+		}
+
+		if (info.streams[6] == 'W')
+		{
+			mapped.weights = (const Vector4*)pos;
+			pos += sizeof(Vector4) * info.size;
+		}
+
+		if (info.streams[7] == 'u')
+		{
+			mapped.uvs1 = (const Vector2*)pos;
+			pos += sizeof(Vector2) * info.size;
+		}
+
+		if (pos + sizeof(BoneInfo) * info.num_bones + sizeof(sSubmeshInfo) * info.num_submeshes > end)
+		{
+			std::cout << "[ERROR] loading BIN: truncated file: " << filename << std::endl;
+			memset(&mapped, 0, sizeof(mapped));
+			unmapFile(file);
+			return false;
+		}
+		mapped_file = file;
+
+		//the small stuff is copied
+		if (info.num_bones)
+		{
+			bones_info.resize(info.num_bones);
+			memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
+			pos += sizeof(BoneInfo) * info.num_bones;
+		}
+
+		submeshes.resize(info.num_submeshes);
+		if (info.num_submeshes)
+			memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+		pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 	}
 
 	aabb_max = info.aabb_max;
@@ -864,26 +1567,73 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
 
-	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
+	//the collision model is created when it is needed (see testRayCollision), it would copy the streams
+	return true;
+}
+
+bool Mesh::readBinFromMemory(const char* data, size_t size)
+{
+	sMeshInfo info;
+	if (size < 4 + sizeof(sMeshInfo) || memcmp(data, "MBIN", 4) != 0)
+		return false;
+	memcpy(&info, data + 4, sizeof(sMeshInfo));
+	if (info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo))
+		return false;
 
-	createCollisionModel();
+	if (!readChunks(this, info, data + 4 + sizeof(sMeshInfo), data + size) || (info.size && vertices.empty()))
+	{
+		clear();
+		return false;
+	}
+
+	aabb_max = info.aabb_max;
+	aabb_min = info.aabb_min;
+	box.center = info.center;
+	box.halfsize = info.halfsize;
+	radius = info.radius;
+	bind_matrix = info.bind_matrix;
 	return true;
 }
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
-	FILE* f = fopen(s_filename.c_str(),"wb");
+	//the streams could be mapped from this same file, copy them before it gets overwritten
+	loadStreams();
+
+	//write to a temporary file so a failed write doesnt destroy the previous one
+	std::string tmp_filename = s_filename + ".tmp";
+	FILE* f = fopen(tmp_filename.c_str(),"wb");
 	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write mesh BIN: " << tmp_filename.c_str() << std::endl;
+		return false;
+	}
+
+	bool ok = writeBin(f);
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+	{
+		remove(tmp_filename.c_str());
+		return false;
+	}
+
+	remove(s_filename.c_str()); //rename doesnt overwrite on windows
+	if (rename(tmp_filename.c_str(), s_filename.c_str()) != 0)
 	{
 		std::cout << "[ERROR] cannot write mesh BIN: " << s_filename.c_str() << std::endl;
+		remove(tmp_filename.c_str());
 		return false;
 	}
+	return true;
+}
+
+bool Mesh::writeBin(FILE* f)
+{
+	loadStreams();
+	assert( vertices.size() || interleaved.size() );
 
 	//watermark
 	fwrite("MBIN",sizeof(char),4,f);
@@ -902,6 +1652,7 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.options = getBinOptions();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -915,36 +1666,100 @@ bool Mesh::writeBin(const char* filename)
 	//write info
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
-	//write streams
+	//the interleaved streams are split, every one is encoded on its own
+	int num_vertices = info.size;
+	std::vector<Vector3> positions_split, normals_split;
+	std::vector<Vector2> uvs_split;
+	const std::vector<Vector3>* positions_stream = &vertices;
+	const std::vector<Vector3>* normals_stream = &normals;
+	const std::vector<Vector2>* uvs_stream = &uvs;
 	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
+	{
+		positions_split.resize(num_vertices);
+		normals_split.resize(num_vertices);
+		uvs_split.resize(num_vertices);
+		for (int i = 0; i < num_vertices; ++i)
+		{
+			positions_split[i] = interleaved[i].vertex;
+			normals_split[i] = interleaved[i].normal;
+			uvs_split[i] = interleaved[i].uv;
+		}
+		positions_stream = &positions_split;
+		normals_stream = &normals_split;
+		uvs_stream = &uvs_split;
+	}
+
+	//positions, relative to their own box
+	if (bin_quantize)
+	{
+		const std::vector<Vector3>& p = *positions_stream;
+		Vector3 min = p[0], max = p[0];
+		for (int i = 1; i < num_vertices; ++i)
+		{
+			min.setMin(p[i]);
+			max.setMax(p[i]);
+		}
+		Vector3 size = max - min;
+		Vector3 scale(size.x > 0 ? 65535.0f / size.x : 0, size.y > 0 ? 65535.0f / size.y : 0, size.z > 0 ? 65535.0f / size.z : 0);
+
+		std::vector<uint8> encoded(2 * sizeof(Vector3) + num_vertices * 3 * sizeof(uint16));
+		memcpy(&encoded[0], &min, sizeof(Vector3));
+		memcpy(&encoded[sizeof(Vector3)], &max, sizeof(Vector3));
+		uint16* q = (uint16*)&encoded[2 * sizeof(Vector3)];
+		for (int i = 0; i < num_vertices; ++i, q += 3)
+		{
+			Vector3 v = p[i] - min;
+			q[0] = (uint16)floor(clamp(v.x * scale.x, 0, 65535) + 0.5f);
+			q[1] = (uint16)floor(clamp(v.y * scale.y, 0, 65535) + 0.5f);
+			q[2] = (uint16)floor(clamp(v.z * scale.z, 0, 65535) + 0.5f);
+		}
+		writeChunk(f, "POS ", CHUNK_POSITION_Q16, &encoded[0], (int)encoded.size());
+	}
 	else
+		writeFloatChunk(f, "POS ", *positions_stream, false);
+
+	if (normals_stream->size())
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+		if (bin_quantize)
+		{
+			std::vector<int16> encoded(num_vertices * 2);
+			for (int i = 0; i < num_vertices; ++i)
+				encodeOctahedral((*normals_stream)[i], &encoded[i * 2]);
+			writeChunk(f, "NORM", CHUNK_NORMAL_OCT16, &encoded[0], (int)(encoded.size() * sizeof(int16)));
+		}
+		else
+			writeFloatChunk(f, "NORM", *normals_stream, false);
 	}
 
+	if (uvs_stream->size())
+		writeFloatChunk(f, "UV0 ", *uvs_stream, bin_quantize);
+	if (m_uvs1.size())
+		writeFloatChunk(f, "UV1 ", m_uvs1, bin_quantize);
+
 	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
+		writeChunk(f, "COL ", CHUNK_RAW, &colors[0], (int)(colors.size() * sizeof(Vector4)));
 
+	//16 bits when every vertex can be addressed
 	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
+	{
+		if (num_vertices <= 65536)
+		{
+			std::vector<uint16> encoded(m_indices.begin(), m_indices.end());
+			writeChunk(f, "IDX ", CHUNK_INDEX_U16, &encoded[0], (int)(encoded.size() * sizeof(uint16)));
+		}
+		else
+			writeChunk(f, "IDX ", CHUNK_RAW, &m_indices[0], (int)(m_indices.size() * sizeof(unsigned int)));
+	}
 
 	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
+		writeChunk(f, "BONE", CHUNK_RAW, &bones[0], (int)(bones.size() * sizeof(Vector4ub)));
 	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
+		writeChunk(f, "WGHT", CHUNK_RAW, &weights[0], (int)(weights.size() * sizeof(Vector4)));
 	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
+		writeChunk(f, "BINF", CHUNK_RAW, &bones_info[0], (int)(bones_info.size() * sizeof(BoneInfo)));
+	if (submeshes.size())
+		writeChunk(f, "SUBM", CHUNK_RAW, &submeshes[0], (int)(submeshes.size() * sizeof(sSubmeshInfo)));
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
-
-	fclose(f);
 	return true;
 }
 
@@ -1078,133 +1893,393 @@ bool Mesh::loadASE(const char* filename)
 	return true;
 }
 
-bool Mesh::loadOBJ(const char* filename)
+//OBJ parsing: the mapped file is split in chunks at line boundaries that are parsed in parallel,
+//every chunk keeps its own lists and they are merged in order afterwards
+
+const int obj_missing = -1; //index not in the face
+const int obj_relative = 1 << 30; //negative indices are relative to the chunk, they are stored minus this
+
+struct sOBJCorner {
+	int v, t, n;
+};
+
+//usemtl and g lines, they split the submeshes
+struct sOBJEvent {
+	bool material;
+	int corner; //corners of the chunk before it
+	char name[64];
+};
+
+struct sOBJChunk {
+	const char* start;
+	const char* end;
+	std::vector<Vector3> positions;
+	std::vector<Vector3> normals;
+	std::vector<Vector2> uvs;
+	std::vector<sOBJCorner> corners; //three per triangle
+	std::vector<sOBJEvent> events;
+	int base_v, base_t, base_n, base_corner; //where the lists of the chunk go in the merged ones
+	int num_invalid; //corners with indices out of range
+};
+
+static inline bool isOBJSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static inline const char* skipOBJSpaces(const char* p, const char* end)
 {
-	std::string data;
-	if(!readFile(filename,data))
-		return false;
-	char* pos = &data[0];
-	char line[255];
-	int i = 0;
-
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
-
-	const float max_float = 10000000;
-	const float min_float = -10000000;
-	aabb_min.set(max_float,max_float,max_float);
-	aabb_max.set(min_float,min_float,min_float);
+	while (p < end && isOBJSpace(*p))
+		p++;
+	return p;
+}
 
-	unsigned int vertex_i = 0;
+static const char* parseOBJFloat(const char* p, const char* end, float& out)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
 
-	sSubmeshInfo submesh_info;
-	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
+	p = skipOBJSpaces(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
 
-	//parse file
-	while(*pos != 0)
+	//up to 19 significant digits in an integer, the rest only move the exponent
+	uint64 mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	while (p < end && *p >= '0' && *p <= '9')
 	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				digits++;
+		}
+		else
+			exponent++;
+		p++;
+	}
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+			p++;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negative_exponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative_exponent = *p++ == '-';
+		int e = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			if (e < 10000)
+				e = e * 10 + (*p - '0');
+			p++;
+		}
+		exponent += negative_exponent ? -e : e;
+	}
 
-		//read one line
-		i = 0;
-		while(i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		memcpy(line,pos,i);
-		line[i] = 0;
-		pos = pos + i;
+	double value = (double)mantissa;
+	if (exponent < 0)
+		value = exponent >= -22 ? value / powers[-exponent] : value * pow(10.0, exponent);
+	else if (exponent > 0)
+		value = exponent <= 22 ? value * powers[exponent] : value * pow(10.0, exponent);
+	out = (float)(negative ? -value : value);
+	return p;
+}
 
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
+static const char* parseOBJInt(const char* p, const char* end, int& out)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	int value = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	out = negative ? -value : value;
+	return p;
+}
 
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line," ");
+//OBJ indices start at 1, negative ones count back from the last element defined
+static inline int resolveOBJIndex(int index, int local_count)
+{
+	if (index > 0)
+		return index - 1;
+	if (index < 0)
+		return local_count + index - obj_relative;
+	return obj_missing;
+}
 
-		if (tokens.empty()) continue;
+//copies the first word after the keyword
+static void parseOBJName(const char* p, const char* end, char* name)
+{
+	p = skipOBJSpaces(p, end);
+	int i = 0;
+	while (p < end && !isOBJSpace(*p) && i < 63)
+		name[i++] = *p++;
+	name[i] = 0;
+}
 
-		if (tokens[0] == "v" && tokens.size() == 4)
-		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_positions.push_back(v);
+static void parseOBJChunk(sOBJChunk& chunk)
+{
+	const char* p = chunk.start;
+	const char* end = chunk.end;
+	sOBJCorner face[3];
 
-			aabb_min.setMin( v );
-			aabb_max.setMax( v );
-		}
-		else if (tokens[0] == "vt" && tokens.size() >= 3)
+	while (p < end)
+	{
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (!line_end)
+			line_end = end;
+		p = skipOBJSpaces(p, line_end);
+		int length = (int)(line_end - p);
+
+		if (length > 2 && p[0] == 'v' && isOBJSpace(p[1]))
 		{
-			Vector2 v((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str()) );
-			indexed_uvs.push_back(v);
+			Vector3 v;
+			const char* q = parseOBJFloat(p + 1, line_end, v.x);
+			q = parseOBJFloat(q, line_end, v.y);
+			parseOBJFloat(q, line_end, v.z);
+			chunk.positions.push_back(v);
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+		else if (length > 3 && p[0] == 'v' && p[1] == 't' && isOBJSpace(p[2]))
 		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_normals.push_back(v);
+			Vector2 v;
+			const char* q = parseOBJFloat(p + 2, line_end, v.x);
+			parseOBJFloat(q, line_end, v.y);
+			v.y = 1.0f - v.y;
+			chunk.uvs.push_back(v);
 		}
-		else if (tokens[0] == "s") //surface? it appears one time before the faces
+		else if (length > 3 && p[0] == 'v' && p[1] == 'n' && isOBJSpace(p[2]))
 		{
-			//process mesh: ????
-			//if (uvs.size() == 0 && indexed_uvs.size() )
-			//	uvs.resize(1);
+			Vector3 v;
+			const char* q = parseOBJFloat(p + 2, line_end, v.x);
+			q = parseOBJFloat(q, line_end, v.y);
+			parseOBJFloat(q, line_end, v.z);
+			chunk.normals.push_back(v);
 		}
-		else if (tokens[0] == "usemtl") //surface? it appears one time before the faces
+		else if (length > 2 && p[0] == 'f' && isOBJSpace(p[1]))
 		{
-			if (last_submesh_vertex != vertices.size())
+			//polygons are triangulated as a fan around the first corner
+			int num_v = (int)chunk.positions.size();
+			int num_t = (int)chunk.uvs.size();
+			int num_n = (int)chunk.normals.size();
+			int num_corners = 0;
+			const char* q = p + 1;
+			while (true)
 			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
+				q = skipOBJSpaces(q, line_end);
+				if (q >= line_end || !((*q >= '0' && *q <= '9') || *q == '-'))
+					break;
+
+				int v = 0, t = 0, n = 0;
+				q = parseOBJInt(q, line_end, v);
+				if (q < line_end && *q == '/')
+				{
+					q++;
+					if (q < line_end && *q != '/')
+						q = parseOBJInt(q, line_end, t);
+					if (q < line_end && *q == '/')
+						q = parseOBJInt(q + 1, line_end, n);
+				}
+				//skip whatever is left of a malformed corner
+				while (q < line_end && !isOBJSpace(*q))
+					q++;
+
+				sOBJCorner corner = { resolveOBJIndex(v, num_v), resolveOBJIndex(t, num_t), resolveOBJIndex(n, num_n) };
+				if (num_corners < 2)
+					face[num_corners] = corner;
+				else
+				{
+					face[2] = corner;
+					chunk.corners.push_back(face[0]);
+					chunk.corners.push_back(face[1]);
+					chunk.corners.push_back(face[2]);
+					face[1] = face[2];
+				}
+				num_corners++;
 			}
-			else
-				strcpy(submesh_info.material, tokens[1].c_str());
 		}
-		else if (tokens[0] == "g") //surface? it appears one time before the faces
+		else if (length > 6 && memcmp(p, "usemtl", 6) == 0 && isOBJSpace(p[6]))
 		{
-			if (last_submesh_vertex != vertices.size())
-			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy( submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
-			}
+			sOBJEvent e;
+			e.material = true;
+			e.corner = (int)chunk.corners.size();
+			parseOBJName(p + 6, line_end, e.name);
+			chunk.events.push_back(e);
 		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
+		else if (length > 1 && p[0] == 'g' && isOBJSpace(p[1]))
 		{
-			Vector3 v1,v2,v3;
-			v1.parseFromText( tokens[1].c_str(), '/' );
+			sOBJEvent e;
+			e.material = false;
+			e.corner = (int)chunk.corners.size();
+			parseOBJName(p + 1, line_end, e.name);
+			chunk.events.push_back(e);
+		}
 
-			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
-			{
-				v2.parseFromText( tokens[iPoly].c_str(), '/' );
-				v3.parseFromText( tokens[iPoly+1].c_str(), '/' );
+		p = line_end + 1;
+	}
+}
+
+//absolute index of a corner element, -1 if it is missing or out of range
+static inline int absoluteOBJIndex(int index, int base, int count)
+{
+	if (index == obj_missing)
+		return -1;
+	if (index < obj_missing)
+		index += obj_relative + base;
+	return index >= 0 && index < count ? index : -1;
+}
 
-				vertices.push_back( indexed_positions[ (unsigned int)(v1.x) -1 ] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v2.x) -1] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v3.x) -1] );
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
+static void resolveOBJChunk(sOBJChunk& chunk, Mesh* mesh, const std::vector<Vector3>& positions, const std::vector<Vector2>& uvs, const std::vector<Vector3>& normals)
+{
+	chunk.num_invalid = 0;
+	for (int i = 0; i < chunk.corners.size(); ++i)
+	{
+		const sOBJCorner& c = chunk.corners[i];
+		int index = chunk.base_corner + i;
 
-				if (indexed_uvs.size() > 0)
-				{
-					uvs.push_back( indexed_uvs[(unsigned int)(v1.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v2.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v3.y) -1] );
-				}
+		int v = absoluteOBJIndex(c.v, chunk.base_v, (int)positions.size());
+		if (v == -1)
+			chunk.num_invalid++;
+		mesh->vertices[index] = v != -1 ? positions[v] : Vector3();
 
-				if (indexed_normals.size() > 0)
-				{
-					normals.push_back( indexed_normals[(unsigned int)(v1.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v2.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v3.z) -1] );
-				}
-			}
+		if (mesh->uvs.size())
+		{
+			int t = absoluteOBJIndex(c.t, chunk.base_t, (int)uvs.size());
+			mesh->uvs[index] = t != -1 ? uvs[t] : Vector2();
+		}
+		if (mesh->normals.size())
+		{
+			int n = absoluteOBJIndex(c.n, chunk.base_n, (int)normals.size());
+			mesh->normals[index] = n != -1 ? normals[n] : Vector3();
 		}
 	}
+}
+
+//runs func(0..n-1), every call in its own thread
+static void parallelChunks(int n, const std::function<void(int)>& func)
+{
+	std::vector<std::thread> threads;
+	for (int i = 1; i < n; ++i)
+		threads.push_back(std::thread(func, i));
+	func(0);
+	for (int i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+bool Mesh::loadOBJ(const char* filename)
+{
+	sMappedFile* file = mapFile(filename);
+	if (!file)
+		return false;
+
+	//small files are not worth the threads
+	const size_t min_chunk_size = 1 << 20;
+	int num_chunks = (int)std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), file->size / min_chunk_size + 1);
+	num_chunks = std::min(num_chunks, 16);
+
+	//split at line boundaries
+	std::vector<sOBJChunk> chunks(num_chunks);
+	const char* data = file->data;
+	const char* end = data + file->size;
+	const char* start = data;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		const char* chunk_end = i == num_chunks - 1 ? end : std::max(start, data + file->size * (i + 1) / num_chunks);
+		const char* line_end = chunk_end < end ? (const char*)memchr(chunk_end, '\n', end - chunk_end) : NULL;
+		chunk_end = line_end ? line_end + 1 : end;
+		chunks[i].start = start;
+		chunks[i].end = chunk_end;
+		start = chunk_end;
+	}
+
+	parallelChunks(num_chunks, [&chunks](int i) { parseOBJChunk(chunks[i]); });
+	unmapFile(file); //everything was copied to the chunks
+
+	//merge the indexed lists
+	int num_v = 0, num_t = 0, num_n = 0, num_corners = 0;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		sOBJChunk& chunk = chunks[i];
+		chunk.base_v = num_v;
+		chunk.base_t = num_t;
+		chunk.base_n = num_n;
+		chunk.base_corner = num_corners;
+		num_v += (int)chunk.positions.size();
+		num_t += (int)chunk.uvs.size();
+		num_n += (int)chunk.normals.size();
+		num_corners += (int)chunk.corners.size();
+	}
+
+	std::vector<Vector3> indexed_positions;
+	std::vector<Vector3> indexed_normals;
+	std::vector<Vector2> indexed_uvs;
+	indexed_positions.reserve(num_v);
+	indexed_uvs.reserve(num_t);
+	indexed_normals.reserve(num_n);
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		sOBJChunk& chunk = chunks[i];
+		indexed_positions.insert(indexed_positions.end(), chunk.positions.begin(), chunk.positions.end());
+		indexed_uvs.insert(indexed_uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+		indexed_normals.insert(indexed_normals.end(), chunk.normals.begin(), chunk.normals.end());
+		std::vector<Vector3>().swap(chunk.positions);
+		std::vector<Vector2>().swap(chunk.uvs);
+		std::vector<Vector3>().swap(chunk.normals);
+	}
+
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	aabb_min.set(max_float,max_float,max_float);
+	aabb_max.set(min_float,min_float,min_float);
+	for (int i = 0; i < indexed_positions.size(); ++i)
+	{
+		aabb_min.setMin(indexed_positions[i]);
+		aabb_max.setMax(indexed_positions[i]);
+	}
+
+	//then every chunk writes its triangles in its part of the streams
+	vertices.resize(num_corners);
+	uvs.resize(indexed_uvs.size() ? num_corners : 0);
+	normals.resize(indexed_normals.size() ? num_corners : 0);
+	parallelChunks(num_chunks, [&](int i) { resolveOBJChunk(chunks[i], this, indexed_positions, indexed_uvs, indexed_normals); });
+
+	int num_invalid = 0;
+	for (int i = 0; i < num_chunks; ++i)
+		num_invalid += chunks[i].num_invalid;
+	if (num_invalid)
+		std::cout << "[WARN] OBJ with " << num_invalid << " corners out of range: " << filename << std::endl;
+
+	//submeshes, split by usemtl and g
+	sSubmeshInfo submesh_info;
+	int last_submesh_vertex = 0;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+	for (int i = 0; i < num_chunks; ++i)
+		for (int j = 0; j < chunks[i].events.size(); ++j)
+		{
+			const sOBJEvent& e = chunks[i].events[j];
+			int vertex = chunks[i].base_corner + e.corner;
+			if (last_submesh_vertex != vertex)
+			{
+				submesh_info.length = vertex - submesh_info.start;
+				last_submesh_vertex = vertex;
+				submeshes.push_back(submesh_info);
+				memset(&submesh_info, 0, sizeof(submesh_info));
+				strcpy(submesh_info.name, e.name);
+				submesh_info.start = last_submesh_vertex;
+			}
+			else if (e.material)
+				strcpy(submesh_info.material, e.name);
+		}
 
 	box.center = (aabb_max + aabb_min) * 0.5;
 	box.halfsize = (aabb_max - box.center);
@@ -1483,6 +2558,7 @@ void Mesh::createGrid(float dist)
 
 void Mesh::updateBoundingBox()
 {
+	loadStreams();
 	if (vertices.size())
 	{
 		aabb_max = aabb_min = vertices[0];
@@ -1495,7 +2571,7 @@ void Mesh::updateBoundingBox()
 	else if (interleaved.size())
 	{
 		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < vertices.size(); ++i)
+		for (int i = 1; i < interleaved.size(); ++i)
 		{
 			aabb_min.setMin(interleaved[i].vertex);
 			aabb_max.setMax(interleaved[i].vertex);
@@ -1556,12 +2632,34 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+//welds and optimizes the meshes imported from other formats, before writing their MBIN
+static void optimizeImported(Mesh* m)
+{
+	if (Mesh::weld_meshes)
+	{
+		int num_vertices = m->getNumVertices();
+		std::cout << "[WELD " << num_vertices << " -> " << m->weldVertices() << "] ";
+	}
+
+	if (Mesh::optimize_meshes && m->getNumIndices())
+	{
+		float atvr_before, atvr_after;
+		float acmr_before = simulateVertexCache(&m->m_indices[0], (int)m->m_indices.size(), m->getNumVertices(), 16, &atvr_before);
+		m->optimizeIndices();
+		float acmr_after = simulateVertexCache(&m->m_indices[0], (int)m->m_indices.size(), m->getNumVertices(), 16, &atvr_after);
+		std::cout << "[OPT ACMR " << acmr_before << " -> " << acmr_after << " ATVR " << atvr_before << " -> " << atvr_after << "] ";
+	}
+}
+
 Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
-	if (it != sMeshesLoaded.end())
-		return it->second;
+	{
+		std::lock_guard<std::mutex> lock(meshes_mutex);
+		std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+		if (it != sMeshesLoaded.end())
+			return it->second;
+	}
 
 	if (skip_load)
 		return NULL;
@@ -1595,9 +2693,31 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		binfilename = binfilename + ".mbin";
 
 	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str(), bFromNetwork) )
+	int bin_version = 0;
+	int bin_options = 0;
+	bool bin_loaded = use_binary && m->readBin(binfilename.c_str(), bFromNetwork, &bin_version, &bin_options);
+
+	//bins cooked with other options are imported again from the source, converting them could not undo the quantization
+	if (bin_loaded && file_format != FORMAT_MBIN && bin_options != getBinOptions() && !bFromNetwork)
+	{
+		std::cout << "[RECOOK] ";
+		delete m;
+		m = new Mesh();
+		bin_loaded = false;
+	}
+
+	if (bin_loaded)
 	{
-		if (interleave_meshes && m->interleaved.size() == 0)
+		//bins written before welding existed are welded, optimized and written again
+		bool welded = false;
+		if (weld_meshes && file_format != FORMAT_MBIN && !m->getNumIndices())
+		{
+			optimizeImported(m);
+			welded = true;
+		}
+
+		//the mapped streams are uploaded as they are, interleaving them would copy them
+		if (interleave_meshes && m->interleaved.size() == 0 && !m->mapped_file)
 		{
 			std::cout << "[INTERL] ";
 			m->interleaveBuffers();
@@ -1609,8 +2729,15 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
+		//bins of an older version are converted (only the ones generated from another format)
+		if ((bin_version != MESH_BIN_VERSION && file_format != FORMAT_MBIN) || welded)
+		{
+			std::cout << "[CONVERT] ";
+			m->writeBin(filename);
+		}
+
+		std::cout << "[OK BIN]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		m->registerMesh(filename);
 		return m;
 	}
 
@@ -1632,6 +2759,9 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		return NULL;
 	}
 
+	//merge the vertices repeated by formats that store them per face and sort them for the GPU
+	optimizeImported(m);
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1646,7 +2776,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
@@ -1661,6 +2791,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 void Mesh::registerMesh( std::string name )
 {
 	this->name = name;
+	std::lock_guard<std::mutex> lock(meshes_mutex);
 	sMeshesLoaded[name] = this;
 }
 
@@ -6,13 +6,16 @@
 
 #include <map>
 #include <string>
+#include <cstdio>
 
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+struct sMappedFile; //for MBIN files
 
 //version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 12 //this is used to regenerate bins if the format changes
+#define MESH_BIN_MAPPED_VERSION 11 //previous version with raw streams, still loaded (mapped, see readBin)
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -23,8 +26,8 @@ struct sSubmeshInfo
 {
 	char name[64];
 	char material[64];
-	int start;//in primitive
-	int length;//in primitive
+	int start;//in vertices, or in indices if the mesh is indexed
+	int length;//in vertices, or in indices if the mesh is indexed
 };
 
 class Mesh
@@ -34,6 +37,18 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	//writeBin quantizes positions (16 bits), normals (octahedral) and uvs (half floats), off by default (--bin-quantize) because it is lossy:
+	//positions move up to 1/131070 of the size of the mesh box, normals about 0.005 degrees and uvs have 11 bits of
+	//precision (a uv of 100 moves up to 0.03), the meshes loaded from the MBIN are not exactly the imported ones
+	static bool bin_quantize;
+	//writeBin compresses every chunk with lzCompress when it makes it smaller, off by default (--bin-compress): compressed chunks are
+	//decoded to the vectors at load instead of being used from the file mapping (see readBin)
+	static bool bin_compress;
+	//the two options above as stored in the MBIN header, bins written with other ones are imported again (see Get)
+	enum eBinOptions { BIN_QUANTIZED = 1, BIN_COMPRESSED = 2 };
+	static int getBinOptions() { return (bin_quantize ? BIN_QUANTIZED : 0) | (bin_compress ? BIN_COMPRESSED : 0); }
+	static bool weld_meshes; //loaded meshes are welded (see weldVertices) before writing the MBIN
+	static bool optimize_meshes; //and their indices optimized (see optimizeIndices)
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
 
@@ -63,6 +78,24 @@ public:
 	std::vector< BoneInfo > bones_info; //tells 
 	Matrix44 bind_matrix;
 
+	//streams of a MBIN used straight from the file mapping (see readBin), the ones stored raw (the rest are decoded to
+	//the vectors), their vectors stay empty until something needs the data in the CPU (collisions...) and calls loadStreams
+	struct sStreams {
+		const tInterleaved* interleaved;
+		const Vector3* vertices;
+		const Vector3* normals;
+		const Vector2* uvs;
+		const Vector2* uvs1;
+		const Vector4* colors;
+		const unsigned int* indices;
+		const Vector4ub* bones;
+		const Vector4* weights;
+		int num_vertices;
+		int num_indices;
+	};
+	sStreams mapped;
+	sMappedFile* mapped_file; //NULL if the mesh is not mapped
+
 	Vector3 aabb_min;
 	Vector3	aabb_max;
 	BoundingBox box;
@@ -75,11 +108,16 @@ public:
 	unsigned int colors_vbo_id;
 
 	unsigned int indices_vbo_id;
+	unsigned int indices_type; //of the index VBO, GL_UNSIGNED_SHORT if the mesh has 65536 vertices or less
 	unsigned int interleaved_vbo_id;
 	unsigned int bones_vbo_id;
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	unsigned int vao_id; //attribute setup of the VBOs, created on the first render
+	bool vao_instanced; //the instance models are already set in the VAO
+	bool upload_pending; //queued in the Loader, not renderable yet
+
 	Mesh();
 	~Mesh();
 
@@ -91,15 +129,22 @@ public:
 	void renderFixedPipeline(int primitive); //sloooooooow
 	//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
-	void enableBuffers(Shader* shader);
+	void enableBuffers(Shader* shader); //only for meshes that are not in VRAM, the rest use the VAO
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
+	bool bindVAO(); //false if the mesh is not in VRAM
 
-	bool readBin(const char* filename, bool bFromNetwork);
-	bool writeBin(const char* filename);
+	bool readBin(const char* filename, bool bFromNetwork, int* version = NULL, int* options = NULL); //loads v11 and v12
+	bool writeBin(const char* filename); //always writes the current version, so it converts older bins
+	//the same MBIN (current version only) inside other files, like the prefab bins
+	bool readBinFromMemory(const char* data, size_t size);
+	bool writeBin(FILE* f);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices() { if (mapped_file) return mapped.num_vertices; return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumIndices() { return mapped_file ? mapped.num_indices : (unsigned int)m_indices.size(); }
+	//copies the mapped streams to the vectors and releases the mapping
+	void loadStreams();
 
 	//collision testing
 	void* collision_model;
@@ -108,7 +153,7 @@ public:
 	bool testRayCollision( Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
 	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
 
-	//loader
+	//loader, loading files must be done in the main thread (it uploads to VRAM), with skip_load it works from any thread
 	static Mesh* Get(const char* filename, bool bFromNetwork, bool skip_load = false);
 	static void Release();
 	void registerMesh(std::string name);
@@ -127,12 +172,18 @@ public:
 
 	//optimize meshes
 	void uploadToVRAM();
+	void streamToVRAM(); //queues the upload in the Loader, it must not be modified until it is done
 	bool interleaveBuffers();
+	//merges the vertices with the same attributes and generates (or remaps) m_indices, returns the vertices left
+	int weldVertices();
+	//sorts the triangles of every submesh for the vertex cache and overdraw, and the vertices in order of use
+	void optimizeIndices();
 
 private:
 	bool loadASE(const char* filename);
 	bool loadOBJ(const char* filename);
 	bool loadMESH(const char* filename); //personal format used for animations
+	void createVAO();
 };
 
 #endif
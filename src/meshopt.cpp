@@ -0,0 +1,298 @@
+#include "meshopt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+float simulateVertexCache(const unsigned int* indices, int num_indices, int num_vertices, int cache_size, float* atvr)
+{
+	//a vertex is in the cache if less than cache_size misses happened since it was loaded
+	std::vector<int> loaded_at(num_vertices, -cache_size - 1);
+	std::vector<bool> used(num_vertices, false);
+	int misses = 0;
+	int num_used = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		if (!used[v])
+		{
+			used[v] = true;
+			num_used++;
+		}
+		if (misses - loaded_at[v] >= cache_size)
+			loaded_at[v] = ++misses;
+	}
+
+	if (atvr)
+		*atvr = num_used ? misses / (float)num_used : 0.0f;
+	return num_indices >= 3 ? misses / (float)(num_indices / 3) : 0.0f;
+}
+
+//Forsyth's scoring, for a LRU cache bigger than the real one
+const int score_cache_size = 32;
+
+static float vertexScore(int cache_position, int remaining)
+{
+	if (remaining == 0)
+		return -1.0f;
+
+	float score = 0.0f;
+	if (cache_position >= 0)
+	{
+		//the last triangle vertices get a fixed score, so it doesn't favour any of them
+		if (cache_position < 3)
+			score = 0.75f;
+		else
+			score = powf(1.0f - (cache_position - 3) / (float)(score_cache_size - 3), 1.5f);
+	}
+
+	//vertices with few triangles left go first, so they don't end isolated
+	return score + 2.0f * powf((float)remaining, -0.5f);
+}
+
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices)
+{
+	int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return;
+
+	//triangles of every vertex, the ones already emitted are removed
+	std::vector<int> remaining(num_vertices, 0);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		remaining[indices[i]]++;
+	std::vector<int> offsets(num_vertices);
+	int offset = 0;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		offsets[i] = offset;
+		offset += remaining[i];
+	}
+	std::vector<int> adjacency(offset);
+	std::vector<int> cursors(offsets);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		adjacency[cursors[indices[i]]++] = i / 3;
+
+	std::vector<int> cache_position(num_vertices, -1);
+	std::vector<float> vertex_scores(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		vertex_scores[i] = vertexScore(-1, remaining[i]);
+
+	std::vector<float> triangle_scores(num_triangles);
+	for (int i = 0; i < num_triangles; ++i)
+		triangle_scores[i] = vertex_scores[indices[i * 3]] + vertex_scores[indices[i * 3 + 1]] + vertex_scores[indices[i * 3 + 2]];
+
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+
+	int cache[score_cache_size + 3];
+	int cache_count = 0;
+	int best = -1;
+	int next_unemitted = 0;
+
+	while (result.size() < num_triangles * 3)
+	{
+		//nothing in the cache is useful, start again from the next triangle
+		if (best == -1)
+		{
+			while (emitted[next_unemitted])
+				next_unemitted++;
+			best = next_unemitted;
+		}
+
+		emitted[best] = true;
+		const unsigned int* triangle = indices + best * 3;
+		int new_cache[score_cache_size + 3];
+		int new_count = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			int v = triangle[k];
+			result.push_back(v);
+
+			int* first = &adjacency[offsets[v]];
+			int* last = first + remaining[v] - 1;
+			int* it = std::find(first, last + 1, best);
+			std::swap(*it, *last);
+			remaining[v]--;
+
+			if (std::find(new_cache, new_cache + new_count, v) == new_cache + new_count)
+				new_cache[new_count++] = v;
+		}
+		int triangle_count = new_count; //less than 3 if it is degenerated
+
+		//the triangle vertices go to the front of the cache, the rest move back
+		for (int i = 0; i < cache_count; ++i)
+			if (std::find(new_cache, new_cache + triangle_count, cache[i]) == new_cache + triangle_count)
+				new_cache[new_count++] = cache[i];
+
+		for (int i = 0; i < new_count; ++i)
+		{
+			int v = new_cache[i];
+			cache_position[v] = i < score_cache_size ? i : -1;
+			float score = vertexScore(cache_position[v], remaining[v]);
+			float diff = score - vertex_scores[v];
+			vertex_scores[v] = score;
+			for (int j = 0; j < remaining[v]; ++j)
+				triangle_scores[adjacency[offsets[v] + j]] += diff;
+		}
+
+		cache_count = std::min(new_count, score_cache_size);
+		memcpy(cache, new_cache, cache_count * sizeof(int));
+
+		//only the triangles of the cached vertices can change their score
+		best = -1;
+		float best_score = -1.0f;
+		for (int i = 0; i < cache_count; ++i)
+		{
+			int v = cache[i];
+			for (int j = 0; j < remaining[v]; ++j)
+			{
+				int t = adjacency[offsets[v] + j];
+				if (triangle_scores[t] > best_score)
+				{
+					best = t;
+					best_score = triangle_scores[t];
+				}
+			}
+		}
+	}
+
+	memcpy(indices, &result[0], result.size() * sizeof(unsigned int));
+}
+
+struct sCluster {
+	int start; //in triangles
+	int length;
+	float sort_key;
+};
+
+static bool sortClusters(const sCluster& a, const sCluster& b)
+{
+	return a.sort_key > b.sort_key;
+}
+
+//a cluster is closed once its ACMR comes down to this times the one of the hard cluster it is part of (Tipsify)
+const float overdraw_threshold = 1.05f;
+
+//FIFO cache where a vertex is in the cache if less than cache_size misses happened since it was loaded,
+//moving the time forward cache_size misses empties it
+static int triangleMisses(const unsigned int* triangle, std::vector<int>& loaded_at, int& time, int cache_size)
+{
+	int misses = 0;
+	for (int k = 0; k < 3; ++k)
+		if (time - loaded_at[triangle[k]] >= cache_size)
+		{
+			loaded_at[triangle[k]] = ++time;
+			misses++;
+		}
+	return misses;
+}
+
+void optimizeOverdraw(unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, int cache_size)
+{
+	int num_triangles = num_indices / 3;
+	if (num_triangles < 2)
+		return;
+
+	//hard clusters end where a triangle misses its three vertices in the cache, sorting them keeps the cache order inside
+	std::vector<sCluster> hard_clusters;
+	std::vector<int> loaded_at(num_vertices, -cache_size - 1);
+	int time = 0;
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		if (triangleMisses(indices + i * 3, loaded_at, time, cache_size) == 3 || i == 0)
+		{
+			sCluster cluster = { i, 0, 0.0f };
+			hard_clusters.push_back(cluster);
+		}
+		hard_clusters.back().length++;
+	}
+
+	//they are split again where the ACMR since the last split is close to the one of the whole cluster,
+	//the vertices reloaded at the start of every piece cost little and the pieces can be sorted on their own
+	std::vector<sCluster> clusters;
+	for (int i = 0; i < hard_clusters.size(); ++i)
+	{
+		const sCluster& hard = hard_clusters[i];
+		int end = hard.start + hard.length;
+
+		time += cache_size;
+		int cluster_misses = 0;
+		for (int t = hard.start; t < end; ++t)
+			cluster_misses += triangleMisses(indices + t * 3, loaded_at, time, cache_size);
+		float threshold = overdraw_threshold * cluster_misses / hard.length;
+
+		time += cache_size;
+		int running_misses = 0;
+		sCluster cluster = { hard.start, 0, 0.0f };
+		for (int t = hard.start; t < end; ++t)
+		{
+			running_misses += triangleMisses(indices + t * 3, loaded_at, time, cache_size);
+			cluster.length++;
+			if (running_misses <= threshold * cluster.length && t + 1 < end)
+			{
+				clusters.push_back(cluster);
+				cluster.start = t + 1;
+				cluster.length = 0;
+				running_misses = 0;
+				time += cache_size;
+			}
+		}
+		clusters.push_back(cluster);
+	}
+	if (clusters.size() < 2)
+		return;
+
+	Vector3 mesh_center;
+	for (int i = 0; i < num_triangles * 3; ++i)
+		mesh_center = mesh_center + positions[indices[i]];
+	mesh_center = mesh_center * (1.0f / (num_triangles * 3));
+
+	//clusters in front of the center and facing out are the most likely to occlude the rest
+	for (int i = 0; i < clusters.size(); ++i)
+	{
+		sCluster& cluster = clusters[i];
+		Vector3 center;
+		Vector3 normal; //area weighted
+		for (int t = cluster.start; t < cluster.start + cluster.length; ++t)
+		{
+			const Vector3& a = positions[indices[t * 3]];
+			const Vector3& b = positions[indices[t * 3 + 1]];
+			const Vector3& c = positions[indices[t * 3 + 2]];
+			center = center + (a + b + c) * (1.0f / 3.0f);
+			normal = normal + (b - a).cross(c - a);
+		}
+		center = center * (1.0f / cluster.length);
+		float length = normal.length();
+		if (length > 0.0f)
+			normal = normal * (1.0f / length);
+		cluster.sort_key = (center - mesh_center).dot(normal);
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), sortClusters);
+
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+	for (int i = 0; i < clusters.size(); ++i)
+		result.insert(result.end(), indices + clusters[i].start * 3, indices + (clusters[i].start + clusters[i].length) * 3);
+	memcpy(indices, &result[0], result.size() * sizeof(unsigned int));
+}
+
+int optimizeVertexFetch(unsigned int* indices, int num_indices, int num_vertices, std::vector<unsigned int>& remap)
+{
+	const unsigned int unused = 0xFFFFFFFF;
+	remap.assign(num_vertices, unused);
+	unsigned int next = 0;
+	for (int i = 0; i < num_indices; ++i)
+	{
+		unsigned int& v = remap[indices[i]];
+		if (v == unused)
+			v = next++;
+		indices[i] = v;
+	}
+
+	int num_used = (int)next;
+	for (int i = 0; i < num_vertices; ++i)
+		if (remap[i] == unused)
+			remap[i] = next++;
+	return num_used;
+}
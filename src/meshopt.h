@@ -0,0 +1,27 @@
+/*  Reordering of index buffers to make the most of the GPU: triangles are sorted for the post-transform
+	vertex cache (Forsyth's algorithm), grouped in clusters sorted to reduce overdraw, and the vertices
+	are reordered in the order they are used. Everything works on plain arrays, see Mesh::optimizeIndices.
+*/
+
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <vector>
+#include "framework.h"
+
+//simulates a FIFO vertex cache, returns the ACMR (vertices transformed per triangle)
+//and stores in atvr the vertices transformed per vertex used (1.0 is the best possible)
+float simulateVertexCache(const unsigned int* indices, int num_indices, int num_vertices, int cache_size = 16, float* atvr = NULL);
+
+//reorders the triangles to reuse the vertices in the cache
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices);
+
+//splits the triangles (already sorted for the cache) in clusters where the cache starts again
+//and sorts the clusters so the ones facing out of the mesh are drawn first
+void optimizeOverdraw(unsigned int* indices, int num_indices, const Vector3* positions, int num_vertices, int cache_size = 16);
+
+//fills remap with the new position of every vertex, in order of first use, and updates the indices
+//returns the number of vertices used (the unused ones go after them)
+int optimizeVertexFetch(unsigned int* indices, int num_indices, int num_vertices, std::vector<unsigned int>& remap);
+
+#endif
@@ -11,14 +11,18 @@
 #include "utils.h"
 #include "framework.h"
 #include "application.h"
+#include "lz.h"
+#include "loader.h"
+#include "bcn.h"
 
 #include <iostream>
 
 using namespace GTR;
 
-int Node::s_NodeID = 0;
+#define PREFAB_BIN_VERSION 4
 
-Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
+std::atomic<int> Node::s_NodeID(0);
+Node::Node() : visible(true), layers(0xFF), mesh(NULL), material(NULL), revision(0), parent(NULL)
 {
 	m_Id = s_NodeID++;
 }
@@ -37,6 +41,9 @@ Node::~Node()
 
 void Node::clear()
 {
+	if (children.size())
+		markEdited();
+
 	//delete children
 	for (int i = 0; i < children.size(); ++i)
 	{
@@ -67,10 +74,19 @@ void Node::removeChild(Node* child)
 			continue;
 		child->parent = NULL;
 		children.erase(children.begin() + i);
+		markEdited();
 		return;
 	}
 }
 
+void Node::markEdited()
+{
+	Node* root = this;
+	while (root->parent)
+		root = root->parent;
+	root->revision++;
+}
+
 Node* Node::findNode(const char* name)
 {
 	if (this->name == name)
@@ -151,8 +167,14 @@ void Node::renderInMenu()
 
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
+	if (ImGui::Checkbox("Visible", &visible))
+		markEdited();
+
 	//Model edit
+	Matrix44 prev_model = model;
 	ImGuiMatrix44(model, "Model");
+	if (memcmp(prev_model.m, model.m, sizeof(model.m)) != 0)
+		markEdited();
 
 	//Material
 	if (material && ImGui::TreeNode(material, "Material"))
@@ -181,12 +203,15 @@ Prefab::Prefab()
 {
 }
 
+static LoadingSet loading_prefabs; //its mutex protects sPrefabsLoaded, prefabs can be loaded from the Loader threads
+
 Prefab::~Prefab()
 {
 	if (name.size())
 	{
+		std::lock_guard<std::mutex> lock(loading_prefabs.mutex);
 		auto it = sPrefabsLoaded.find(name);
-		if (it != sPrefabsLoaded.end())
+		if (it != sPrefabsLoaded.end() && it->second == this)
 			sPrefabsLoaded.erase(it);
 	}
 }
@@ -197,33 +222,56 @@ void Prefab::updateBounding()
 }
 
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+bool Prefab::use_binary = true;
 
 Prefab* Prefab::Get(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
-	if (it != sPrefabsLoaded.end())
-		return it->second;
+
+	//if another thread is loading it, wait for it instead of loading it twice
+	{
+		std::unique_lock<std::mutex> lock(loading_prefabs.mutex);
+		do
+		{
+			std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
+			if (it != sPrefabsLoaded.end())
+				return it->second;
+		} while (!loading_prefabs.claim(lock, filename));
+	}
 
 	Prefab* prefab = nullptr;
+	std::string binfilename = std::string(filename) + ".pbin";
 	{
+		if (use_binary)
+			prefab = readBin(binfilename.c_str(), filename);
 		if (!prefab)
+		{
 			prefab = loadGLTF(filename);
+			//writing reads the textures back from the GPU, it is queued after their uploads
+			if (prefab && use_binary)
+			{
+				std::string source = filename;
+				Loader::stream(0, [prefab, binfilename, source]() { prefab->writeBin(binfilename.c_str(), source.c_str()); });
+			}
+		}
 		if (!prefab) {
 			std::cout << "[ERROR]: Prefab not found" << std::endl;
+			loading_prefabs.release(filename);
 			return NULL;
 		}
 	}
 
 	std::string name = filename;
-	prefab->registerPrefab(name);
 	prefab->updateBounding();
+	prefab->registerPrefab(name);
+	loading_prefabs.release(name);
 	return prefab;
 }
 
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
+	std::lock_guard<std::mutex> lock(loading_prefabs.mutex);
 	sPrefabsLoaded[name] = this;
 }
 
@@ -249,3 +297,599 @@ void Prefab::updateNodesByName()
 	nodes_by_name.clear();
 	updateInDepth(nodes_by_name, &root);
 }
+
+//PREFAB BIN: the parsed prefab with everything it uses (meshes as MBIN, textures already decoded) in one file,
+//tagged with the modification time and size of the source so it is rebuilt when the source changes
+
+struct sPrefabBinInfo {
+	int version;
+	int header_bytes;
+	uint64 source_time;
+	uint64 source_size;
+	int num_dependencies; //buffers and images referenced by the gltf, each one stored as name, time and size
+	int num_textures;
+	int num_materials;
+	int num_meshes;
+	int mesh_options; //Mesh::getBinOptions of the meshes, written again when they change
+};
+
+struct sPrefabBinTexture {
+	int width;
+	int height;
+	int mipmaps;
+	int format; //-1 for RGBA pixels, otherwise the eBlockFormat of the levels stored
+	int num_levels;
+	int bytes; //RGBA pixels or blocks
+	int compressed_bytes; //0 if not compressed (with lz)
+};
+
+struct sPrefabBinMaterial {
+	int alpha_mode;
+	float alpha_cutoff;
+	int two_sided;
+	Vector4 color;
+	float roughness_factor;
+	float metallic_factor;
+	Vector3 emissive_factor;
+	int textures[6]; //index in the textures of the bin, -1 if none
+	int uv_channels[6];
+};
+
+struct sPrefabBinNode {
+	int visible;
+	int layers;
+	Matrix44 model;
+	int mesh; //index in the meshes of the bin, -1 if none
+	int material;
+	int num_children;
+};
+
+static void writeBinString(FILE* f, const std::string& str)
+{
+	int length = (int)str.size();
+	fwrite(&length, sizeof(int), 1, f);
+	fwrite(str.c_str(), 1, length, f);
+}
+
+//reads from memory checking it doesn't go past the end, once it fails every read fails
+struct sBinReader {
+	const char* pos;
+	const char* end;
+	bool ok;
+
+	bool read(void* dst, size_t bytes) {
+		ok = ok && bytes <= (size_t)(end - pos);
+		if (ok)
+		{
+			memcpy(dst, pos, bytes);
+			pos += bytes;
+		}
+		return ok;
+	}
+	std::string readString() {
+		int length = 0;
+		if (!read(&length, sizeof(int)) || length < 0 || length > end - pos)
+		{
+			ok = false;
+			return "";
+		}
+		std::string str(pos, length);
+		pos += length;
+		return str;
+	}
+};
+
+//the samplers in the order they are stored
+static void getSamplers(Material* material, Sampler** samplers)
+{
+	samplers[0] = &material->color_texture;
+	samplers[1] = &material->emissive_texture;
+	samplers[2] = &material->opacity_texture;
+	samplers[3] = &material->metallic_roughness_texture;
+	samplers[4] = &material->occlusion_texture;
+	samplers[5] = &material->normal_texture;
+}
+
+//assigns an index to every mesh, material and texture used by the nodes
+static void collectBinResources(Node* node, std::map<Mesh*, int>& meshes, std::map<Material*, int>& materials, std::map<Texture*, int>& textures, std::vector<Mesh*>& mesh_list, std::vector<Material*>& material_list, std::vector<Texture*>& texture_list)
+{
+	if (node->mesh && !meshes.count(node->mesh))
+	{
+		meshes[node->mesh] = (int)mesh_list.size();
+		mesh_list.push_back(node->mesh);
+	}
+	if (node->material && !materials.count(node->material))
+	{
+		materials[node->material] = (int)material_list.size();
+		material_list.push_back(node->material);
+		Sampler* samplers[6];
+		getSamplers(node->material, samplers);
+		for (int i = 0; i < 6; ++i)
+		{
+			Texture* texture = samplers[i]->texture;
+			if (texture && texture->texture_type == GL_TEXTURE_2D && !textures.count(texture))
+			{
+				textures[texture] = (int)texture_list.size();
+				texture_list.push_back(texture);
+			}
+		}
+	}
+	for (int i = 0; i < node->children.size(); ++i)
+		collectBinResources(node->children[i], meshes, materials, textures, mesh_list, material_list, texture_list);
+}
+
+//the nodes are read first to a flat list (parents before their children), the tree is built once the whole file is valid
+struct sBinNodeEntry {
+	std::string name;
+	sPrefabBinNode info;
+};
+
+//the same list from the tree, to write it
+static void collectBinNodes(Node* node, std::vector<sBinNodeEntry>& nodes, std::map<Mesh*, int>& meshes, std::map<Material*, int>& materials)
+{
+	sBinNodeEntry entry;
+	entry.name = node->name;
+	entry.info.visible = node->visible;
+	entry.info.layers = node->layers;
+	entry.info.model = node->model;
+	entry.info.mesh = node->mesh ? meshes[node->mesh] : -1;
+	entry.info.material = node->material ? materials[node->material] : -1;
+	entry.info.num_children = (int)node->children.size();
+	nodes.push_back(entry);
+	for (int i = 0; i < node->children.size(); ++i)
+		collectBinNodes(node->children[i], nodes, meshes, materials);
+}
+
+static bool readBinNodes(sBinReader& reader, std::vector<sBinNodeEntry>& nodes, int num_meshes, int num_materials, int depth = 0)
+{
+	sBinNodeEntry entry;
+	entry.name = reader.readString();
+	if (!reader.read(&entry.info, sizeof(entry.info)) || depth > 256 || entry.info.num_children < 0 ||
+		entry.info.mesh >= num_meshes || entry.info.material >= num_materials)
+		return false;
+	nodes.push_back(entry);
+	for (int i = 0; i < entry.info.num_children; ++i)
+		if (!readBinNodes(reader, nodes, num_meshes, num_materials, depth + 1))
+			return false;
+	return true;
+}
+
+//returns the index of the next node in the list
+static int buildBinNode(Node* node, const std::vector<sBinNodeEntry>& nodes, int index, std::vector<Mesh*>& meshes, std::vector<Material*>& materials)
+{
+	const sPrefabBinNode& info = nodes[index].info;
+	node->name = nodes[index].name;
+	node->visible = info.visible != 0;
+	node->layers = info.layers;
+	node->model = info.model;
+	node->mesh = info.mesh >= 0 ? meshes[info.mesh] : NULL;
+	node->material = info.material >= 0 ? materials[info.material] : NULL;
+	index++;
+	for (int i = 0; i < info.num_children; ++i)
+	{
+		Node* child = new Node();
+		node->addChild(child);
+		index = buildBinNode(child, nodes, index, meshes, materials);
+	}
+	return index;
+}
+
+//what writeBin reads on the main thread, the worker compresses it and writes the file
+struct sPrefabBinData {
+	std::string filename;
+	std::string source;
+	std::vector<std::string> texture_names;
+	std::vector<sPrefabBinTexture> textures;
+	std::vector<std::vector<uint8>> pixels; //RGBA or the blocks of all the levels
+	std::vector<std::string> material_names;
+	std::vector<sPrefabBinMaterial> materials;
+	std::vector<Mesh*> meshes; //their vectors don't change once they are uploaded
+	std::vector<sBinNodeEntry> nodes;
+};
+
+static bool writeBinData(sPrefabBinData* bin)
+{
+	sPrefabBinInfo info;
+	memset(&info, 0, sizeof(info));
+	info.version = PREFAB_BIN_VERSION;
+	info.header_bytes = sizeof(sPrefabBinInfo);
+	if (!getFileInfo(bin->source.c_str(), info.source_time, info.source_size))
+		return false;
+
+	std::vector<std::string> dependencies;
+	std::vector<uint64> dependencies_info;
+	getGLTFDependencies(bin->source.c_str(), dependencies);
+	for (int i = 0; i < dependencies.size(); ++i)
+	{
+		uint64 dep_time = 0, dep_size = 0;
+		if (!getFileInfo(dependencies[i].c_str(), dep_time, dep_size))
+			return false;
+		dependencies_info.push_back(dep_time);
+		dependencies_info.push_back(dep_size);
+	}
+	info.num_dependencies = (int)dependencies.size();
+	info.num_textures = (int)bin->textures.size();
+	info.num_materials = (int)bin->materials.size();
+	info.num_meshes = (int)bin->meshes.size();
+	info.mesh_options = Mesh::getBinOptions();
+
+	//write to a temporary file so a crash or a reader never sees half a file
+	std::string tmp_filename = bin->filename + ".tmp";
+	FILE* f = fopen(tmp_filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write prefab BIN: " << tmp_filename.c_str() << std::endl;
+		return false;
+	}
+
+	fwrite("PBIN", sizeof(char), 4, f);
+	fwrite(&info, sizeof(info), 1, f);
+	for (int i = 0; i < dependencies.size(); ++i)
+	{
+		writeBinString(f, dependencies[i]);
+		fwrite(&dependencies_info[i * 2], sizeof(uint64), 2, f);
+	}
+
+	//block compressed ones are stored as they are, lz doesn't gain much with them
+	std::vector<uint8> compressed;
+	for (int i = 0; i < bin->textures.size(); ++i)
+	{
+		sPrefabBinTexture& tex_info = bin->textures[i];
+		std::vector<uint8>& pixels = bin->pixels[i];
+		if (tex_info.format == -1)
+		{
+			tex_info.compressed_bytes = lzCompress(&pixels[0], tex_info.bytes, compressed);
+			if (tex_info.compressed_bytes >= tex_info.bytes)
+				tex_info.compressed_bytes = 0;
+		}
+		writeBinString(f, bin->texture_names[i]);
+		fwrite(&tex_info, sizeof(tex_info), 1, f);
+		if (tex_info.compressed_bytes)
+			fwrite(&compressed[0], 1, tex_info.compressed_bytes, f);
+		else
+			fwrite(&pixels[0], 1, tex_info.bytes, f);
+		std::vector<uint8>().swap(pixels);
+	}
+
+	for (int i = 0; i < bin->materials.size(); ++i)
+	{
+		writeBinString(f, bin->material_names[i]);
+		fwrite(&bin->materials[i], sizeof(sPrefabBinMaterial), 1, f);
+	}
+
+	//every mesh is a MBIN preceded by its size
+	bool ok = true;
+	for (int i = 0; i < bin->meshes.size() && ok; ++i)
+	{
+		writeBinString(f, bin->meshes[i]->name);
+		int bytes = 0;
+		long start = ftell(f);
+		fwrite(&bytes, sizeof(int), 1, f);
+		ok = bin->meshes[i]->writeBin(f);
+		long end = ftell(f);
+		bytes = (int)(end - start - sizeof(int));
+		fseek(f, start, SEEK_SET);
+		fwrite(&bytes, sizeof(int), 1, f);
+		fseek(f, end, SEEK_SET);
+	}
+
+	for (int i = 0; i < bin->nodes.size(); ++i)
+	{
+		writeBinString(f, bin->nodes[i].name);
+		fwrite(&bin->nodes[i].info, sizeof(sPrefabBinNode), 1, f);
+	}
+	ok = ok && !ferror(f);
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+	{
+		remove(tmp_filename.c_str());
+		return false;
+	}
+
+	remove(bin->filename.c_str()); //rename doesnt overwrite on windows
+	if (rename(tmp_filename.c_str(), bin->filename.c_str()) != 0)
+	{
+		std::cout << "[ERROR] cannot write prefab BIN: " << bin->filename << std::endl;
+		remove(tmp_filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+void Prefab::writeBin(const char* filename, const char* source)
+{
+	sPrefabBinData* bin = new sPrefabBinData();
+	bin->filename = filename;
+	bin->source = source;
+
+	std::map<Mesh*, int> meshes;
+	std::map<Material*, int> materials;
+	std::map<Texture*, int> textures;
+	std::vector<Material*> material_list;
+	std::vector<Texture*> texture_list;
+	collectBinResources(&root, meshes, materials, textures, bin->meshes, material_list, texture_list);
+	collectBinNodes(&root, bin->nodes, meshes, materials);
+
+	//only the textures are read back here, from the GPU, the decoded images are not kept
+	Image image;
+	CompressedImage blocks;
+	bin->textures.resize(texture_list.size());
+	bin->pixels.resize(texture_list.size());
+	for (int i = 0; i < texture_list.size(); ++i)
+	{
+		Texture* texture = texture_list[i];
+		sPrefabBinTexture& tex_info = bin->textures[i];
+		tex_info.mipmaps = texture->mipmaps;
+		tex_info.compressed_bytes = 0;
+		bin->texture_names.push_back(texture->filename);
+
+		eBlockFormat block_format;
+		if (blockFormatFromGL(texture->internal_format, block_format))
+		{
+			blocks.fromTexture(texture);
+			tex_info.width = blocks.width;
+			tex_info.height = blocks.height;
+			tex_info.format = blocks.format;
+			tex_info.num_levels = blocks.num_levels;
+			tex_info.bytes = (int)blocks.data.size();
+			bin->pixels[i].swap(blocks.data);
+			continue;
+		}
+
+		image.fromTexture(texture);
+		tex_info.width = image.width;
+		tex_info.height = image.height;
+		tex_info.format = -1;
+		tex_info.num_levels = 1;
+		tex_info.bytes = image.width * image.height * 4;
+		bin->pixels[i].assign(image.data, image.data + tex_info.bytes);
+	}
+
+	for (int i = 0; i < material_list.size(); ++i)
+	{
+		Material* material = material_list[i];
+		sPrefabBinMaterial mat_info;
+		mat_info.alpha_mode = material->alpha_mode;
+		mat_info.alpha_cutoff = material->alpha_cutoff;
+		mat_info.two_sided = material->two_sided;
+		mat_info.color = material->color;
+		mat_info.roughness_factor = material->roughness_factor;
+		mat_info.metallic_factor = material->metallic_factor;
+		mat_info.emissive_factor = material->emissive_factor;
+		Sampler* samplers[6];
+		getSamplers(material, samplers);
+		for (int j = 0; j < 6; ++j)
+		{
+			Texture* texture = samplers[j]->texture;
+			mat_info.textures[j] = texture && textures.count(texture) ? textures[texture] : -1;
+			mat_info.uv_channels[j] = samplers[j]->uv_channel;
+		}
+		bin->material_names.push_back(material->name);
+		bin->materials.push_back(mat_info);
+	}
+
+	//the compression of the textures, the meshes and the file in a worker, the frame doesn't wait for them
+	Loader::run([bin]() {
+		writeBinData(bin);
+		delete bin;
+	});
+}
+
+Prefab* Prefab::readBin(const char* filename, const char* source)
+{
+	double time = getTime();
+
+	sMappedFile* file = mapFile(filename);
+	if (!file)
+		return NULL;
+
+	sBinReader reader = { file->data, file->data + file->size, true };
+	char watermark[4];
+	sPrefabBinInfo info;
+	uint64 source_time = 0, source_size = 0;
+	getFileInfo(source, source_time, source_size);
+	if (!reader.read(watermark, 4) || memcmp(watermark, "PBIN", 4) != 0 || !reader.read(&info, sizeof(info)) ||
+		info.version != PREFAB_BIN_VERSION || info.header_bytes != sizeof(sPrefabBinInfo))
+	{
+		std::cout << "[WARN] loading prefab BIN: invalid or old version: " << filename << std::endl;
+		unmapFile(file);
+		return NULL;
+	}
+	if (info.source_time != source_time || info.source_size != source_size || info.mesh_options != Mesh::getBinOptions())
+	{
+		std::cout << "[WARN] loading prefab BIN: outdated, " << source << " or the cook options changed" << std::endl;
+		unmapFile(file);
+		return NULL;
+	}
+	for (int i = 0; i < info.num_dependencies; ++i)
+	{
+		std::string dependency = reader.readString();
+		uint64 dep_info[2];
+		uint64 dep_time = 0, dep_size = 0;
+		if (!reader.read(dep_info, sizeof(dep_info)) || !getFileInfo(dependency.c_str(), dep_time, dep_size) ||
+			dep_info[0] != dep_time || dep_info[1] != dep_size)
+		{
+			std::cout << "[WARN] loading prefab BIN: outdated, " << dependency << " changed" << std::endl;
+			unmapFile(file);
+			return NULL;
+		}
+	}
+
+	std::cout << " + Prefab loading: " << filename << " ... ";
+
+	//nothing is created or registered until the whole file has been parsed, so a corrupt file leaves nothing behind
+	//textures and materials already loaded (by name) are shared, like the glTF loader does
+	std::vector<Texture*> textures(info.num_textures, (Texture*)NULL);
+	std::vector<std::string> texture_names(info.num_textures);
+	std::vector<sPrefabBinTexture> texture_infos(info.num_textures);
+	std::vector<Image*> images(info.num_textures, (Image*)NULL);
+	std::vector<CompressedImage*> blocks(info.num_textures, (CompressedImage*)NULL);
+	for (int i = 0; i < info.num_textures && reader.ok; ++i)
+	{
+		std::string name = reader.readString();
+		sPrefabBinTexture& tex_info = texture_infos[i];
+		if (!reader.read(&tex_info, sizeof(tex_info)) || tex_info.width <= 0 || tex_info.height <= 0 || tex_info.format < -1 || tex_info.format > BC5)
+		{
+			reader.ok = false;
+			break;
+		}
+		CompressedImage level_info;
+		if (tex_info.format >= 0)
+		{
+			level_info.format = (eBlockFormat)tex_info.format;
+			level_info.width = tex_info.width;
+			level_info.height = tex_info.height;
+			reader.ok = tex_info.num_levels > 0 && tex_info.num_levels <= 32 && tex_info.bytes == level_info.levelOffset(tex_info.num_levels) && !tex_info.compressed_bytes;
+		}
+		else
+			reader.ok = tex_info.bytes == tex_info.width * tex_info.height * 4;
+		int stored = tex_info.compressed_bytes ? tex_info.compressed_bytes : tex_info.bytes;
+		if (!reader.ok || stored < 0 || stored > reader.end - reader.pos)
+		{
+			reader.ok = false;
+			break;
+		}
+
+		texture_names[i] = name;
+		textures[i] = name.size() ? Texture::Find(name.c_str()) : NULL;
+		if (!textures[i] && tex_info.format >= 0)
+		{
+			blocks[i] = new CompressedImage();
+			blocks[i]->format = level_info.format;
+			blocks[i]->width = tex_info.width;
+			blocks[i]->height = tex_info.height;
+			blocks[i]->num_levels = tex_info.num_levels;
+			blocks[i]->data.assign((const uint8*)reader.pos, (const uint8*)reader.pos + stored);
+		}
+		else if (!textures[i])
+		{
+			images[i] = new Image();
+			images[i]->resize(tex_info.width, tex_info.height, 4);
+			if (tex_info.compressed_bytes)
+				reader.ok = lzDecompress((const uint8*)reader.pos, stored, images[i]->data, tex_info.bytes);
+			else
+				memcpy(images[i]->data, reader.pos, tex_info.bytes);
+		}
+		reader.pos += stored;
+	}
+
+	std::vector<std::string> material_names(info.num_materials);
+	std::vector<sPrefabBinMaterial> material_infos(info.num_materials);
+	for (int i = 0; i < info.num_materials && reader.ok; ++i)
+	{
+		material_names[i] = reader.readString();
+		reader.read(&material_infos[i], sizeof(sPrefabBinMaterial));
+	}
+
+	//meshes are parsed to new meshes, not registered yet
+	std::vector<Mesh*> meshes(info.num_meshes, (Mesh*)NULL);
+	std::vector<std::string> mesh_names(info.num_meshes);
+	std::vector<bool> new_meshes(info.num_meshes, false);
+	for (int i = 0; i < info.num_meshes && reader.ok; ++i)
+	{
+		mesh_names[i] = reader.readString();
+		int bytes = 0;
+		if (!reader.read(&bytes, sizeof(int)) || bytes < 0 || bytes > reader.end - reader.pos)
+		{
+			reader.ok = false;
+			break;
+		}
+
+		meshes[i] = mesh_names[i].size() ? Mesh::Get(mesh_names[i].c_str(), false, true) : NULL;
+		if (!meshes[i])
+		{
+			meshes[i] = new Mesh();
+			new_meshes[i] = true;
+			if (!meshes[i]->readBinFromMemory(reader.pos, bytes))
+			{
+				reader.ok = false;
+				break;
+			}
+		}
+		reader.pos += bytes;
+	}
+
+	std::vector<sBinNodeEntry> nodes;
+	if (reader.ok)
+		reader.ok = readBinNodes(reader, nodes, info.num_meshes, info.num_materials);
+	unmapFile(file);
+
+	if (!reader.ok)
+	{
+		std::cout << "[ERROR] corrupt file" << std::endl;
+		for (int i = 0; i < info.num_textures; ++i)
+		{
+			delete images[i];
+			delete blocks[i];
+		}
+		for (int i = 0; i < info.num_meshes; ++i)
+			if (new_meshes[i])
+				delete meshes[i];
+		return NULL;
+	}
+
+	//everything is valid, now the resources can be created and shared
+	for (int i = 0; i < info.num_textures; ++i)
+	{
+		if (textures[i])
+			continue;
+		Texture* texture = new Texture();
+		if (blocks[i])
+			texture->streamFromCompressed(blocks[i]);
+		else
+			texture->streamFromImage(images[i], texture_infos[i].mipmaps != 0);
+		if (texture_names[i].size())
+			texture->setName(texture_names[i].c_str());
+		textures[i] = texture;
+	}
+
+	std::vector<Material*> materials(info.num_materials, (Material*)NULL);
+	for (int i = 0; i < info.num_materials; ++i)
+	{
+		const std::string& name = material_names[i];
+		const sPrefabBinMaterial& mat_info = material_infos[i];
+		Material* material = name.size() ? Material::Get(name.c_str()) : NULL;
+		if (!material)
+		{
+			material = new Material();
+			material->alpha_mode = (eAlphaMode)mat_info.alpha_mode;
+			material->alpha_cutoff = mat_info.alpha_cutoff;
+			material->two_sided = mat_info.two_sided != 0;
+			material->color = mat_info.color;
+			material->roughness_factor = mat_info.roughness_factor;
+			material->metallic_factor = mat_info.metallic_factor;
+			material->emissive_factor = mat_info.emissive_factor;
+			Sampler* samplers[6];
+			getSamplers(material, samplers);
+			for (int j = 0; j < 6; ++j)
+			{
+				int index = mat_info.textures[j];
+				samplers[j]->texture = index >= 0 && index < textures.size() ? textures[index] : NULL;
+				samplers[j]->uv_channel = mat_info.uv_channels[j];
+			}
+			if (name.size())
+				material = Material::GetOrRegister(name.c_str(), material);
+		}
+		materials[i] = material;
+	}
+
+	for (int i = 0; i < info.num_meshes; ++i)
+	{
+		if (!new_meshes[i])
+			continue;
+		Mesh* mesh = meshes[i];
+		if (Mesh::interleave_meshes)
+			mesh->interleaveBuffers();
+		mesh->streamToVRAM();
+		if (mesh_names[i].size())
+			mesh->registerMesh(mesh_names[i]);
+	}
+
+	Prefab* prefab = new Prefab();
+	buildBinNode(&prefab->root, nodes, 0, meshes, materials);
+
+	prefab->updateNodesByName();
+	prefab->updateBounding();
+	std::cout << "[OK BIN] Meshes: " << info.num_meshes << " Textures: " << info.num_textures << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return prefab;
+}
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <map>
 #include <string>
+#include <atomic>
 
 #include "material.h"
 #include "scene.h"
@@ -26,7 +27,7 @@ namespace GTR {
 	class Node
 	{
 	public:
-		static int s_NodeID;
+		static std::atomic<int> s_NodeID;
 		int m_Id;
 
 	public:
@@ -46,6 +47,8 @@ namespace GTR {
 
 		BoundingBox aabb; //node bounding box in world space
 
+		int revision; //only kept in the root, increased by markEdited so the render calls of the tree are built again
+
 		//info to create the tree
 		Node* parent;
 		std::vector<Node*> children;
@@ -73,6 +76,9 @@ namespace GTR {
 		}
 		void removeChild(Node* child);
 
+		//call it after changing the model, visibility, mesh, material or children of a node of a tree in use
+		void markEdited();
+
 		//compute the global matrix taking into account its parent
 		Matrix44 getGlobalMatrix(bool fast = false) { 
 			if (parent)
@@ -112,8 +118,14 @@ namespace GTR {
 
 				//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
+		static bool use_binary; //Get loads the .pbin next to the file if it is up to date, or writes it
 		static Prefab* Get(const char* filename);
 		void registerPrefab(std::string name);
+
+		//prefab with its meshes, materials and decoded textures in one file, source is the file it comes from
+		//main thread: the textures are read back here, the file is compressed and written in a worker
+		void writeBin(const char* filename, const char* source);
+		static Prefab* readBin(const char* filename, const char* source);
 	};
 
 };
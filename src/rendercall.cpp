@@ -1,17 +1,150 @@
 #include "rendercall.h"
+#include "texture.h"
 
+#include <cassert>
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <map>
 
 using namespace GTR;
 
+int sCopyCounter::count = 0;
+
+//bits of the texture set and the material ids in the sort key
+const int state_id_bits = 18;
+
+struct sTextureSet {
+	Texture* textures[4];
+	bool operator < (const sTextureSet& b) const { return memcmp(textures, b.textures, sizeof(textures)) < 0; }
+};
+
+//the textures that define the texture set of a material
+static void getStateTextures(Material* material, Texture** textures)
+{
+	textures[0] = material->color_texture.texture;
+	textures[1] = material->emissive_texture.texture;
+	textures[2] = material->metallic_roughness_texture.texture;
+	textures[3] = material->normal_texture.texture;
+}
+
+//returns a small id shared by all the materials that use the same textures
+int getTextureSetId(Material* material)
+{
+	static std::map<sTextureSet, int> texture_sets;
+
+	sTextureSet set;
+	getStateTextures(material, set.textures);
+
+	std::map<sTextureSet, int>::iterator it = texture_sets.find(set);
+	if (it != texture_sets.end())
+		return it->second;
+
+	int id = texture_sets.size();
+	texture_sets[set] = id;
+	return id;
+}
+
 RenderCall::RenderCall(Mesh* mesh, Material* material, Matrix44& model)
 {
 	this->mesh = mesh;
 	this->material = material;
 	this->model = model;
 	probe = NULL;
+	entity = NULL;
+	node = NULL;
 
 	cam_dist = 0;
-}
\ No newline at end of file
+	sort_key = 0;
+	updateStateKey();
+}
+
+void RenderCall::updateStateKey()
+{
+	//materials sharing the same textures get the same texture set id, so they are drawn together
+	getStateTextures(material, state_textures);
+	uint64 texture_set = getTextureSetId(material);
+	uint64 material_id = material->m_Id;
+	assert(texture_set < (1 << state_id_bits) && material_id < (1 << state_id_bits) && "too many materials for the sort key");
+	state_key = (texture_set << state_id_bits) | material_id;
+}
+
+void RenderCall::updateSortKey(Camera* camera)
+{
+	const uint64 depth_max = (1 << 24) - 1;
+
+	//the textures of the material can be changed after the call is built
+	Texture* textures[4];
+	getStateTextures(material, textures);
+	if (memcmp(textures, state_textures, sizeof(textures)) != 0)
+		updateStateKey();
+
+	//quantize the distance to the camera in 24 bits
+	uint64 depth = 0;
+	if (camera && camera->far_plane > 0)
+		depth = (uint64)(clamp(cam_dist / camera->far_plane, 0.0f, 1.0f) * depth_max);
+
+	uint64 alpha = (uint64)material->alpha_mode;
+	uint64 two_sided = material->two_sided ? 1 : 0;
+	uint64 state = (two_sided << (2 * state_id_bits)) | state_key;
+
+	if (material->alpha_mode == BLEND)
+		sort_key = (alpha << 62) | ((depth_max - depth) << (2 * state_id_bits + 1)) | state; //back to front
+	else
+		sort_key = (alpha << 62) | (state << 24) | depth; //grouped by state, then front to back
+}
+
+void GTR::sortRenderCalls(const std::vector<RenderCall>& calls, std::vector<int>& order)
+{
+	//reuse the buffer between frames to avoid allocations
+	static std::vector<uint64> keys;
+
+	int num = calls.size();
+	keys.resize(num);
+	order.resize(num);
+	for (int i = 0; i < num; ++i)
+	{
+		keys[i] = calls[i].sort_key;
+		order[i] = i;
+	}
+	radixSort(keys, order);
+}
+
+void GTR::radixSort(std::vector<uint64>& keys, std::vector<int>& order)
+{
+	//reuse the buffers between calls to avoid allocations
+	static std::vector<uint64> keys_tmp;
+	static std::vector<int> order_tmp;
+
+	int num = keys.size();
+	if (!num)
+		return;
+	keys_tmp.resize(num);
+	order_tmp.resize(num);
+
+	uint64 diff = 0; //bits that change between keys, passes over equal bytes are skipped
+	for (int i = 0; i < num; ++i)
+		diff |= keys[i] ^ keys[0];
+
+	//least significant digit radix sort, 8 bits per pass
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		if (((diff >> shift) & 0xFF) == 0)
+			continue;
+
+		int count[257] = { 0 };
+		for (int i = 0; i < num; ++i)
+			count[((keys[i] >> shift) & 0xFF) + 1]++;
+		for (int i = 0; i < 256; ++i)
+			count[i + 1] += count[i];
+
+		for (int i = 0; i < num; ++i)
+		{
+			int pos = count[(keys[i] >> shift) & 0xFF]++;
+			keys_tmp[pos] = keys[i];
+			order_tmp[pos] = order[i];
+		}
+		keys.swap(keys_tmp);
+		order.swap(order_tmp);
+	}
+}
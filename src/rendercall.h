@@ -6,6 +6,17 @@
 
 namespace GTR {
 
+	//counts how many times it is copied, used to check that passes don't copy the calls (moves are not counted)
+	struct sCopyCounter
+	{
+		static int count;
+		sCopyCounter() {}
+		sCopyCounter(const sCopyCounter& c) { count++; }
+		sCopyCounter(sCopyCounter&& c) = default;
+		sCopyCounter& operator = (const sCopyCounter& c) { count++; return *this; }
+		sCopyCounter& operator = (sCopyCounter&& c) = default;
+	};
+
 	class RenderCall
 	{
 	public:
@@ -13,18 +24,32 @@ namespace GTR {
 		Material* material;
 		Matrix44 model;
 		ReflectionProbeEntity* probe;
+		BaseEntity* entity; //entity that generated this call
+		Node* node; //node of the prefab of the entity that generated this call
+		BoundingBox world_bounding; //mesh bounding box in world space
 
 		float cam_dist;
 
+		//packed key used to sort the calls, from most to least significant bits:
+		//opaque: alpha mode (2) | two sided (1) | texture set (18) | material (18) | depth (24, front to back)
+		//blend:  alpha mode (2) | depth (24, back to front) | two sided (1) | texture set (18) | material (18)
+		uint64 sort_key;
+		uint64 state_key; //texture set and material ids, computed again when the textures of the material change
+		Texture* state_textures[4]; //textures of the material when state_key was computed
+
+		sCopyCounter copies;
+
 		RenderCall(Mesh* mesh, Material* material, Matrix44& model);
 
-		bool operator < (RenderCall& b) const
-		{
-			if (material->alpha_mode != b.material->alpha_mode)
-				return material->alpha_mode <= b.material->alpha_mode;
-			else {
-				return cam_dist > b.cam_dist;
-			}
-		}
+		//computes the sort key using the distance to the camera (cam_dist must be updated) and the current material state
+		void updateSortKey(Camera* camera);
+
+	private:
+		void updateStateKey();
 	};
+
+	//sorts the indices of the calls by their sort key (radix sort)
+	void sortRenderCalls(const std::vector<RenderCall>& calls, std::vector<int>& order);
+	//sorts the indices by their keys, both are reordered (stable, they are the same size)
+	void radixSort(std::vector<uint64>& keys, std::vector<int>& order);
 }
@@ -9,9 +9,13 @@
 #include "scene.h"
 #include "extra/hdre.h"
 #include "rendercall.h"
+#include "glstate.h"
+#include "loader.h"
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <deque>
+#include <map>
 #include "math.h"
 
 using namespace GTR;
@@ -57,8 +61,14 @@ Renderer::Renderer()
 
 	show_reflection_probes = false;
 	show_probes = false;
+	instancing = true;
 	reflections_calculated = false;
 
+	retained_frame = 0;
+	num_calls_rebuilt = 0;
+	memset(pass_shaders, 0, sizeof(pass_shaders));
+	memset(block_buffers, 0, sizeof(block_buffers));
+
 	gbuffers_fbo = new FBO();
 	decals_fbo = new FBO();
 
@@ -90,6 +100,31 @@ Renderer::Renderer()
 	irr_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT, false);
 	probes_texture = NULL;
 
+	//two sets of pixel buffers, one is read back while the other receives the next probe
+	int face_bytes = irr_fbo->width * irr_fbo->height * 3 * sizeof(float);
+	for (int i = 0; i < 2; ++i)
+	{
+		probe_readbacks[i].probe = -1;
+		probe_readbacks[i].fence = 0;
+		glGenBuffers(6, probe_readbacks[i].pbos);
+		for (int j = 0; j < 6; ++j)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, probe_readbacks[i].pbos[j]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, face_bytes, NULL, GL_STREAM_READ);
+		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	next_readback = 0;
+	probes_per_frame = 4;
+	probe_influence = 1.5;
+	probes_from_bake = false;
+
+	//projection of the probes in the GPU: the rows of every face are summed first, then the rows into the probes texture
+	gpu_sh_projection = true;
+	sh_rows_fbo = new FBO();
+	sh_rows_fbo->create(9, irr_fbo->height, 1, GL_RGB, GL_FLOAT, false);
+	probes_fbo = new FBO();
+
 	//FBO para clacular las reflexiones
 	reflections_fbo = new FBO();
 	reflections_fbo->create(w, h,
@@ -136,30 +171,400 @@ void Renderer::getCallsFromNode(const Matrix44& prefab_model, GTR::Node* node, C
 
 		//Create RenderCall
 		RenderCall call = RenderCall(node->mesh, node->material, node_model);
+		call.world_bounding = world_bounding;
+		call.node = node;
 
 		if (camera)
 			call.cam_dist = world_bounding.center.distance(camera->eye);
 
 		//Calculamos la probe mas cercana por call por si las desplazamos poder ver la diferencia
-		float dist = FLT_MAX;
+		assignProbe(call);
+		calls.push_back(call);
+	}
+
+	//iterate recursively with children
+	for (int i = 0; i < node->children.size(); ++i)
+		getCallsFromNode(prefab_model, node->children[i], camera);
+}
+
+void Renderer::assignProbe(RenderCall& call)
+{
+	call.probe = NULL;
+	float dist = FLT_MAX;
+	for (int i = 0; i < reflection_probes.size(); ++i)
+	{
+		ReflectionProbeEntity* p = reflection_probes[i];
+		Vector3 pos = p->model.getTranslation();
+		float dist_probe = pos.distance(call.model.getTranslation());
+
+		if (dist_probe < dist)
+		{
+			dist = dist_probe;
+			call.probe = p;
+		}
+	}
+}
+
+void Renderer::invalidateCalls()
+{
+	calls.clear();
+	retained_prefabs.clear();
+}
+
+void Renderer::updateCalls(Scene* scene, Camera* camera)
+{
+	retained_frame++;
+	num_calls_rebuilt = 0;
+
+	//first mark the prefab entities that are new or have changed since the last fetch:
+	//a different prefab or an edited node builds the calls of the entity again, a different model only moves them
+	int num_dirty = 0;
+	int num_moved = 0;
+	int num_alive = 0;
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->entity_type != PREFAB)
+			continue;
+
+		PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+		if (!pent->prefab)
+			continue;
+
+		num_alive++;
+		std::map<PrefabEntity*, sRetainedPrefab>::iterator it = retained_prefabs.find(pent);
+		if (it == retained_prefabs.end() || it->second.entity_id != pent->m_Id)
+		{
+			sRetainedPrefab& r = retained_prefabs[pent];
+			r.entity_id = pent->m_Id;
+			r.prefab = pent->prefab;
+			r.revision = pent->prefab->root.revision;
+			r.model = pent->model;
+			r.frame = retained_frame;
+			r.dirty = true;
+			r.moved = false;
+			num_dirty++;
+			continue;
+		}
+
+		sRetainedPrefab& r = it->second;
+		r.dirty = r.prefab != pent->prefab || r.revision != pent->prefab->root.revision;
+		r.moved = !r.dirty && memcmp(r.model.m, pent->model.m, sizeof(r.model.m)) != 0;
+		r.prefab = pent->prefab;
+		r.revision = pent->prefab->root.revision;
+		r.model = pent->model;
+		r.frame = retained_frame;
+		if (r.dirty)
+			num_dirty++;
+		if (r.moved)
+			num_moved++;
+	}
+
+	//nodes that got another mesh or material, or were hidden, without markEdited (the calls of an entity are contiguous)
+	PrefabEntity* last_entity = NULL;
+	sRetainedPrefab* last_retained = NULL;
+	for (int i = 0; i < calls.size(); ++i)
+	{
+		RenderCall& call = calls[i];
+		if (call.entity != last_entity)
+		{
+			last_entity = (PrefabEntity*)call.entity;
+			std::map<PrefabEntity*, sRetainedPrefab>::iterator it = retained_prefabs.find(last_entity);
+			last_retained = it != retained_prefabs.end() && it->second.frame == retained_frame ? &it->second : NULL;
+		}
+		if (!last_retained || last_retained->dirty)
+			continue;
+		if (!call.node->visible || call.node->mesh != call.mesh || call.node->material != call.material)
+		{
+			last_retained->dirty = true;
+			last_retained->moved = false;
+			num_dirty++;
+		}
+	}
+
+	//once the probes are baked, the places where the geometry changes have to be baked again
+	bool track_changes = probes_texture != NULL;
+
+	//remove the calls of entities that changed, were hidden or removed from the scene
+	bool calls_changed = num_dirty || num_alive != retained_prefabs.size();
+	if (calls_changed)
+	{
+		std::vector<RenderCall>::iterator last = std::remove_if(calls.begin(), calls.end(), [this, track_changes](const RenderCall& call) {
+			std::map<PrefabEntity*, sRetainedPrefab>::iterator it = retained_prefabs.find((PrefabEntity*)call.entity);
+			bool removed = it == retained_prefabs.end() || it->second.dirty || it->second.frame != retained_frame;
+			if (removed && track_changes)
+				changed_boxes.push_back(call.world_bounding);
+			return removed;
+		});
+		calls.erase(last, calls.end());
+
+		for (std::map<PrefabEntity*, sRetainedPrefab>::iterator it = retained_prefabs.begin(); it != retained_prefabs.end();)
+		{
+			if (it->second.frame != retained_frame)
+				it = retained_prefabs.erase(it);
+			else
+				++it;
+		}
+	}
+
+	//the entities that only moved keep their calls, the global matrices of the nodes are still valid
+	if (num_moved)
+	{
+		last_entity = NULL;
+		last_retained = NULL;
+		for (int i = 0; i < calls.size(); ++i)
+		{
+			RenderCall& call = calls[i];
+			if (call.entity != last_entity)
+			{
+				last_entity = (PrefabEntity*)call.entity;
+				last_retained = &retained_prefabs[last_entity];
+			}
+			if (!last_retained->moved)
+				continue;
+			if (track_changes)
+				changed_boxes.push_back(call.world_bounding);
+			call.model = call.node->global_model * last_retained->model;
+			call.world_bounding = transformBoundingBox(call.model, call.mesh->box);
+			if (track_changes)
+				changed_boxes.push_back(call.world_bounding);
+		}
+	}
+
+	//check if the reflection probes moved since the calls were assigned to them
+	bool probes_changed = retained_probes.size() != reflection_probes.size();
+	if (!probes_changed)
+		for (int i = 0; i < reflection_probes.size(); ++i)
+			if (retained_probes[i].distance(reflection_probes[i]->model.getTranslation()) != 0.0f)
+				probes_changed = true;
+	if (probes_changed)
+	{
+		retained_probes.resize(reflection_probes.size());
 		for (int i = 0; i < reflection_probes.size(); ++i)
+			retained_probes[i] = reflection_probes[i]->model.getTranslation();
+	}
+
+	//now walk again only the nodes of the dirty entities
+	if (num_dirty)
+	{
+		for (int i = 0; i < scene->entities.size(); ++i)
 		{
-			ReflectionProbeEntity* p = reflection_probes[i];
-			Vector3 pos = p->model.getTranslation();
-			float dist_probe = pos.distance(call.model.getTranslation());
+			BaseEntity* ent = scene->entities[i];
+			if (!ent->visible || ent->entity_type != PREFAB)
+				continue;
 
-			if (dist_probe < dist)
+			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+			if (!pent->prefab || !retained_prefabs[pent].dirty)
+				continue;
+
+			int first = calls.size();
+			getCallsFromPrefab(ent->model, pent->prefab, camera);
+			for (int j = first; j < calls.size(); ++j)
 			{
-				dist = dist_probe;
-				call.probe = p;
+				calls[j].entity = pent;
+				if (track_changes)
+					changed_boxes.push_back(calls[j].world_bounding);
 			}
+			num_calls_rebuilt += calls.size() - first;
+
+			retained_prefabs[pent].dirty = false;
 		}
-		calls.push_back(call);
 	}
 
-	//iterate recursively with children
-	for (int i = 0; i < node->children.size(); ++i)
-		getCallsFromNode(prefab_model, node->children[i], camera);
+	//camera dependant info is cheap, update it for all the calls
+	for (int i = 0; i < calls.size(); ++i)
+	{
+		RenderCall& call = calls[i];
+		if (camera)
+			call.cam_dist = call.world_bounding.center.distance(camera->eye);
+		if (probes_changed || (num_moved && retained_prefabs[(PrefabEntity*)call.entity].moved))
+			assignProbe(call);
+		call.updateSortKey(camera);
+	}
+
+	//Sorting rendercalls (only their indices, the calls stay where they are)
+	sortRenderCalls(calls, sorted_calls);
+	call_rank.resize(sorted_calls.size());
+	for (int i = 0; i < sorted_calls.size(); ++i)
+		call_rank[sorted_calls[i]] = i;
+
+	//the tree is built again when calls are added or removed, if they only moved its boxes are refitted
+	if (calls_changed || bvh.items.size() != calls.size())
+		bvh.build(calls);
+	else if (num_moved)
+		bvh.refit(calls);
+	bvh.resetStats();
+}
+
+void Renderer::cullCalls(Camera* camera, std::vector<int>& result)
+{
+	bvh.cull(camera, result);
+
+	//render them in the sorted order, by their rank with the radix sort of the keys
+	cull_keys.resize(result.size());
+	for (int i = 0; i < result.size(); ++i)
+		cull_keys[i] = call_rank[result[i]];
+	radixSort(cull_keys, result);
+}
+
+void Renderer::beginPass()
+{
+	//the state is kept between passes, every change goes through GLState
+	GLState::nextPass();
+	memset(pass_shaders, 0, sizeof(pass_shaders));
+}
+
+Renderer::sBatchSlot* Renderer::findBatchSlot(const RenderCall& call)
+{
+	uint64 hash = (uint64)(size_t)call.mesh * 0x9E3779B97F4A7C15ull;
+	hash = (hash ^ (uint64)(size_t)call.material) * 0x9E3779B97F4A7C15ull;
+	hash = (hash ^ (uint64)(size_t)call.probe) * 0x9E3779B97F4A7C15ull;
+	int mask = (int)batch_table.size() - 1;
+	int i = (int)(hash >> 32) & mask;
+	while (true)
+	{
+		sBatchSlot& slot = batch_table[i];
+		if (slot.batch == -1 || (slot.mesh == call.mesh && slot.material == call.material && slot.probe == call.probe))
+			return &slot;
+		i = (i + 1) & mask; //the table is never more than half full
+	}
+}
+
+void Renderer::batchCalls(const std::vector<int>& visible)
+{
+	batches.clear();
+	call_batch.resize(visible.size());
+
+	//the open batches are found in a hash table (open addressing) that keeps its memory between passes
+	int table_size = 16;
+	while (table_size < visible.size() * 2)
+		table_size *= 2;
+	sBatchSlot empty_slot = { NULL, NULL, NULL, -1 };
+	batch_table.assign(table_size, empty_slot);
+
+	//first assign every call to a batch and count them
+	for (int i = 0; i < visible.size(); ++i)
+	{
+		RenderCall& call = calls[visible[i]];
+		int b = -1;
+		if (instancing)
+		{
+			if (call.material->alpha_mode == BLEND)
+			{
+				//blended calls go back to front, joining a batch drawn before would break the order
+				if (!batches.empty())
+				{
+					RenderCall& prev = calls[batches.back().call];
+					if (prev.mesh == call.mesh && prev.material == call.material && prev.probe == call.probe)
+						b = (int)batches.size() - 1;
+				}
+			}
+			else
+			{
+				sBatchSlot* slot = findBatchSlot(call);
+				if (slot->batch != -1)
+					b = slot->batch;
+				else
+				{
+					//the new batch created below stays open
+					slot->mesh = call.mesh;
+					slot->material = call.material;
+					slot->probe = call.probe;
+					slot->batch = (int)batches.size();
+				}
+			}
+		}
+
+		if (b == -1)
+		{
+			b = (int)batches.size();
+			sBatch batch = { visible[i], 0, 0 };
+			batches.push_back(batch);
+		}
+		batches[b].count++;
+		call_batch[i] = b;
+	}
+
+	//then the offsets, and the counts are used again as write cursors
+	int first = 0;
+	for (int i = 0; i < batches.size(); ++i)
+	{
+		batches[i].first = first;
+		first += batches[i].count;
+		batches[i].count = 0;
+	}
+
+	batch_models.resize(visible.size());
+	for (int i = 0; i < visible.size(); ++i)
+	{
+		sBatch& batch = batches[call_batch[i]];
+		batch_models[batch.first + batch.count++] = calls[visible[i]].model;
+	}
+}
+
+void Renderer::drawMesh(Mesh* mesh, const sBatch* batch)
+{
+	if (batch && batch->count > 1)
+		mesh->renderInstanced(GL_TRIANGLES, &batch_models[batch->first], batch->count);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
+void Renderer::uploadBlock(eUniformBlock block, const void* data, int size, int capacity)
+{
+	//first time we create the buffer, big enough for the whole block
+	if (!block_buffers[block])
+	{
+		glGenBuffers(1, &block_buffers[block]);
+		glBindBuffer(GL_UNIFORM_BUFFER, block_buffers[block]);
+		glBufferData(GL_UNIFORM_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, block, block_buffers[block]);
+	}
+	else
+		glBindBuffer(GL_UNIFORM_BUFFER, block_buffers[block]);
+
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Renderer::uploadCameraBlock(Camera* camera)
+{
+	sCameraBlock block;
+	block.viewprojection = camera->viewprojection_matrix;
+	block.view = camera->view_matrix;
+	block.camera_position = camera->eye;
+	block.gamma = hdr_gamma;
+	uploadBlock(UB_CAMERA, &block, sizeof(block), sizeof(block));
+}
+
+void Renderer::uploadLightBlock()
+{
+	sLightBlock block;
+	int num_lights = std::min((int)lights.size(), (int)max_lights);
+
+	for (int i = 0; i < num_lights; ++i)
+	{
+		LightEntity* light = lights[i];
+		sLightData& data = block.lights[i];
+
+		Vector3 pos = light->model * Vector3(0, 0, 0);
+		Vector3 front = light->model.frontVector();
+		data.shadow_viewproj = light->camera->viewprojection_matrix;
+		data.position = Vector4(pos.x, pos.y, pos.z, light->max_distance);
+		data.color = Vector4(pow(light->color.x, hdr_gamma), pow(light->color.y, hdr_gamma), pow(light->color.z, hdr_gamma), light->intensity);
+		data.vector = Vector4(front.x, front.y, front.z, cos(light->cone_angle * PI / 180));
+		data.uvs = Vector4(light->uvs.x, light->uvs.y, light->uvs.z, light->spot_exp);
+		data.type = (int)light->light_type;
+		data.shadows = (int)light->cast_shadows;
+		data.bias = light->bias;
+	}
+	block.num_lights = num_lights;
+	block.shadow_count = shadow_count;
+
+	//only the used part of the array is uploaded
+	int size = sizeof(block) - (max_lights - num_lights) * sizeof(sLightData);
+	uploadBlock(UB_LIGHTS, &block, size, sizeof(block));
 }
 
 void Renderer::updateLight(LightEntity* light, Camera* camera)
@@ -187,11 +592,81 @@ void Renderer::updateLight(LightEntity* light, Camera* camera)
 
 		//Update viewproj matrix
 		light->camera->viewprojection_matrix = light->camera->view_matrix * light->camera->projection_matrix;
+		light->camera->extractFrustum();
 		break;
 	}
 }
 
-void Renderer::renderGBuffers(std::vector<RenderCall> calls, Camera* camera, Scene* scene, int& w, int& h)
+void Renderer::updateCascades(LightEntity* light, Camera* camera, bool* update)
+{
+	int num_cascades = std::min(light->num_cascades, max_cascades);
+	float near_plane = camera->near_plane;
+	float far_plane = std::min(camera->far_plane, light->cascade_distance > 0 ? light->cascade_distance : light->area_size);
+	far_plane = std::max(far_plane, near_plane * 2);
+	int tile = light->shadow_fbo->width / 2;
+
+	//when the light changes every cascade is rendered again
+	bool all = light->cascades_frame == 0 || memcmp(light->cascades_model.m, light->model.m, sizeof(light->model.m)) != 0;
+	light->cascades_model = light->model;
+
+	Vector3 front = light->model.rotateVector(Vector3(0, 0, 1));
+	Vector3 up = light->model.rotateVector(Vector3(0, 1, 0));
+
+	//corners of the frustum slices, from the camera basis
+	Vector3 cam_front = camera->center - camera->eye;
+	cam_front.normalize();
+	Vector3 cam_right = cam_front.cross(camera->up);
+	cam_right.normalize();
+	Vector3 cam_up = cam_right.cross(cam_front);
+	float tan_y = tan(camera->fov * 0.5 * DEG2RAD);
+	float tan_x = tan_y * camera->aspect;
+
+	float split_near = near_plane;
+	for (int c = 0; c < num_cascades; ++c)
+	{
+		//practical split scheme, between the logarithmic and the uniform splits
+		float t = (c + 1) / (float)num_cascades;
+		float split_far = light->cascade_lambda * near_plane * pow(far_plane / near_plane, t) + (1.0 - light->cascade_lambda) * (near_plane + (far_plane - near_plane) * t);
+
+		//the first two every frame, the next every 2 and 4 frames
+		update[c] = all || c < 2 || light->cascades_frame % (1 << (c - 1)) == 0;
+		if (update[c])
+		{
+			//the bounding sphere of the slice doesn't change when the camera rotates, so the shadows don't shimmer
+			Vector3 corners[8];
+			Vector3 center;
+			for (int i = 0; i < 8; ++i)
+			{
+				float d = i < 4 ? split_near : split_far;
+				float sx = (i & 1) ? 1.0 : -1.0;
+				float sy = (i & 2) ? 1.0 : -1.0;
+				corners[i] = camera->eye + cam_front * d + cam_right * (sx * tan_x * d) + cam_up * (sy * tan_y * d);
+				center = center + corners[i] * 0.125;
+			}
+			float radius = 0;
+			for (int i = 0; i < 8; ++i)
+				radius = std::max(radius, corners[i].distance(center));
+			radius = ceil(radius);
+
+			//the light looks at the slice from far enough to see the casters in between
+			Camera* cascade = &light->cascades[c];
+			float back = light->max_distance;
+			cascade->lookAt(center - front * back, center, up);
+			cascade->setOrthographic(-radius, radius, -radius, radius, 0.1f, back + radius);
+
+			//Snap camera X,Y to the texels of the cascade
+			float grid = 2 * radius / (float)tile;
+			cascade->view_matrix.M[3][0] = round(cascade->view_matrix.M[3][0] / grid) * grid;
+			cascade->view_matrix.M[3][1] = round(cascade->view_matrix.M[3][1] / grid) * grid;
+			cascade->viewprojection_matrix = cascade->view_matrix * cascade->projection_matrix;
+			cascade->extractFrustum();
+		}
+		split_near = split_far;
+	}
+	light->cascades_frame++;
+}
+
+void Renderer::renderGBuffers(Camera* camera, Scene* scene, int& w, int& h)
 {
 	if (gbuffers_fbo->fbo_id == 0) {
 		Texture* albedo = new Texture(w, h, GL_RGBA, GL_FLOAT);
@@ -243,16 +718,12 @@ void Renderer::renderGBuffers(std::vector<RenderCall> calls, Camera* camera, Sce
 	gbuffers_fbo->enableAllBuffers();
 
 	//render everything 
-	//Rendering the final scene
-	for (int i = 0; i < calls.size(); ++i)
-	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(calls[i].model, calls[i].mesh->box);
-
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
-			renderMeshWithMaterial(calls[i], camera, scene, render_mode);
-	}
+	//Rendering the final scene, only the calls inside the camera frustum
+	cullCalls(camera, visible_calls);
+	batchCalls(visible_calls);
+	beginPass();
+	for (int i = 0; i < batches.size(); ++i)
+		renderMeshWithMaterial(calls[batches[i].call], camera, scene, render_mode, &batches[i]);
 
 	//stop rendering to the gbuffers
 	gbuffers_fbo->unbind();
@@ -270,8 +741,8 @@ void Renderer::renderGBuffers(std::vector<RenderCall> calls, Camera* camera, Sce
 	decals_fbo->color_textures[1]->copyTo(gbuffers_fbo->color_textures[1]);
 	decals_fbo->color_textures[2]->copyTo(gbuffers_fbo->color_textures[2]);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
 }
 
 void GTR::Renderer::renderToFBO(Scene* scene, Camera* camera)
@@ -351,11 +822,11 @@ void GTR::Renderer::renderToFBO(Scene* scene, Camera* camera)
 	applyBloom(camera);
 	fbo = Texture::getGlobalFBO(ping);
 	fbo->bind();
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE);
+	GLState::setCapability(GL_BLEND, true);
+	GLState::blendFunc(GL_ONE, GL_ONE);
 	bloom_fbo->color_textures[0]->toViewport();
 	fbo->unbind();
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, false);
 
 	//Fifth FX (Chromatic aberration)
 	fbo = Texture::getGlobalFBO(pong);
@@ -398,7 +869,7 @@ void GTR::Renderer::renderToFBO(Scene* scene, Camera* camera)
 		hdr_shader->setUniform("u_igamma", inv_gamma);
 	}
 
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, false);
 
 	ping->toViewport(hdr_shader);
 
@@ -412,9 +883,7 @@ void GTR::Renderer::renderToFBO(Scene* scene, Camera* camera)
 
 void Renderer::fetchSceneEntities(Scene* scene, Camera* camera, bool fetch_prefabs, bool fetch_lights, bool fetch_probes, bool fetch_grid)
 {
-	//if we want to fetch the calls (lights), clear the array of calls (lights) first
-	if (fetch_prefabs)
-		calls.clear();
+	//if we want to fetch the lights, clear the array of lights first (calls are retained between frames)
 	if (fetch_lights)
 	{
 		directional_light = NULL;
@@ -430,14 +899,6 @@ void Renderer::fetchSceneEntities(Scene* scene, Camera* camera, bool fetch_prefa
 		if (!ent->visible)
 			continue;
 
-		//is a prefab!
-		if (fetch_prefabs && ent->entity_type == PREFAB)
-		{
-			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if (pent->prefab)
-				getCallsFromPrefab(ent->model, pent->prefab, camera);
-		}
-
 		if (fetch_probes && ent->entity_type == REFLECTION_PROBE)
 		{
 			ReflectionProbeEntity* pent = (GTR::ReflectionProbeEntity*)ent;
@@ -465,13 +926,15 @@ void Renderer::fetchSceneEntities(Scene* scene, Camera* camera, bool fetch_prefa
 		}
 	}
 
-	//Sorting rendercalls
-	if (fetch_prefabs) 
-		std::sort(calls.begin(), calls.end());
+	//prefabs are fetched last so the calls know all the reflection probes
+	if (fetch_prefabs)
+		updateCalls(scene, camera);
 }
 
 void Renderer::renderScene(Scene* scene, Camera* camera)
 {
+	GLState::resetStats();
+
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
 
 	// Clear the color and the depth buffer
@@ -480,6 +943,9 @@ void Renderer::renderScene(Scene* scene, Camera* camera)
 
 	fetchSceneEntities(scene, camera, true, true, true, true);
 
+	//only the copies done by the passes, rebuilding the calls above is expected to copy
+	sCopyCounter::count = 0;
+
 	//Calculate the shadowmaps
 	if (light_mode == MULTI) 
 	{
@@ -496,20 +962,47 @@ void Renderer::renderScene(Scene* scene, Camera* camera)
 				shadowMapping(directional_light, camera);
 		}
 	}
-	else if (light_mode == SINGLE)
+	else
+	{
+		//single pass and clustered read the lights from the light block and their shadows from the atlas
 		renderToAtlas(camera);
+		uploadLightBlock();
+
+		//in deferred the directional light is not in the block, it uses its own shadowmap
+		if (light_mode == CLUSTERED && render_mode == DEFERRED && directional_light && directional_light->cast_shadows)
+			shadowMapping(directional_light, camera);
+	}
+
+	//the probes of the bake file only need their texture
+	if (grid && grid->baked && !probes_texture)
+		loadBakedProbes();
+
+	//bake a few of the probes around the geometry that changed, the rest wait for the next frames
+	if (grid && probes_texture && grid->probes.size() == probe_coeffs.size())
+	{
+		for (int i = 0; i < changed_boxes.size(); ++i)
+			queueProbes(&changed_boxes[i]);
+		//these are not saved, the bake file is for the scene as it is loaded
+		if (!probes_to_bake.empty() || probe_readbacks[0].probe != -1 || probe_readbacks[1].probe != -1)
+		{
+			bakeProbes(scene, probes_per_frame, false);
+			camera->enable();
+		}
+		uploadProbes();
+	}
+	changed_boxes.clear();
 
 	//Render depending on the mode
 	if (render_mode == FORWARD)
 	{
 		illumination_fbo->bind();
-		renderCalls(calls, camera, scene, render_mode);
+		renderCalls(camera, scene, render_mode);
 		illumination_fbo->unbind();
-		glDisable(GL_BLEND);
-		glDisable(GL_DEPTH_TEST);
+		GLState::setCapability(GL_BLEND, false);
+		GLState::setCapability(GL_DEPTH_TEST, false);
 	}
 	else if (render_mode == DEFERRED)
-		renderDeferred(calls, camera, scene);
+		renderDeferred(camera, scene);
 }
 
 void Renderer::renderSkybox(Texture* skybox, Camera* camera)
@@ -529,14 +1022,14 @@ void Renderer::renderSkybox(Texture* skybox, Camera* camera)
 
 	shader->setUniform("u_texture", skybox, 0);
 
-	glDisable(GL_BLEND);
-	glDisable(GL_CULL_FACE);
-	glDisable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_BLEND, false);
+	GLState::setCapability(GL_CULL_FACE, false);
+	GLState::setCapability(GL_DEPTH_TEST, false);
 
 	mesh->render(GL_TRIANGLES);
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_CULL_FACE, true);
+	GLState::setCapability(GL_DEPTH_TEST, true);
 }
 
 void GTR::Renderer::renderDecals(Scene* scene, Camera* camera)
@@ -564,8 +1057,8 @@ void GTR::Renderer::renderDecals(Scene* scene, Camera* camera)
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->depth_texture->width, 1.0 / (float)gbuffers_fbo->depth_texture->height));
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
 
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
@@ -587,7 +1080,7 @@ void GTR::Renderer::renderDecals(Scene* scene, Camera* camera)
 	}
 }
 
-void Renderer::renderCalls(std::vector<RenderCall> calls, Camera* camera, Scene* scene, eRenderMode pipeline)
+void Renderer::renderCalls(Camera* camera, Scene* scene, eRenderMode pipeline)
 {
 	Vector3 bg_color = scene->background_color;
 	glClearColor(bg_color.x, bg_color.y, bg_color.z, 1.0);
@@ -596,24 +1089,28 @@ void Renderer::renderCalls(std::vector<RenderCall> calls, Camera* camera, Scene*
 	if (scene->environment)
 		renderSkybox(scene->environment, camera);
 
-	//Rendering the final scene
-	for (int i = 0; i < calls.size(); ++i)
-	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(calls[i].model, calls[i].mesh->box);
-
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
-			renderMeshWithMaterial(calls[i], camera, scene, pipeline);
-	}
+	//Rendering the final scene, only the calls inside the camera frustum
+	cullCalls(camera, visible_calls);
+	batchCalls(visible_calls);
+	beginPass();
+	uploadCameraBlock(camera);
+	if (light_mode == CLUSTERED)
+		clusters.build(camera, lights, max_lights);
+	for (int i = 0; i < batches.size(); ++i)
+		renderMeshWithMaterial(calls[batches[i].call], camera, scene, pipeline, &batches[i]);
+	if (Shader::current)
+		Shader::current->disable();
 }
 
-void Renderer::renderDeferred(std::vector<RenderCall> calls, Camera* camera, Scene* scene)
+void Renderer::renderDeferred(Camera* camera, Scene* scene)
 {
 	int w = Application::instance->window_width;
 	int h = Application::instance->window_height;
 
-	renderGBuffers(calls, camera, scene, w, h);
+	renderGBuffers(camera, scene, w, h);
+
+	if (light_mode == CLUSTERED)
+		clusters.build(camera, lights, max_lights);
 
 	Texture* ao = NULL;
 	if (activate_ssao)
@@ -651,40 +1148,44 @@ void Renderer::renderDeferred(std::vector<RenderCall> calls, Camera* camera, Sce
 		sh->setUniform("u_pcf", pcf);
 		directional_light->uploadLightParams(sh, true, hdr_gamma);
 	}
+	else if (light_mode == CLUSTERED)
+		sh->setUniform("u_light_type", (int)NO_LIGHT); //only the lights of the clusters
 	else
 		sh->setUniform("u_light_eq", (int)NO_EQ);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
 
 	quad->render(GL_TRIANGLES);
 
 	sh->disable();
 
-	sh = Shader::Get("deferred_ws"); //Sphere shader
+	//the light volumes, in clustered mode all the lights were added in the first pass
+	if (light_mode != CLUSTERED)
+	{
+		sh = Shader::Get("deferred_ws"); //Sphere shader
 
-	sh->enable();
+		sh->enable();
 
-	//Render the scene with the second pass uniforms
-	passDeferredUniforms(sh, false, camera, scene, w, h);
-	renderMultiPassSphere(sh, camera);
+		//Render the scene with the second pass uniforms
+		passDeferredUniforms(sh, false, camera, scene, w, h);
+		renderMultiPassSphere(sh, camera);
+	}
 
 	//Alpha forward
 	if (!dithering) {
 		if (directional_light)
 			lights.push_back(directional_light);
 
-		for (int i = 0; i < calls.size(); ++i)
-		{
-			if (calls[i].material->alpha_mode == NO_ALPHA)
-				continue;
-
-			//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-			BoundingBox world_bounding = transformBoundingBox(calls[i].model, calls[i].mesh->box);
-			//if bounding box is inside the camera frustum then the object is probably visible
-			if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
-				renderMeshWithMaterial(calls[i], camera, scene, DEFERRED_ALPHA);
-		}
+		cullCalls(camera, visible_calls);
+		//the opaque calls are already in the gbuffers
+		visible_calls.erase(std::remove_if(visible_calls.begin(), visible_calls.end(), [this](int i) { return calls[i].material->alpha_mode == NO_ALPHA; }), visible_calls.end());
+		batchCalls(visible_calls);
+		beginPass();
+		for (int i = 0; i < batches.size(); ++i)
+			renderMeshWithMaterial(calls[batches[i].call], camera, scene, DEFERRED_ALPHA, &batches[i]);
+		if (Shader::current)
+			Shader::current->disable();
 	}
 
 	if (volumetric)
@@ -698,8 +1199,8 @@ void Renderer::renderDeferred(std::vector<RenderCall> calls, Camera* camera, Sce
 	if (show_reflection_probes)
 		renderReflectionProbes(scene, camera);
 
-	glDisable(GL_BLEND);
-	glDisable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_BLEND, false);
+	GLState::setCapability(GL_DEPTH_TEST, false);
 
 	illumination_fbo->unbind();
 }
@@ -721,9 +1222,9 @@ void Renderer::volumetricDirectional(Camera* camera)
 
 	directional_light->uploadLightParams(shader, true, hdr_gamma);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-	glDisable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_BLEND, true);
+	GLState::blendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::setCapability(GL_DEPTH_TEST, false);
 
 	quad->render(GL_TRIANGLES);
 
@@ -737,17 +1238,21 @@ void Renderer::volumetricDirectional(Camera* camera)
 	}
 }
 
-void Renderer::renderMeshWithMaterialShadow(const Matrix44& model, Mesh* mesh, GTR::Material* material, LightEntity* light)
+void Renderer::renderMeshWithMaterialShadow(const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* light_camera, const sBatch* batch)
 {
 	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material)
+	//meshes still streaming in are not drawn until they are uploaded
+	if (!mesh || !mesh->getNumVertices() || mesh->upload_pending || !material)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
 
 	//define locals to simplify coding
 	Texture* texture = NULL;
-	Shader* shader = NULL;
-	shader = Shader::Get("shadowmap");
+	//the shadow pass only uses one shader (and its instanced version), it is kept in the first slot
+	bool instanced = batch && batch->count > 1;
+	Shader* shader = pass_shaders[instanced][0];
+	if (!shader)
+		shader = pass_shaders[instanced][0] = Shader::Get(instanced ? "shadowmap_instanced" : "shadowmap");
 	assert(glGetError() == GL_NO_ERROR);
 
 	texture = material->color_texture.texture;
@@ -759,41 +1264,37 @@ void Renderer::renderMeshWithMaterialShadow(const Matrix44& model, Mesh* mesh, G
 		return;
 
 	//select if render both sides of the triangles
-	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
-	else
-		glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_CULL_FACE, !material->two_sided);
 	assert(glGetError() == GL_NO_ERROR);
 	
 	shader->enable();
 
-	Matrix44 shadow_proj = light->camera->viewprojection_matrix;
-	shader->setUniform("u_viewprojection", shadow_proj);
+	if (GLState::needsPassUniforms(shader))
+		shader->setUniform(U_VIEWPROJECTION, light_camera->viewprojection_matrix);
 
 	if (texture)
-		shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(U_TEXTURE, texture, 0);
 
-	shader->setUniform("u_model", model);
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(U_MODEL, model);
+	shader->setUniform(U_ALPHA_CUTOFF, material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 	
-	mesh->render(GL_TRIANGLES);
-
-	shader->disable();
+	drawMesh(mesh, batch);
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS); //as default
+	GLState::setCapability(GL_BLEND, false);
+	GLState::depthFunc(GL_LESS); //as default
 }
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* scene, eRenderMode pipeline)
+void Renderer::renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* scene, eRenderMode pipeline, const sBatch* batch)
 {
 	Mesh* mesh = call.mesh;
 	Material* material = call.material;
-	const Matrix44 model = call.model;
+	const Matrix44& model = call.model;
 
 	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material)
+	//meshes still streaming in are not drawn until they are uploaded
+	if (!mesh || !mesh->getNumVertices() || mesh->upload_pending || !material)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -811,27 +1312,35 @@ void Renderer::renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* s
 	//texture = material->occlusion_texture;
 
 	//select if render both sides of the triangles
-	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
-	else
-		glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_CULL_FACE, !material->two_sided);
 	assert(glGetError() == GL_NO_ERROR);
 
-	//chose a shader
-	switch (pipeline) 
+	//chose a shader (it only depends on the pipeline and the instancing, so it is fetched once per pass)
+	bool instanced = batch && batch->count > 1;
+	shader = pass_shaders[instanced][pipeline];
+	if (!shader)
 	{
-		case FORWARD:
-			if (light_mode == MULTI)
-				shader = Shader::Get("light_multi");
-			if (light_mode == SINGLE)
-				shader = Shader::Get("light_single");
-			break;
-		case DEFERRED:
-			shader = Shader::Get("gbuffers");
-			break;
-		case DEFERRED_ALPHA:
-			shader = Shader::Get("light_multi");
-			break;
+		std::string name;
+		switch (pipeline)
+		{
+			case FORWARD:
+				if (light_mode == MULTI || light_mode == CLUSTERED)
+					name = "light_multi";
+				if (light_mode == SINGLE)
+					name = "light_single";
+				break;
+			case DEFERRED:
+				name = "gbuffers";
+				break;
+			case DEFERRED_ALPHA:
+				name = "light_multi";
+				break;
+		}
+		//same shaders, but the model comes from an attribute
+		if (instanced)
+			name += "_instanced";
+		shader = Shader::Get(name.c_str());
+		pass_shaders[instanced][pipeline] = shader;
 	}
 
 	assert(glGetError() == GL_NO_ERROR);
@@ -841,147 +1350,164 @@ void Renderer::renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* s
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_viewmatrix", camera->view_matrix);
-	shader->setUniform("u_model", model);
+	//upload uniforms, the ones that don't change during the pass only the first time
+	bool first_draw = GLState::needsPassUniforms(shader);
+	if (first_draw)
+	{
+		shader->setUniform(U_VIEWPROJECTION, camera->viewprojection_matrix);
+		shader->setUniform(U_CAMERA_POSITION, camera->eye);
+		shader->setUniform(U_VIEWMATRIX, camera->view_matrix);
+		shader->setUniform(U_GAMMA, hdr_gamma);
+		shader->setUniform(U_CLUSTERED, light_mode == CLUSTERED);
+	}
+	shader->setUniform(U_MODEL, model);
 
 	Vector4 mat_color = material->color;
 	mat_color = Vector4(pow(mat_color.x, hdr_gamma), pow(mat_color.y, hdr_gamma), pow(mat_color.z, hdr_gamma), mat_color.w);
-	shader->setUniform("u_color", mat_color);
+	shader->setUniform(U_COLOR, mat_color);
 
 	Vector3 em_factor = material->emissive_factor;
 	em_factor = Vector3(pow(em_factor.x, hdr_gamma), pow(em_factor.y, hdr_gamma), pow(em_factor.z, hdr_gamma));
-	shader->setUniform("u_emissive", em_factor);
+	shader->setUniform(U_EMISSIVE, em_factor);
 
 	Vector3 ambient = scene->ambient_light;
 	ambient = Vector3(pow(ambient.x, hdr_gamma), pow(ambient.y, hdr_gamma), pow(ambient.z, hdr_gamma));
 
-	shader->setVector3("u_ambient_light", ambient);
-	shader->setUniform("u_light_eq", light_eq);
-	shader->setUniform("u_gamma", hdr_gamma);
+	shader->setUniform(U_AMBIENT_LIGHT, ambient);
+	shader->setUniform(U_LIGHT_EQ, light_eq);
 
 	if (!texture)
 		texture = Texture::getWhiteTexture(); //a 1x1 white texture
-	if (!texture_met_rough)
+	if (!texture_met_rough || texture_met_rough->upload_pending)
 		texture_met_rough = Texture::getGreenTexture(); //a 1x1 white texture
 
-	shader->setUniform("u_metallic", material->metallic_factor);
-	shader->setUniform("u_roughness", material->roughness_factor);
+	shader->setUniform(U_METALLIC, material->metallic_factor);
+	shader->setUniform(U_ROUGHNESS, material->roughness_factor);
 
 	if (!texture_em)
 		texture_em = Texture::getWhiteTexture(); //a 1x1 white texture
-	if (!texture_norm)
-		texture_norm = Texture::getBlackTexture(); //a 1x1 white texture
+	if (!texture_norm || texture_norm->upload_pending)
+		texture_norm = Texture::getBlackTexture(); //a 1x1 white texture, also while it streams in, as it means no normal map
 
-	shader->setUniform("u_texture", texture, 0);
-	shader->setUniform("u_texture_em", texture_em, 1);
-	shader->setUniform("u_texture_metallic_roughness", texture_met_rough, 2);
-	shader->setUniform("u_texture_normals", texture_norm, 3);
+	shader->setUniform(U_TEXTURE, texture, 0);
+	shader->setUniform(U_TEXTURE_EM, texture_em, 1);
+	shader->setUniform(U_TEXTURE_METALLIC_ROUGHNESS, texture_met_rough, 2);
+	shader->setUniform(U_TEXTURE_NORMALS, texture_norm, 3);
 
 	if(call.probe)
 		if (call.probe->cubemap)
-			shader->setUniform("u_environment_texture", call.probe->cubemap, 13);
+			shader->setUniform(U_ENVIRONMENT_TEXTURE, call.probe->cubemap, 13);
 		else
-			shader->setUniform("u_environment_texture",Texture::getWhiteTexture(), 13);
+			shader->setUniform(U_ENVIRONMENT_TEXTURE,Texture::getWhiteTexture(), 13);
 
-	shader->setUniform("u_deferred", (bool)(pipeline == DEFERRED_ALPHA));
+	shader->setUniform(U_DEFERRED, (bool)(pipeline == DEFERRED_ALPHA));
 
 	if (pipeline == DEFERRED_ALPHA)
 	{
-		shader->setUniform("u_ao", activate_ssao);
+		shader->setUniform(U_AO, activate_ssao);
 
 		if (activate_ssao)
 		{
 			Texture* ao = ssao->ssao_fbo->color_textures[0];
-			shader->setUniform("u_ao_texture", ao, 5);
+			shader->setUniform(U_AO_TEXTURE, ao, 5);
 		}
 	}
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(U_ALPHA_CUTOFF, material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 
 	if (reflections)
 	{
-		shader->setTexture("u_environment_texture", call.probe->cubemap, 11);
+		shader->setUniform(U_ENVIRONMENT_TEXTURE, call.probe->cubemap, 11);
 	}
-	shader->setUniform("u_reflections", reflections);
+	shader->setUniform(U_REFLECTIONS, reflections);
+
+	if (light_mode == CLUSTERED && (pipeline == FORWARD || pipeline == DEFERRED_ALPHA))
+	{
+		//select the blending
+		if (material->alpha_mode == GTR::eAlphaMode::BLEND)
+		{
+			GLState::setCapability(GL_BLEND, true);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		else
+			GLState::setCapability(GL_BLEND, false);
 
-	if (pipeline == FORWARD && light_mode == MULTI || pipeline == DEFERRED_ALPHA)
+		renderClustered(mesh, shader, pipeline, first_draw, batch);
+	}
+	else if (pipeline == FORWARD && light_mode == MULTI || pipeline == DEFERRED_ALPHA)
 	{
 		//select the blending
 		if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::setCapability(GL_BLEND, true);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		}
 		else
 		{
-			glDisable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+			GLState::setCapability(GL_BLEND, false);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 		}
 
 		if (lights.size() == 0) //Taking care of the "no lights" scenario
 		{
-			shader->setUniform("u_light_type", (int)NO_LIGHT);
-			shader->setUniform("u_light_eq", (int)NO_EQ);
-			mesh->render(GL_TRIANGLES);
+			shader->setUniform(U_LIGHT_TYPE, (int)NO_LIGHT);
+			shader->setUniform(U_LIGHT_EQ, (int)NO_EQ);
+			drawMesh(mesh, batch);
 		}
 		else
-			renderMultiPass(mesh, material, shader, pipeline);
+			renderMultiPass(mesh, material, shader, pipeline, batch);
 	}
 	else if (pipeline == FORWARD && light_mode == SINGLE)
 	{
 		//select the blending
 		if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLState::setCapability(GL_BLEND, true);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		}
 
-		renderSinglePass(shader, mesh);
+		renderSinglePass(shader, mesh, first_draw, batch);
 	}
 	else 
 	{
 		bool irradiance = false;
 		if (probes_texture) {
 			irradiance = true;
-			shader->setUniform("u_invmodel_grid", grid->inv_model);
-			shader->setUniform("u_irr_dims", grid->dim);
-			shader->setUniform("u_trilinear", irr_3lerp);
-			shader->setTexture("u_texture_probes", probes_texture, 6);
+			shader->setUniform(U_INVMODEL_GRID, grid->inv_model);
+			shader->setUniform(U_IRR_DIMS, grid->dim);
+			shader->setUniform(U_TRILINEAR, irr_3lerp);
+			shader->setUniform(U_TEXTURE_PROBES, probes_texture, 6);
 		}
-		shader->setUniform("u_irr", irradiance);
+		shader->setUniform(U_IRR, irradiance);
 		if (dithering || material->alpha_mode == NO_ALPHA)
-			mesh->render(GL_TRIANGLES);
+			drawMesh(mesh, batch);
 	}
 
-	//disable shader
-	shader->disable();
+	//the shader is kept enabled, the next call will probably use it too
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS); //as default
+	GLState::setCapability(GL_BLEND, false);
+	GLState::depthFunc(GL_LESS); //as default
 }
 
-void Renderer::renderMultiPass(Mesh* mesh, Material* material, Shader* shader, eRenderMode pipeline)
+void Renderer::renderMultiPass(Mesh* mesh, Material* material, Shader* shader, eRenderMode pipeline, const sBatch* batch)
 {
 	//allow to render pixels that have the same depth as the one in the depth buffer
-	glEnable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LEQUAL);
+	GLState::setCapability(GL_DEPTH_TEST, true);
+	GLState::depthFunc(GL_LEQUAL);
 
-	shader->setUniform("u_pcf", pcf);
+	shader->setUniform(U_PCF, pcf);
 
 	bool irradiance = false;
 	if (probes_texture) {
 		irradiance = true;
-		shader->setUniform("u_invmodel_grid", grid->inv_model);
-		shader->setUniform("u_irr_dims", grid->dim);
-		shader->setUniform("u_trilinear", irr_3lerp);
-		shader->setTexture("u_texture_probes", probes_texture, 6);
+		shader->setUniform(U_INVMODEL_GRID, grid->inv_model);
+		shader->setUniform(U_IRR_DIMS, grid->dim);
+		shader->setUniform(U_TRILINEAR, irr_3lerp);
+		shader->setUniform(U_TEXTURE_PROBES, probes_texture, 6);
 	}
-	shader->setUniform("u_irr", activate_irr);
+	shader->setUniform(U_IRR, activate_irr);
 
 	for (int i = 0; i < lights.size(); ++i)
 	{
@@ -993,39 +1519,73 @@ void Renderer::renderMultiPass(Mesh* mesh, Material* material, Shader* shader, e
 			if (material)
 			{
 				if (material->alpha_mode == GTR::eAlphaMode::BLEND)
-					glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+					GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 				else
-					glEnable(GL_BLEND);
+					GLState::setCapability(GL_BLEND, true);
 			}
 
-			shader->setVector3("u_ambient_light", Vector3(0, 0, 0));
-			shader->setUniform("u_irr", false);
-			shader->setUniform("u_reflections", false);
+			shader->setUniform(U_AMBIENT_LIGHT, Vector3(0, 0, 0));
+			shader->setUniform(U_IRR, false);
+			shader->setUniform(U_REFLECTIONS, false);
 
 			if (pipeline == DEFERRED)
 			{
-				shader->setUniform("u_emissive", false);
-				glEnable(GL_BLEND);
-				glBlendFunc(GL_ONE, GL_ONE);
+				shader->setUniform(U_EMISSIVE, false);
+				GLState::setCapability(GL_BLEND, true);
+				GLState::blendFunc(GL_ONE, GL_ONE);
 			}
 			else
-				shader->setUniform("u_emissive", Vector3(0, 0, 0));
+				shader->setUniform(U_EMISSIVE, Vector3(0, 0, 0));
 		}
 
 		light->uploadLightParams(shader, true, hdr_gamma);
 
 		//render the mesh
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh, batch);
+	}
+}
+
+void Renderer::renderClustered(Mesh* mesh, Shader* shader, eRenderMode pipeline, bool first_draw, const sBatch* batch)
+{
+	//allow to render pixels that have the same depth as the one in the depth buffer
+	GLState::setCapability(GL_DEPTH_TEST, true);
+	GLState::depthFunc(GL_LEQUAL);
+
+	//the lists, the atlas and the directional light don't change during the pass
+	if (first_draw)
+	{
+		clusters.bind(shader, 9, 10);
+		shader->setUniform(U_PCF, pcf);
+		shader->setUniform(U_TEXTURE_ATLAS, shadow_count && atlas ? atlas->depth_texture : Texture::getBlackTexture(), 7);
+
+		//in deferred the directional light is not in the clusters, so it goes as the single light of the shader
+		if (pipeline == DEFERRED_ALPHA && directional_light)
+			directional_light->uploadLightParams(shader, true, hdr_gamma);
+		else
+			shader->setUniform(U_LIGHT_TYPE, (int)NO_LIGHT);
+	}
+
+	bool irradiance = false;
+	if (probes_texture) {
+		irradiance = true;
+		shader->setUniform(U_INVMODEL_GRID, grid->inv_model);
+		shader->setUniform(U_IRR_DIMS, grid->dim);
+		shader->setUniform(U_TRILINEAR, irr_3lerp);
+		shader->setUniform(U_TEXTURE_PROBES, probes_texture, 6);
 	}
+	shader->setUniform(U_IRR, activate_irr);
+
+	//render the mesh once, the shader loops the lights of every pixel cluster
+	drawMesh(mesh, batch);
 }
 
 void Renderer::renderMultiPassSphere(Shader* sh, Camera* camera)
 {
 	//first pass doesn't use blending)
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE);
+	GLState::setCapability(GL_BLEND, true);
+	GLState::blendFunc(GL_ONE, GL_ONE);
 	//glDepthFunc(GL_GEQUAL);
-	glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_CULL_FACE, true);
 
 	sh->setVector3("u_ambient_light", Vector3(0, 0, 0));
 	sh->setUniform("u_emissive", false);
@@ -1064,87 +1624,45 @@ void Renderer::renderMultiPassSphere(Shader* sh, Camera* camera)
 	sh->disable();
 
 	//disable depth test and blend!!
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
 	glFrontFace(GL_CCW);
 }
 
-void Renderer::renderSinglePass(Shader* shader, Mesh* mesh)
+void Renderer::renderSinglePass(Shader* shader, Mesh* mesh, bool first_draw, const sBatch* batch)
 {
-	//Defining the vectors that will be passed to the GPU
-	Matrix44 shadow_proj[max_lights];
-	Vector3 light_position[max_lights];
-	Vector3 light_color[max_lights];
-	Vector3 light_direction[max_lights];
-	Vector3 light_uvs[max_lights];
-	int light_type[max_lights];
-	float light_maxdistance[max_lights];
-	float light_intensity[max_lights];
-	float light_cutoff[max_lights];
-	float light_exponent[max_lights];
-	float light_bias[max_lights];
-	int light_shadows[max_lights];
-
-	//Filling the vectors
-	for (int i = 0; i < lights.size(); ++i)
-	{
-		LightEntity* light = lights[i];
-
-		light_position[i] = light->model * Vector3(0, 0, 0);
-
-		Vector3 l_color = Vector3(pow(light->color.x, hdr_gamma), pow(light->color.y, hdr_gamma), pow(light->color.z, hdr_gamma));
-		light_color[i] = l_color;
-
-		light_maxdistance[i] = light->max_distance;
-		light_type[i] = (int)light->light_type;
-		light_intensity[i] = light->intensity;
-		light_cutoff[i] = cos(light->cone_angle * PI / 180);
-		light_direction[i] = light->model.frontVector();
-		light_exponent[i] = light->spot_exp;
-		light_shadows[i] = (int)light->cast_shadows;
-		light_bias[i] = light->bias;
-		shadow_proj[i] = light->camera->viewprojection_matrix;
-		light_uvs[i] = light->uvs;
-	}
-
 	bool irradiance = false;
 	if (probes_texture) {
 		irradiance = true;
-		shader->setUniform("u_invmodel_grid", grid->inv_model);
-		shader->setUniform("u_irr_dims", grid->dim);
-		shader->setUniform("u_trilinear", irr_3lerp);
-		shader->setTexture("u_texture_probes", probes_texture, 6);
-	}
-	shader->setUniform("u_irr", activate_irr);
-
-	//Passing all the vectors to the GPU
-	shader->setMatrix44Array("u_shadow_viewproj", shadow_proj, max_lights);
-	shader->setUniform3Array("u_light_position", (float*)&light_position, max_lights);
-	shader->setUniform3Array("u_light_color", (float*)&light_color, max_lights);
-	shader->setUniform3Array("u_light_vector", (float*)&light_direction, max_lights);
-	shader->setUniform3Array("u_light_uvs", (float*)&light_uvs, max_lights);
-	shader->setUniform1Array("u_light_maxdist", (float*)&light_maxdistance, max_lights);
-	shader->setUniform1Array("u_light_type", (int*)&light_type, max_lights);
-	shader->setUniform1Array("u_light_intensity", (float*)&light_intensity, max_lights);
-	shader->setUniform1Array("u_light_cutoff", (float*)&light_cutoff, max_lights);
-	shader->setUniform1Array("u_light_exp", (float*)&light_exponent, max_lights);
-	shader->setUniform1Array("u_shadows", (int*)&light_shadows, max_lights);
-	shader->setUniform1Array("u_shadow_bias", (float*)&light_bias,max_lights);
-	shader->setUniform1("u_num_lights", (int)lights.size());
-	shader->setUniform("u_shadow_count", shadow_count);
-	shader->setUniform("u_pcf", pcf);
-
-	if (shadow_count != 0)
-		shader->setUniform("u_texture_atlas", atlas->depth_texture, 8);
-	else
-		shader->setUniform("u_texture_atlas", Texture::getBlackTexture(), 8);
+		shader->setUniform(U_INVMODEL_GRID, grid->inv_model);
+		shader->setUniform(U_IRR_DIMS, grid->dim);
+		shader->setUniform(U_TRILINEAR, irr_3lerp);
+		shader->setUniform(U_TEXTURE_PROBES, probes_texture, 6);
+	}
+	shader->setUniform(U_IRR, activate_irr);
+
+	//the lights come from the light block (see uploadLightBlock), only the atlas is left
+	if (first_draw)
+	{
+		shader->setUniform(U_PCF, pcf);
+		if (shadow_count != 0)
+			shader->setUniform(U_TEXTURE_ATLAS, atlas->depth_texture, 8);
+		else
+			shader->setUniform(U_TEXTURE_ATLAS, Texture::getBlackTexture(), 8);
+	}
 
 	//render the mesh
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, batch);
 }
 
 void Renderer::shadowMapping(LightEntity* light, Camera* camera)
 {
+	if (light->light_type == DIRECTIONAL && light->num_cascades > 1)
+	{
+		cascadedShadowMapping(light, camera);
+		return;
+	}
+
 	updateLight(light, camera);
 
 	//Bind to render inside a texture
@@ -1152,34 +1670,73 @@ void Renderer::shadowMapping(LightEntity* light, Camera* camera)
 	glColorMask(false, false, false, false);
 	glClear(GL_DEPTH_BUFFER_BIT);
 
-	for (int i = 0; i < calls.size(); ++i)
+	//only the calls inside the light frustum
+	cullCalls(light->camera, visible_calls);
+	batchCalls(visible_calls);
+	beginPass();
+	for (int i = 0; i < batches.size(); ++i)
 	{
-		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
-		BoundingBox world_bounding = transformBoundingBox(calls[i].model, calls[i].mesh->box);
-
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (light->camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
-			renderMeshWithMaterialShadow(calls[i].model, calls[i].mesh, calls[i].material, light);
+		RenderCall& call = calls[batches[i].call];
+		renderMeshWithMaterialShadow(call.model, call.mesh, call.material, light->camera, &batches[i]);
 	}
+	if (Shader::current)
+		Shader::current->disable();
 
 	//disable it to render back to the screen
 	light->shadow_fbo->unbind();
 	glColorMask(true, true, true, true);
 }
 
+void Renderer::cascadedShadowMapping(LightEntity* light, Camera* camera)
+{
+	//the light camera is still updated, the debug view and the atlas modes use it
+	updateLight(light, camera);
+
+	bool update[max_cascades];
+	updateCascades(light, camera, update);
+
+	light->shadow_fbo->bind();
+	glColorMask(false, false, false, false);
+	glEnable(GL_SCISSOR_TEST);
+
+	int tile = light->shadow_fbo->width / 2;
+	for (int c = 0; c < light->num_cascades; ++c)
+	{
+		if (!update[c])
+			continue;
+
+		//clear only the quarter of this cascade, the others may keep what they had
+		int x = (c % 2) * tile;
+		int y = (c / 2) * tile;
+		glScissor(x, y, tile, tile);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glViewport(x, y, tile, tile);
+
+		//only the calls inside this cascade
+		Camera* cascade = &light->cascades[c];
+		cullCalls(cascade, visible_calls);
+		batchCalls(visible_calls);
+		beginPass();
+		for (int i = 0; i < batches.size(); ++i)
+		{
+			RenderCall& call = calls[batches[i].call];
+			renderMeshWithMaterialShadow(call.model, call.mesh, call.material, cascade, &batches[i]);
+		}
+	}
+	if (Shader::current)
+		Shader::current->disable();
+
+	glDisable(GL_SCISSOR_TEST);
+	light->shadow_fbo->unbind();
+	glColorMask(true, true, true, true);
+}
+
 void Renderer::renderToAtlas(Camera* camera) {
 
 	//if render mode is not singlepass or there are no lights or prefabs to show, return
 	if (shadow_count == 0 || calls.empty())
 		return;
 
-	Shader* shader = NULL;
-	shader = Shader::Get("shadowmap");
-	//no shader? then nothing to render
-	if (!shader)
-		return;
-	shader->enable();
-
 	int res = 1024 * pow(2, (int)Application::instance->quality); // resolution of texture (1:1 aspect ratio)
 	shadow_count = 4;
 	//first time we create the FBO
@@ -1220,39 +1777,31 @@ void Renderer::renderToAtlas(Camera* camera) {
 		glScissor(ires, jres, res, res);
 		glClear(GL_DEPTH_BUFFER_BIT);
 		glViewport(ires, jres, res, res);
-		//traverse all prefabs that dont use blending
-		for (int i = 0; i < calls.size(); ++i) {
-			//if prefab is inside the light's camera frustum render it
-			BoundingBox aabb = transformBoundingBox(calls[i].model, calls[i].mesh->box);
-			if ((!light->camera->testBoxInFrustum(aabb.center, aabb.halfsize) && light->light_type != DIRECTIONAL) || calls[i].material->alpha_mode == BLEND) {
-				continue;
-			}
-			//select if render both sides of the triangles
-			if (calls[i].material->two_sided)
-				glDisable(GL_CULL_FACE);
-			else
-				glEnable(GL_CULL_FACE);
-			assert(glGetError() == GL_NO_ERROR);
-			Mesh* mesh = calls[i].mesh;
-			Matrix44 model = calls[i].model;
-			Texture* c_texture = calls[i].material->color_texture.texture;
-			shader->setUniform("u_viewprojection", light->camera->viewprojection_matrix);
-			shader->setUniform("u_model", model);
-			shader->setUniform("u_texture", c_texture, 5);
-			shader->setUniform("u_alpha_cutoff", calls[i].material->alpha_mode == GTR::eAlphaMode::MASK ? calls[i].material->alpha_cutoff : 0);
-			mesh->render(GL_TRIANGLES);
+		//directional lights render everything, the rest only the calls inside the light's camera frustum
+		if (light->light_type == DIRECTIONAL)
+			visible_calls = sorted_calls;
+		else
+			cullCalls(light->camera, visible_calls);
+
+		//traverse all prefabs (the ones that use blending are skipped), the light camera is uploaded once per pass
+		batchCalls(visible_calls);
+		beginPass();
+		for (int i = 0; i < batches.size(); ++i) {
+			RenderCall& call = calls[batches[i].call];
+			renderMeshWithMaterialShadow(call.model, call.mesh, call.material, light->camera, &batches[i]);
 		}
 		c++; //update light counter
 	}
 	//unbind to render back to the screen
 	atlas->unbind();
-	shader->disable();
+	if (Shader::current)
+		Shader::current->disable();
 	int w = Application::instance->window_width;
 	int h = Application::instance->window_height;
 	glViewport(0, 0, w, h);
 
 	glDisable(GL_SCISSOR_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_CULL_FACE, true);
 
 	//allow to render back to the color buffer
 	glColorMask(true, true, true, true);
@@ -1262,7 +1811,7 @@ void Renderer::renderToAtlas(Camera* camera) {
 void Renderer::renderAtlas() {
 
 	Shader* atlas_shader = Shader::Get("atlas");
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, false);
 
 	int w = Application::instance->window_width;
 	int h = Application::instance->window_height;
@@ -1323,7 +1872,7 @@ void Renderer::renderShadowmaps()
 		light->shadow_fbo->depth_texture->toViewport(zshader);
 	}
 	//Render shadow atlas (singlepass)
-	if (light_mode == SINGLE && depth_viewport && shadow_count > 0)
+	if (light_mode != MULTI && depth_viewport && shadow_count > 0)
 		renderAtlas();
 }
 
@@ -1521,17 +2070,17 @@ Texture* SSAO::apply(Texture* normal_buffer, Texture* depth_buffer, Camera* came
 void Renderer::passDeferredUniforms(Shader* sh, bool first_pass, Camera* camera, Scene* scene, int& w, int& h)
 {
 	//pass the gbuffers to the shader
-	sh->setUniform("u_color_texture", gbuffers_fbo->color_textures[0], 0);
-	sh->setUniform("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
-	sh->setUniform("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
-	sh->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	sh->setUniform(U_COLOR_TEXTURE, gbuffers_fbo->color_textures[0], 0);
+	sh->setUniform(U_NORMAL_TEXTURE, gbuffers_fbo->color_textures[1], 1);
+	sh->setUniform(U_EXTRA_TEXTURE, gbuffers_fbo->color_textures[2], 2);
+	sh->setUniform(U_DEPTH_TEXTURE, gbuffers_fbo->depth_texture, 4);
 
 	//pass the inverse projection of the camera to reconstruct world pos.
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
-	sh->setUniform("u_inverse_viewprojection", inv_vp);
+	sh->setUniform(U_INVERSE_VIEWPROJECTION, inv_vp);
 	//pass the inverse window resolution, this may be useful
-	sh->setUniform("u_iRes", Vector2(1.0 / (float)w, 1.0 / (float)h));
+	sh->setUniform(U_IRES, Vector2(1.0 / (float)w, 1.0 / (float)h));
 
 	//Light uniforms
 	if (first_pass)
@@ -1539,23 +2088,33 @@ void Renderer::passDeferredUniforms(Shader* sh, bool first_pass, Camera* camera,
 		Vector3 ambient = scene->ambient_light;
 		ambient = Vector3(pow(ambient.x, hdr_gamma), pow(ambient.y, hdr_gamma), pow(ambient.z, hdr_gamma));
 
-		sh->setVector3("u_ambient_light", ambient);
-		sh->setUniform("u_emissive", true);
-		sh->setUniform("u_back", true);
-		sh->setUniform("u_ao", activate_ssao);
-		sh->setUniform("u_irr_texture", gbuffers_fbo->color_textures[3], 11);
-		sh->setUniform("u_irr", activate_irr);
+		sh->setUniform(U_AMBIENT_LIGHT, ambient);
+		sh->setUniform(U_EMISSIVE, true);
+		sh->setUniform(U_BACK, true);
+		sh->setUniform(U_AO, activate_ssao);
+		sh->setUniform(U_IRR_TEXTURE, gbuffers_fbo->color_textures[3], 11);
+		sh->setUniform(U_IRR, activate_irr);
 	}
 	else {
-		sh->setVector3("u_ambient_light", Vector3(0, 0, 0));
-		sh->setUniform("u_emissive", false);
-		sh->setUniform("u_back", false);
-		sh->setUniform("u_ao", false);
+		sh->setUniform(U_AMBIENT_LIGHT, Vector3(0, 0, 0));
+		sh->setUniform(U_EMISSIVE, false);
+		sh->setUniform(U_BACK, false);
+		sh->setUniform(U_AO, false);
 	}
 
-	sh->setUniform("u_light_eq", light_eq);
-	sh->setUniform("u_camera_position", camera->eye);
-	sh->setUniform("u_gamma", hdr_gamma);
+	sh->setUniform(U_LIGHT_EQ, light_eq);
+	sh->setUniform(U_CAMERA_POSITION, camera->eye);
+	sh->setUniform(U_GAMMA, hdr_gamma);
+
+	//the first pass adds the lights of every cluster, there is no light volumes pass
+	bool clustered = first_pass && light_mode == CLUSTERED;
+	sh->setUniform(U_CLUSTERED, clustered);
+	if (clustered)
+	{
+		clusters.bind(sh, 9, 10);
+		sh->setUniform(U_PCF, pcf);
+		sh->setUniform(U_TEXTURE_ATLAS, shadow_count && atlas ? atlas->depth_texture : Texture::getBlackTexture(), 7);
+	}
 }
 
 void Renderer::renderProbes()
@@ -1567,9 +2126,9 @@ void Renderer::renderProbes()
 	Shader* shader = Shader::Get("probe");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj",false);
 
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_CULL_FACE, true);
+	GLState::setCapability(GL_BLEND, false);
+	GLState::setCapability(GL_DEPTH_TEST, true);
 
 	shader->enable();
 	
@@ -1589,9 +2148,147 @@ void Renderer::renderProbes()
 	}
 }
 
-void Renderer::extractProbe(ProbeEntity* p, std::vector<RenderCall> calls, Scene* scene) {
+void Renderer::updateProbes(Scene* scene)
+{
+	if (!grid)
+		return;
+
+	bakeAllProbes(scene);
+	grid->baked = true;
+	probes_from_bake = false;
+	scene->saveBake();
+}
+
+void Renderer::bakeAllProbes(Scene* scene)
+{
+	//the scene may be streaming, the probes have to see all of it
+	Loader::finish();
+
+	//update grid
+	grid->updateGrid();
+	int n_probes = grid->probes.size();
+	for (int i = 0; i < n_probes; ++i)
+		grid->updateProbe(grid->probes[i]);
+
+	if (!probes_texture || probes_texture->height != n_probes)
+		createProbesTexture(n_probes);
+
+	//bake all of them, the SH of a probe are computed in the workers (or a shader) while the next ones render
+	queueProbes();
+	changed_boxes.clear();
+	bakeProbes(scene, n_probes, true);
+	Loader::wait();
+	uploadProbes();
+
+	//the shader left them in the texture, the bake file needs them (only 9 texels per probe)
+	if (gpu_sh_projection)
+		readProbes();
+}
+
+void Renderer::loadBakedProbes()
+{
+	grid->updateGrid();
+	int n_probes = grid->probes.size();
+	for (int i = 0; i < n_probes; ++i)
+		grid->updateProbe(grid->probes[i]);
+
+	createProbesTexture(n_probes);
+	for (int i = 0; i < n_probes; ++i)
+	{
+		probe_coeffs[i] = grid->probes[i]->sh;
+		probes_changed.push_back(i);
+	}
+	uploadProbes();
+	probes_from_bake = true;
+}
+
+void Renderer::createProbesTexture(int n_probes)
+{
+	//9 coefficients per probe, as many rows as probes, they require a high range
+	if (probes_texture)
+		delete probes_texture;
+	probes_texture = new Texture(9, n_probes, GL_RGB, GL_FLOAT);
+
+	//disable any texture filtering when reading
+	probes_texture->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	probes_texture->unbind();
+
+	//the projection in the GPU writes the rows directly
+	probes_fbo->setTexture(probes_texture);
+
+	probe_coeffs.assign(n_probes, SphericalHarmonics());
+	probes_changed.clear();
+}
+
+void Renderer::queueProbes(const BoundingBox* box)
+{
+	int n_probes = grid->probes.size();
+	probe_queued.resize(n_probes, false);
+
+	//how far a probe sees the changes, in world units
+	Vector3 influence;
+	if (box)
+	{
+		Vector3 cell(1.0 / std::max(grid->dim.x, 1.0f), 1.0 / std::max(grid->dim.y, 1.0f), 1.0 / std::max(grid->dim.z, 1.0f));
+		influence = transformBoundingBox(grid->model, BoundingBox(Vector3(), cell * probe_influence)).halfsize;
+	}
+
+	for (int i = 0; i < n_probes; ++i)
+	{
+		if (probe_queued[i])
+			continue;
+		if (box)
+		{
+			Vector3 pos = grid->probes[i]->model.getTranslation();
+			if (fabs(pos.x - box->center.x) > influence.x + box->halfsize.x ||
+				fabs(pos.y - box->center.y) > influence.y + box->halfsize.y ||
+				fabs(pos.z - box->center.z) > influence.z + box->halfsize.z)
+				continue;
+		}
+		probe_queued[i] = true;
+		probes_to_bake.push_back(i);
+	}
+}
+
+void Renderer::bakeProbes(Scene* scene, int max_probes, bool flush)
+{
+	for (int n = 0; n < max_probes && !probes_to_bake.empty(); ++n)
+	{
+		int index = probes_to_bake.front();
+		probes_to_bake.pop_front();
+		probe_queued[index] = false;
+		if (index >= grid->probes.size())
+			continue;
+
+		//the shader projects it without reading anything back
+		if (gpu_sh_projection)
+		{
+			renderProbe(index, scene, NULL);
+			continue;
+		}
+
+		//the slot still has the probe rendered two bakes ago, by now the GPU should be done with it
+		sProbeReadback& slot = probe_readbacks[next_readback];
+		if (slot.probe != -1)
+			finishProbeReadback(slot, true);
+		renderProbe(index, scene, &slot);
+		next_readback = (next_readback + 1) % 2;
+	}
+
+	//collect the readbacks that are ready, the oldest first
+	for (int i = 0; i < 2; ++i)
+	{
+		sProbeReadback& slot = probe_readbacks[(next_readback + i) % 2];
+		if (slot.probe != -1)
+			finishProbeReadback(slot, flush);
+	}
+}
 
-	FloatImage images[6]; //here we will store the six views
+void Renderer::renderProbe(int index, Scene* scene, sProbeReadback* slot)
+{
+	ProbeEntity* p = grid->probes[index];
 
 	Camera cam;
 	//set the fov to 90 and the aspect to 1
@@ -1607,69 +2304,193 @@ void Renderer::extractProbe(ProbeEntity* p, std::vector<RenderCall> calls, Scene
 		cam.lookAt(eye, center, up);
 		cam.enable();
 
-		//render the scene from this point of view
+		//render the scene from this point of view and copy it to the pixel buffer, it doesn't wait for the GPU
 		irr_fbo->bind();
-		renderCalls(calls, &cam, scene, FORWARD);
+		renderCalls(&cam, scene, FORWARD);
+		if (slot)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbos[i]);
+			glReadPixels(0, 0, irr_fbo->width, irr_fbo->height, GL_RGB, GL_FLOAT, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
 		irr_fbo->unbind();
 
-		//read the pixels back and store in a FloatImage
-		images[i].fromTexture(irr_fbo->color_textures[0]);
+		if (!slot)
+			projectProbeFace(i);
 	}
 
-	//compute the coefficients given the six images
-	p->sh = computeSH(images, false);
+	if (!slot)
+	{
+		writeProbeSH(index);
+		return;
+	}
+	slot->probe = index;
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-void Renderer::updateProbes(Scene* scene)
+void Renderer::projectProbeFace(int face)
 {
-	if (grid)
+	//every pixel of sh_rows_fbo is a coefficient (x) of a row (y) of the face, the faces are added
+	sh_rows_fbo->bind();
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_CULL_FACE, false);
+	GLState::setCapability(GL_BLEND, face > 0);
+	GLState::blendFunc(GL_ONE, GL_ONE);
+
+	Shader* shader = Shader::Get("sh_rows");
+	shader->enable();
+	shader->setUniform("u_texture", irr_fbo->color_textures[0], 0);
+	shader->setUniform3Array("u_face_axis", cubemapFaceNormals[face][0].v, 3);
+	shader->setUniform("u_scale", getSHSolidAngleScale(irr_fbo->width));
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+
+	GLState::setCapability(GL_BLEND, false);
+	sh_rows_fbo->unbind();
+}
+
+void Renderer::writeProbeSH(int index)
+{
+	//the rows are added into the row of the probe
+	probes_fbo->bind();
+	glViewport(0, index, 9, 1);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
+
+	Shader* shader = Shader::Get("sh_sum");
+	shader->enable();
+	shader->setUniform("u_texture", sh_rows_fbo->color_textures[0], 0);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+
+	probes_fbo->unbind();
+}
+
+void Renderer::readProbes()
+{
+	probes_texture->bind();
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, &probe_coeffs[0]);
+	probes_texture->unbind();
+	for (int i = 0; i < probe_coeffs.size() && i < grid->probes.size(); ++i)
+		grid->probes[i]->sh = probe_coeffs[i];
+}
+
+bool Renderer::compareProbeProjections(Scene* scene, float tolerance)
+{
+	if (!grid)
+		return false;
+
+	bool gpu = gpu_sh_projection;
+	gpu_sh_projection = false;
+	bakeAllProbes(scene);
+	std::vector<SphericalHarmonics> reference = probe_coeffs;
+	gpu_sh_projection = true;
+	bakeAllProbes(scene);
+	gpu_sh_projection = gpu;
+
+	//the error of every probe is relative to its biggest coefficient, the small ones are mostly noise
+	float max_error = 0;
+	int failed = 0;
+	for (int i = 0; i < reference.size() && i < probe_coeffs.size(); ++i)
 	{
-		//update grid
-		grid->updateGrid();
-		int n_probes = grid->probes.size();
-		if (!probes_texture)
-		{
-			//create the texture to store the probes (do this ONCE!!!)
-			probes_texture = new Texture(
-				9, //9 coefficients per probe
-				n_probes, //as many rows as probes
-				GL_RGB, //3 channels per coefficient
-				GL_FLOAT); //they require a high range
-		}
+		float max_value = 0;
+		float error = 0;
+		for (int k = 0; k < 9; ++k)
+			for (int c = 0; c < 3; ++c)
+			{
+				error = std::max(error, (float)fabs(probe_coeffs[i].coeffs[k].v[c] - reference[i].coeffs[k].v[c]));
+				max_value = std::max(max_value, (float)fabs(reference[i].coeffs[k].v[c]));
+			}
+		if (max_value > 0)
+			error /= max_value;
+		max_error = std::max(max_error, error);
+		if (error > tolerance)
+			failed++;
+	}
 
-		//we must create the color information for the texture. because every SH are 27 floats in the RGB,RGB,... order, we can create an array of SphericalHarmonics and use it as pixels of the texture
-		SphericalHarmonics* sh_data = NULL;
-		sh_data = new SphericalHarmonics[n_probes];
+	bool passed = !failed && reference.size() == probe_coeffs.size();
+	std::cout << (passed ? "[PASS]" : "[FAIL]") << " SH projection GPU vs CPU: max relative error " << max_error <<
+		" (tolerance " << tolerance << "), " << failed << " of " << reference.size() << " probes over it" << std::endl;
+	return passed;
+}
 
-		//extract each probe
-		for (int i = 0; i < n_probes; ++i)
+bool Renderer::finishProbeReadback(sProbeReadback& slot, bool wait)
+{
+	GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	while (wait && status == GL_TIMEOUT_EXPIRED)
+		status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	if (status == GL_TIMEOUT_EXPIRED)
+		return false;
+	glDeleteSync(slot.fence);
+	slot.fence = 0;
+
+	//copy the faces so the buffers can be reused, the projection is done in a worker
+	struct sProbeBake {
+		int probe;
+		FloatImage images[6];
+	};
+	sProbeBake* bake = new sProbeBake();
+	bake->probe = slot.probe;
+	slot.probe = -1;
+
+	int w = irr_fbo->width;
+	int h = irr_fbo->height;
+	for (int i = 0; i < 6; ++i)
+	{
+		bake->images[i].resize(w, h, 3);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbos[i]);
+		float* pixels = (float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, w * h * 3 * sizeof(float), GL_MAP_READ_BIT);
+		if (pixels)
 		{
-			ProbeEntity* p = grid->probes[i];
-			//update position
-			grid->updateProbe(p);
-			extractProbe(p, calls, scene);
-
-			sh_data[i] = p->sh;
+			memcpy(bake->images[i].data, pixels, w * h * 3 * sizeof(float));
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
 		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	Loader::run([this, bake]() {
+		//the faces of this probe are already spread over the workers, no need for more threads
+		SphericalHarmonics sh = computeSH(bake->images, false, false);
+		int index = bake->probe;
+		delete bake;
+		Loader::onMainThread([this, index, sh]() {
+			//the grid could have changed while it was computed
+			if (index >= probe_coeffs.size())
+				return;
+			probe_coeffs[index] = sh;
+			probes_changed.push_back(index);
+		});
+	});
+	return true;
+}
 
-		probes_texture->upload(GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
+void Renderer::uploadProbes()
+{
+	if (!probes_texture)
+		return;
 
-		//disable any texture filtering when reading
-		probes_texture->bind();
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		probes_texture->unbind();
+	//every SH are 27 floats in the RGB,RGB,... order, a row of the texture
+	probes_texture->bind();
+	for (int i = 0; i < probes_changed.size(); ++i)
+	{
+		int index = probes_changed[i];
+		if (index >= probe_coeffs.size() || index >= probes_texture->height)
+			continue;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, index, 9, 1, GL_RGB, GL_FLOAT, &probe_coeffs[index]);
 
-		//always free memory after allocating it!!!
-		delete[] sh_data;
+		//the probes keep a copy to debug them
+		if (index < grid->probes.size())
+			grid->probes[index]->sh = probe_coeffs[index];
 	}
+	probes_texture->unbind();
+	probes_changed.clear();
 }
 
 void GTR::Renderer::renderReflectionProbes(Scene* scene, Camera* camera)
 {
-	glDisable(GL_BLEND);
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_BLEND, false);
+	GLState::setCapability(GL_CULL_FACE, true);
+	GLState::setCapability(GL_DEPTH_TEST, false);
 
 	Shader* shader = Shader::Get("reflection_probe");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj", false);
@@ -1694,14 +2515,17 @@ void GTR::Renderer::renderReflectionProbes(Scene* scene, Camera* camera)
 		mesh->render(GL_TRIANGLES);
 	}
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::setCapability(GL_CULL_FACE, true);
+	GLState::setCapability(GL_DEPTH_TEST, true);
 }
 
 void GTR::Renderer::updateReflectionProbes(Scene* scene)
 {
 	std::cout << "hola";
 
+	//the scene may be streaming, the cubemaps have to see all of it
+	Loader::finish();
+
 	Camera cam;
 	//set the fov to 90 and the aspect to 1
 	cam.setPerspective(90, 1, 0.1, 1000);
@@ -1725,11 +2549,14 @@ void GTR::Renderer::updateReflectionProbes(Scene* scene)
 			Vector3 up = cubemapFaceNormals[i][1];
 			cam.lookAt(eye, center, up);
 			cam.enable();
-			renderCalls(calls, &cam, scene, FORWARD);
+			renderCalls(&cam, scene, FORWARD);
 			reflections_fbo->unbind();
 		}
 
 		//generate the mipmaps
 		probe->cubemap->generateMipmaps();
+		probe->baked = true;
 	}
+
+	scene->saveBake();
 }
\ No newline at end of file
@@ -1,10 +1,15 @@
 #pragma once
 #include "prefab.h"
 #include "rendercall.h"
+#include "bvh.h"
+#include "clusters.h"
 #include "scene.h"
 #include "fbo.h"
+#include "shader.h"
 #include "application.h"
 
+#include <deque>
+
 //forward declarations
 class Camera;
 class HDRE;
@@ -20,7 +25,7 @@ namespace GTR {
 	enum eLightMode {
 		SINGLE,
 		MULTI,
-		BRUH
+		CLUSTERED
 	};
 
 	enum eLightEq {
@@ -52,12 +57,40 @@ namespace GTR {
 		Texture* apply(Texture* normal_buffer, Texture* depth_buffer, Camera* camera);
 	};
 
+	//std140 uniform blocks, they must match camera_block and light_block in the shader atlas
+	//every member is a multiple of 16 bytes so the C++ layout is the same as the GPU one
+	struct sCameraBlock {
+		Matrix44 viewprojection;
+		Matrix44 view;
+		Vector3 camera_position;
+		float gamma;
+	};
+
+	struct sLightData {
+		Matrix44 shadow_viewproj;
+		Vector4 position; //w: max distance
+		Vector4 color; //w: intensity
+		Vector4 vector; //w: cosine of the cone angle
+		Vector4 uvs; //w: spot exponent
+		int type;
+		int shadows;
+		float bias;
+		float padding;
+	};
+
 	class Renderer
 	{
 
 	public:
 		static const int max_lights = 100; //Setting the maximum light number to 10
 
+		struct sLightBlock {
+			int num_lights;
+			int shadow_count;
+			int padding[2];
+			sLightData lights[max_lights]; //last, so only the used lights need to be uploaded
+		};
+
 		eRenderMode render_mode;
 		eLightMode light_mode;
 		eLightEq light_eq;
@@ -76,6 +109,7 @@ namespace GTR {
 		bool show_probes;
 		bool volumetric;
 		bool show_reflection_probes;
+		bool instancing; //to draw the calls that share mesh and material with one instanced draw
 		float air_density;
 
 		int depth_light;
@@ -86,13 +120,35 @@ namespace GTR {
 		float hdr_white_balance;
 		float hdr_gamma;
 
-		std::vector<RenderCall> calls;
+		std::vector<RenderCall> calls; //frame call buffer, passes refer to it by index and never copy it
 		std::vector<LightEntity*> lights;
 		std::vector<ReflectionProbeEntity*> reflection_probes;
 		IrradianceGrid* grid;
 		LightEntity* directional_light;
 
 		Texture* probes_texture;
+
+		//irradiance probes baking: the faces of a probe are read back through pixel buffers while the next one renders,
+		//and their SH are projected in the Loader threads
+		struct sProbeReadback {
+			int probe; //index in the grid, -1 if the slot is free
+			GLuint pbos[6];
+			GLsync fence;
+		};
+		sProbeReadback probe_readbacks[2];
+		int next_readback;
+		std::deque<int> probes_to_bake; //indices in the grid
+		std::vector<bool> probe_queued;
+		std::vector<SphericalHarmonics> probe_coeffs; //results of the bakes, uploaded to probes_texture
+		std::vector<int> probes_changed; //rows of probes_texture to upload
+		int probes_per_frame; //probes baked per frame when the geometry around them changes
+		float probe_influence; //cells around a probe where a change in the geometry bakes it again
+		std::vector<BoundingBox> changed_boxes; //world boxes of the calls removed or added since the probes were checked
+		bool probes_from_bake; //the SH of probes_texture were read from the bake file
+		bool gpu_sh_projection; //the SH are projected in a shader and written to probes_texture, nothing is read back
+		FBO* sh_rows_fbo; //9 x face height, the projection of every row of the faces
+		FBO* probes_fbo; //with probes_texture
+
 		FBO* atlas;
 		FBO* gbuffers_fbo;
 		FBO* illumination_fbo;
@@ -110,6 +166,52 @@ namespace GTR {
 
 		Matrix44 prev_vp;
 
+		//retained render calls, only the prefab entities that changed are walked again
+		struct sRetainedPrefab {
+			int entity_id; //m_Id of the entity, a different one means the entity was deleted and its address reused
+			Prefab* prefab;
+			int revision; //revision of the root of the prefab when the calls were built
+			Matrix44 model;
+			long frame; //last frame the entity was fetched
+			bool dirty; //its calls have to be built again
+			bool moved; //only its model changed, its calls are moved where they are
+		};
+		std::map<PrefabEntity*, sRetainedPrefab> retained_prefabs;
+		std::vector<Vector3> retained_probes; //probe positions used to assign call.probe
+		long retained_frame;
+		int num_calls_rebuilt; //calls generated again during the last fetch
+
+		BVH bvh; //hierarchy over the world boxes of the calls, used to cull them
+		std::vector<int> visible_calls; //indices of the calls that passed the culling of the current pass
+		std::vector<int> sorted_calls; //indices of the calls in render order
+		std::vector<int> call_rank; //position of every call in sorted_calls
+		std::vector<uint64> cull_keys; //ranks of the visible calls, to sort them
+
+		//calls of a pass that share mesh, material and probe, they are drawn together
+		struct sBatch {
+			int call;	//first call of the batch, it gives the mesh and the material
+			int first;	//first model in batch_models
+			int count;
+		};
+		std::vector<sBatch> batches; //batches of the current pass, in render order
+		std::vector<Matrix44> batch_models; //models of the calls of every batch, grouped by batch
+		std::vector<int> call_batch; //batch of every visible call, used while grouping
+
+		//open batch of a mesh, material and probe, in the hash table used while grouping
+		struct sBatchSlot {
+			Mesh* mesh;
+			Material* material;
+			ReflectionProbeEntity* probe;
+			int batch; //-1 if the slot is empty
+		};
+		std::vector<sBatchSlot> batch_table; //open addressing, cleared every pass but its memory is kept
+
+		Shader* pass_shaders[2][3]; //shader used by every pipeline (and its instanced version) during the current pass, fetched on the first draw
+
+		GLuint block_buffers[UB_NUM_BLOCKS]; //uniform buffers bound to the binding point of every eUniformBlock
+
+		LightClusters clusters; //lights of every froxel of the current camera (CLUSTERED light mode)
+
 		//Post FX parameters
 		float bloom_th;
 		float bloom_soft_th;
@@ -124,6 +226,8 @@ namespace GTR {
 
 		//update the light viewproj matrix and parameters
 		void updateLight(LightEntity* light, Camera* camera);
+		//fits the cascades of a directional light to the camera frustum, update says which ones must be rendered
+		void updateCascades(LightEntity* light, Camera* camera, bool* update);
 
 		void renderToFBO(Scene* scene, Camera* camera);
 
@@ -131,43 +235,75 @@ namespace GTR {
 		void renderScene(Scene* scene, Camera* camera);
 		//fetches scene entities
 		void fetchSceneEntities(Scene* scene, Camera* camera, bool fetch_prefabs, bool fetch_lights, bool fetch_probes, bool fetch_grid);
+		//updates the retained calls, rebuilding only the prefab entities that changed
+		void updateCalls(Scene* scene, Camera* camera);
+		//forces all the calls to be generated again in the next fetch
+		void invalidateCalls();
+		//fills result with the calls visible from the camera, in render order
+		void cullCalls(Camera* camera, std::vector<int>& result);
+		//resyncs the gl state cache before a loop of draws
+		void beginPass();
+		//groups the visible calls in batches (see sBatch), blended calls are only grouped with the previous one to keep their order
+		void batchCalls(const std::vector<int>& visible);
+		sBatchSlot* findBatchSlot(const RenderCall& call);
+		//draws the mesh once per model of the batch, with an instanced draw if there is more than one
+		void drawMesh(Mesh* mesh, const sBatch* batch);
+		//fill the uniform blocks, programs that declare them don't need these uniforms per draw
+		void uploadCameraBlock(Camera* camera);
+		void uploadLightBlock();
+		void uploadBlock(eUniformBlock block, const void* data, int size, int capacity);
+		//assigns the closest reflection probe to the call
+		void assignProbe(RenderCall& call);
 		//to render a whole prefab (with all its nodes)
 		void getCallsFromPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
 		//to render one node from the prefab and its children
 		void getCallsFromNode(const Matrix44& model, GTR::Node* node, Camera* camera);
 		//to render one mesh given its material and transformation matrix
 		//void renderMeshWithMaterial(const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* camera, Scene* scene, eRenderMode pipeline);
-		void renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* scene, eRenderMode pipeline);
+		void renderMeshWithMaterial(RenderCall& call, Camera* camera, Scene* scene, eRenderMode pipeline, const sBatch* batch = NULL);
 
 		//render the shadowmap
-		void renderMeshWithMaterialShadow(const Matrix44& model, Mesh* mesh, GTR::Material* material, LightEntity* light);
+		void renderMeshWithMaterialShadow(const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* light_camera, const sBatch* batch = NULL);
 
 		//to create the shadowmaps
 		void shadowMapping(LightEntity* light, Camera* camera);
+		void cascadedShadowMapping(LightEntity* light, Camera* camera);
 		void renderToAtlas(Camera* camera);
 		void renderAtlas();
 		void renderShadowmaps();
 
 		//different renders for the different light_modes
-		void renderMultiPass(Mesh* mesh, Material* material, Shader* shader, eRenderMode pipeline);
+		void renderMultiPass(Mesh* mesh, Material* material, Shader* shader, eRenderMode pipeline, const sBatch* batch);
 		void renderMultiPassSphere(Shader* sh, Camera* camera);
-		void renderSinglePass(Shader* shader, Mesh* mesh);
+		void renderSinglePass(Shader* shader, Mesh* mesh, bool first_draw, const sBatch* batch);
+		void renderClustered(Mesh* mesh, Shader* shader, eRenderMode pipeline, bool first_draw, const sBatch* batch);
 
-		//renderers
-		void renderCalls(std::vector<RenderCall> calls, Camera* camera, Scene* scene, eRenderMode pipeline);
-		void renderDeferred(std::vector<RenderCall> calls, Camera* camera, Scene* scene);
+		//renderers (they render the calls of the frame buffer visible from the camera)
+		void renderCalls(Camera* camera, Scene* scene, eRenderMode pipeline);
+		void renderDeferred(Camera* camera, Scene* scene);
 		void passDeferredUniforms(Shader* sh, bool first_pass, Camera* camera, Scene* scene, int& w, int& h);
 
 		//
-		void renderGBuffers(std::vector<RenderCall> calls, Camera* camera, Scene* scene, int& w, int& h);
+		void renderGBuffers(Camera* camera, Scene* scene, int& w, int& h);
 		void showGbuffers(FBO* gbuffers_fbo, Camera* camera);
 
 		//irradiance
 		void renderProbes();
-		void extractProbe(ProbeEntity* p, std::vector<RenderCall> calls, Scene* scene);
 		void updatecoeffs(float hdr[3], float domega, ProbeEntity p);
 
-		void updateProbes( Scene* scene);
+		void updateProbes( Scene* scene); //bakes the whole grid and saves the bake file
+		void bakeAllProbes(Scene* scene); //bakes the whole grid, nothing is saved
+		void loadBakedProbes(); //uses the SH the grid already has
+		void createProbesTexture(int n_probes);
+		void queueProbes(const BoundingBox* box = NULL); //the probes influenced by the box, or all of them
+		void bakeProbes(Scene* scene, int max_probes, bool flush); //flush waits for the last readbacks
+		void renderProbe(int index, Scene* scene, sProbeReadback* slot); //without slot the SH are projected in the GPU
+		bool finishProbeReadback(sProbeReadback& slot, bool wait); //false if the GPU has not finished it
+		void projectProbeFace(int face);
+		void writeProbeSH(int index);
+		void uploadProbes();
+		void readProbes(); //from probes_texture
+		bool compareProbeProjections(Scene* scene, float tolerance = 1e-4); //bakes with the CPU and the GPU, false if they differ more than the relative tolerance
 		void updateReflectionProbes(Scene* scene);
 		void renderReflectionProbes(Scene* scene, Camera* camera);
 
@@ -2,15 +2,26 @@
 #include "utils.h"
 #include "application.h"
 #include "shader.h"
+#include "texture.h"
+#include "glstate.h"
 
 #include "prefab.h"
+#include "loader.h"
+#include "lz.h"
+#include "gltf_loader.h"
 #include "extra/cJSON.h"
 
+#include <cstdio>
+
+#define SCENE_BAKE_VERSION 2
+
 GTR::Scene* GTR::Scene::instance = NULL;
+std::atomic<int> GTR::BaseEntity::s_EntityID(0);
 
 GTR::Scene::Scene()
 {
 	instance = this;
+	bake_key = 0;
 }
 
 void GTR::Scene::clear()
@@ -29,6 +40,40 @@ void GTR::Scene::addEntity(BaseEntity* entity)
 	entities.push_back(entity); entity->scene = this;
 }
 
+//FNV-1a
+static uint64 hashBytes(uint64 hash, const void* data, size_t size)
+{
+	const uint8* bytes = (const uint8*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+//the JSON plus the time and size of every prefab and the files it depends on, the same check the .pbin does
+uint64 GTR::Scene::computeBakeKey(const std::string& content)
+{
+	uint64 key = hashBytes(14695981039346656037ull, content.c_str(), content.size());
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		if (entities[i]->entity_type != PREFAB)
+			continue;
+		PrefabEntity* ent = (PrefabEntity*)entities[i];
+		if (ent->filename.empty())
+			continue;
+
+		std::vector<std::string> files(1, std::string("data/") + ent->filename);
+		getGLTFDependencies(files[0].c_str(), files);
+		for (int j = 0; j < files.size(); ++j)
+		{
+			uint64 file_info[2] = { 0, 0 }; //a missing file counts as a change too
+			getFileInfo(files[j].c_str(), file_info[0], file_info[1]);
+			key = hashBytes(key, files[j].c_str(), files[j].size());
+			key = hashBytes(key, file_info, sizeof(file_info));
+		}
+	}
+	return key;
+}
+
 bool GTR::Scene::load(const char* filename)
 {
 	std::string content;
@@ -114,6 +159,15 @@ bool GTR::Scene::load(const char* filename)
 	//free memory
 	cJSON_Delete(json);
 
+	//the bake is only valid for the same JSON and the same files of its prefabs
+	bake_key = computeBakeKey(content);
+
+	//the prefabs are loaded in the Loader threads, wait for them and upload what they read
+	Loader::wait();
+
+	//the probes baked in a previous session, if the scene didn't change
+	loadBake();
+
 	for (int i = 0; i < 20; ++i)
 	{
 		LightEntity* light = new LightEntity();
@@ -143,6 +197,308 @@ bool GTR::Scene::load(const char* filename)
 	return true;
 }
 
+//SCENE BAKE: the SH of every probe of the irradiance grid and the cubemaps of the reflection probes (all their levels,
+//face after face like the HDRE files), tagged with the key of the scene so it is ignored when the scene or its assets change
+
+struct sSceneBakeInfo {
+	int version;
+	int header_bytes;
+	uint64 bake_key;
+	int dim[3]; //of the grid, 0 if it was not baked
+	int num_probes;
+	int num_reflection_probes;
+};
+
+struct sSceneBakeCubemap {
+	int baked; //0 if this probe was not rendered, nothing else is stored
+	int width;
+	int height;
+	int num_levels;
+	int bytes; //RGB pixels of all the levels and faces
+	int compressed_bytes; //with lz
+};
+
+//the entities are matched by their order in the scene
+static GTR::IrradianceGrid* findGrid(GTR::Scene* scene)
+{
+	for (int i = 0; i < scene->entities.size(); ++i)
+		if (scene->entities[i]->entity_type == GTR::IRRADIANCE_GRID)
+			return (GTR::IrradianceGrid*)scene->entities[i];
+	return NULL;
+}
+
+static void findReflectionProbes(GTR::Scene* scene, std::vector<GTR::ReflectionProbeEntity*>& probes)
+{
+	for (int i = 0; i < scene->entities.size(); ++i)
+		if (scene->entities[i]->entity_type == GTR::REFLECTION_PROBE)
+			probes.push_back((GTR::ReflectionProbeEntity*)scene->entities[i]);
+}
+
+static int cubemapLevels(Texture* cubemap)
+{
+	int levels = 1;
+	while (((int)cubemap->width >> levels) > 0 && ((int)cubemap->height >> levels) > 0)
+		levels++;
+	return levels;
+}
+
+//what a save reads from the GPU, the worker compresses and writes it
+struct sSceneBakeData {
+	int version; //of this save, an older one that finishes later doesn't overwrite it
+	std::string filename;
+	sSceneBakeInfo info;
+	std::vector<SphericalHarmonics> sh;
+	std::vector<sSceneBakeCubemap> cubemaps;
+	std::vector<std::vector<uint8>> pixels;
+};
+
+static std::mutex s_bake_mutex;
+static int s_bake_versions = 0; //main thread
+static int s_bake_written = 0; //with s_bake_mutex
+
+static void writeBake(sSceneBakeData* bake)
+{
+	std::vector<uint8> compressed;
+	std::vector<std::vector<uint8>> stored(bake->cubemaps.size());
+	for (int i = 0; i < bake->cubemaps.size(); ++i)
+	{
+		sSceneBakeCubemap& cube_info = bake->cubemaps[i];
+		if (!cube_info.baked)
+			continue;
+
+		//only keep the compressed version if it is worth it
+		std::vector<uint8>& pixels = bake->pixels[i];
+		int compressed_size = lzCompress(&pixels[0], cube_info.bytes, compressed);
+		if (compressed_size < cube_info.bytes)
+		{
+			cube_info.compressed_bytes = compressed_size;
+			stored[i].assign(compressed.begin(), compressed.begin() + compressed_size);
+		}
+		else
+			stored[i].swap(pixels);
+	}
+
+	std::lock_guard<std::mutex> lock(s_bake_mutex);
+	if (bake->version < s_bake_written)
+		return;
+
+	//written aside and renamed, a bake cut in the middle would be read as valid
+	std::string tmpfilename = bake->filename + ".tmp";
+	FILE* f = fopen(tmpfilename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write scene bake: " << bake->filename << std::endl;
+		return;
+	}
+
+	bool ok = true;
+	ok &= fwrite("BAKE", sizeof(char), 4, f) == 4;
+	ok &= fwrite(&bake->info, sizeof(bake->info), 1, f) == 1;
+	if (bake->sh.size())
+		ok &= fwrite(&bake->sh[0], sizeof(SphericalHarmonics), bake->sh.size(), f) == bake->sh.size();
+	for (int i = 0; i < bake->cubemaps.size(); ++i)
+	{
+		ok &= fwrite(&bake->cubemaps[i], sizeof(sSceneBakeCubemap), 1, f) == 1;
+		if (stored[i].size())
+			ok &= fwrite(&stored[i][0], 1, stored[i].size(), f) == stored[i].size();
+	}
+	ok &= fclose(f) == 0;
+
+	remove(bake->filename.c_str());
+	if (!ok || rename(tmpfilename.c_str(), bake->filename.c_str()) != 0)
+	{
+		std::cout << "[ERROR] cannot write scene bake: " << bake->filename << std::endl;
+		remove(tmpfilename.c_str());
+		return;
+	}
+	s_bake_written = bake->version;
+}
+
+bool GTR::Scene::saveBake()
+{
+	if (filename.empty())
+		return false;
+
+	//the meshes and textures still streaming are missing in the probes, the bake would be stored incomplete
+	if (Loader::numPendingJobs() || Loader::numPendingUploads())
+	{
+		std::cout << "[WARN] bake not saved, the scene is still loading" << std::endl;
+		return false;
+	}
+
+	IrradianceGrid* grid = findGrid(this);
+	std::vector<ReflectionProbeEntity*> reflection_probes;
+	findReflectionProbes(this, reflection_probes);
+
+	sSceneBakeData* bake = new sSceneBakeData();
+	bake->version = ++s_bake_versions;
+	bake->filename = filename + ".bake";
+	sSceneBakeInfo& info = bake->info;
+	memset(&info, 0, sizeof(info));
+	info.version = SCENE_BAKE_VERSION;
+	info.header_bytes = sizeof(sSceneBakeInfo);
+	info.bake_key = bake_key;
+	if (grid && grid->baked)
+	{
+		info.dim[0] = grid->dim.x;
+		info.dim[1] = grid->dim.y;
+		info.dim[2] = grid->dim.z;
+		info.num_probes = grid->probes.size();
+	}
+	info.num_reflection_probes = reflection_probes.size();
+
+	for (int i = 0; i < info.num_probes; ++i)
+		bake->sh.push_back(grid->probes[i]->sh);
+
+	//the cubemaps are read back from the GPU, only after an explicit bake that already stalled for the rendering
+	bake->cubemaps.resize(reflection_probes.size());
+	bake->pixels.resize(reflection_probes.size());
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (int i = 0; i < reflection_probes.size(); ++i)
+	{
+		ReflectionProbeEntity* probe = reflection_probes[i];
+		sSceneBakeCubemap& cube_info = bake->cubemaps[i];
+		memset(&cube_info, 0, sizeof(cube_info));
+		if (!probe->baked || !probe->cubemap)
+			continue;
+
+		Texture* cubemap = probe->cubemap;
+		cube_info.baked = 1;
+		cube_info.width = cubemap->width;
+		cube_info.height = cubemap->height;
+		cube_info.num_levels = cubemapLevels(cubemap);
+		std::vector<uint8>& pixels = bake->pixels[i];
+		glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap->texture_id);
+		GLState::forgetActiveTexture();
+		for (int level = 0; level < cube_info.num_levels; ++level)
+		{
+			int face_bytes = std::max(1, cube_info.width >> level) * std::max(1, cube_info.height >> level) * 3;
+			for (int face = 0; face < 6; ++face)
+			{
+				pixels.resize(pixels.size() + face_bytes);
+				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB, GL_UNSIGNED_BYTE, &pixels[pixels.size() - face_bytes]);
+			}
+		}
+		cube_info.bytes = pixels.size();
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+	//the compression and the file in a worker
+	Loader::run([bake]() {
+		writeBake(bake);
+		delete bake;
+	});
+	return true;
+}
+
+bool GTR::Scene::loadBake()
+{
+	std::string bakefilename = filename + ".bake";
+	sMappedFile* file = mapFile(bakefilename.c_str());
+	if (!file)
+		return false;
+
+	IrradianceGrid* grid = findGrid(this);
+	std::vector<ReflectionProbeEntity*> reflection_probes;
+	findReflectionProbes(this, reflection_probes);
+
+	const char* pos = file->data;
+	const char* end = file->data + file->size;
+	sSceneBakeInfo info;
+	if (end - pos < 4 + (int)sizeof(info) || memcmp(pos, "BAKE", 4) != 0)
+	{
+		std::cout << "[WARN] loading scene bake: invalid file: " << bakefilename << std::endl;
+		unmapFile(file);
+		return false;
+	}
+	memcpy(&info, pos + 4, sizeof(info));
+	pos += 4 + sizeof(info);
+	if (info.version != SCENE_BAKE_VERSION || info.header_bytes != sizeof(sSceneBakeInfo) || info.num_probes < 0 || info.num_reflection_probes < 0)
+	{
+		std::cout << "[WARN] loading scene bake: old version: " << bakefilename << std::endl;
+		unmapFile(file);
+		return false;
+	}
+	if (info.bake_key != bake_key || info.num_reflection_probes != reflection_probes.size())
+	{
+		std::cout << "[WARN] loading scene bake: outdated, " << filename << " or its assets changed" << std::endl;
+		unmapFile(file);
+		return false;
+	}
+
+	//the grid only if it has the same probes
+	if (end - pos < (long)info.num_probes * (long)sizeof(SphericalHarmonics))
+	{
+		unmapFile(file);
+		return false;
+	}
+	if (grid && info.num_probes && info.num_probes == grid->probes.size() &&
+		info.dim[0] == (int)grid->dim.x && info.dim[1] == (int)grid->dim.y && info.dim[2] == (int)grid->dim.z)
+	{
+		for (int i = 0; i < info.num_probes; ++i)
+			memcpy(&grid->probes[i]->sh, pos + i * sizeof(SphericalHarmonics), sizeof(SphericalHarmonics));
+		grid->baked = true;
+	}
+	pos += info.num_probes * sizeof(SphericalHarmonics);
+
+	std::vector<uint8> pixels;
+	std::vector<Uint8*> faces(6);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int i = 0; i < reflection_probes.size(); ++i)
+	{
+		sSceneBakeCubemap cube_info;
+		if (end - pos < (int)sizeof(cube_info))
+			break;
+		memcpy(&cube_info, pos, sizeof(cube_info));
+		pos += sizeof(cube_info);
+		if (!cube_info.baked)
+			continue;
+
+		int stored_bytes = cube_info.compressed_bytes ? cube_info.compressed_bytes : cube_info.bytes;
+		if (cube_info.width <= 0 || cube_info.height <= 0 || cube_info.num_levels <= 0 || cube_info.num_levels > 16 ||
+			cube_info.bytes <= 0 || stored_bytes < 0 || stored_bytes > end - pos)
+			break;
+
+		//the levels have to fill the pixels exactly
+		int expected = 0;
+		for (int level = 0; level < cube_info.num_levels; ++level)
+			expected += std::max(1, cube_info.width >> level) * std::max(1, cube_info.height >> level) * 3 * 6;
+		const uint8* data = (const uint8*)pos;
+		pos += stored_bytes;
+		if (expected != cube_info.bytes)
+			continue;
+		if (cube_info.compressed_bytes)
+		{
+			pixels.resize(cube_info.bytes);
+			if (!lzDecompress(data, cube_info.compressed_bytes, &pixels[0], cube_info.bytes))
+				continue;
+			data = &pixels[0];
+		}
+
+		//the same storage the renderer creates, with every level uploaded
+		Texture* cubemap = reflection_probes[i]->cubemap;
+		if (cubemap->width != cube_info.width || cubemap->height != cube_info.height)
+			cubemap->createCubemap(cube_info.width, cube_info.height, NULL, cubemap->format, cubemap->type, false);
+		for (int level = 0; level < cube_info.num_levels; ++level)
+		{
+			int face_bytes = std::max(1, cube_info.width >> level) * std::max(1, cube_info.height >> level) * 3;
+			for (int face = 0; face < 6; ++face)
+				faces[face] = (Uint8*)data + face * face_bytes;
+			cubemap->uploadCubemap(GL_RGB, GL_UNSIGNED_BYTE, false, &faces[0], 0, level);
+			data += face_bytes * 6;
+		}
+		glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap->texture_id);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
+		GLState::forgetActiveTexture();
+		reflection_probes[i]->baked = true;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	unmapFile(file);
+	std::cout << " + Scene bake loaded: " << bakefilename << std::endl;
+	return true;
+}
+
 GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 {
 	if (type == "PREFAB")
@@ -183,7 +539,8 @@ void GTR::PrefabEntity::configure(cJSON* json)
 	if (cJSON_GetObjectItem(json, "filename"))
 	{
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
-		prefab = GTR::Prefab::Get( (std::string("data/") + filename).c_str());
+		std::string path = std::string("data/") + filename;
+		Loader::run([this, path]() { prefab = GTR::Prefab::Get(path.c_str()); });
 	}
 }
 
@@ -222,6 +579,7 @@ void GTR::ProbeEntity::renderInMenu()
 GTR::IrradianceGrid::IrradianceGrid()
 {
 	entity_type = IRRADIANCE_GRID;
+	baked = false;
 	inv_model = model;
 	inv_model.inverse();
 }
@@ -275,6 +633,11 @@ GTR::LightEntity::LightEntity()
 	uvs = Vector3();
 
 	shadow_fbo = NULL;
+
+	num_cascades = 4;
+	cascade_lambda = 0.75;
+	cascade_distance = 0;
+	cascades_frame = 0;
 }
 
 void GTR::LightEntity::configure(cJSON* json)
@@ -340,6 +703,14 @@ void GTR::LightEntity::configure(cJSON* json)
 	{
 		cast_shadows = readJSONBool(json, "cast_shadows", false);
 	}
+	if (cJSON_GetObjectItem(json, "cascades"))
+	{
+		num_cascades = (int)clamp(readJSONNumber(json, "cascades", 1), 1, max_cascades);
+	}
+	if (cJSON_GetObjectItem(json, "cascade_distance"))
+	{
+		cascade_distance = readJSONNumber(json, "cascade_distance", 0);
+	}
 }
 
 bool GTR::LightEntity::lightBounding(Camera* camera)
@@ -367,6 +738,9 @@ void GTR::LightEntity::renderInMenu()
 		ImGui::Text("DIRECTIONAL LIGHT"); // Edit 3 floats representing a color
 		ImGui::SliderFloat("Light area", &area_size, 0.0f, 5000.0f);
 		ImGui::Checkbox("Cast Shadows", &cast_shadows);
+		ImGui::SliderInt("Cascades", &num_cascades, 1, max_cascades);
+		ImGui::SliderFloat("Cascade split", &cascade_lambda, 0.0f, 1.0f);
+		ImGui::SliderFloat("Cascade distance", &cascade_distance, 0.0f, 5000.0f);
 	}
 	if (light_type == SPOT)
 	{
@@ -391,32 +765,44 @@ void GTR::LightEntity::uploadLightParams(Shader* sh, bool linearize, float& hdr_
 	if (cast_shadows) {
 		//If shadows are enabled, pass the shadowmap
 		Texture* shadowmap = shadow_fbo->depth_texture;
-		sh->setTexture("shadowmap", shadowmap, 8);
+		sh->setUniform(U_SHADOWMAP, shadowmap, 8);
 		Matrix44 shadow_proj = camera->viewprojection_matrix;
-		sh->setUniform("u_shadow_viewproj", shadow_proj);
-		sh->setUniform("u_shadow_bias", bias);
+		sh->setUniform(U_SHADOW_VIEWPROJ, shadow_proj);
+		sh->setUniform(U_SHADOW_BIAS, bias);
+
+		//with cascades every one has its own viewprojection
+		int used_cascades = light_type == DIRECTIONAL && num_cascades > 1 ? num_cascades : 0;
+		sh->setUniform(U_SHADOW_CASCADES, used_cascades);
+		if (used_cascades)
+		{
+			Matrix44 viewprojs[max_cascades];
+			for (int i = 0; i < used_cascades; ++i)
+				viewprojs[i] = cascades[i].viewprojection_matrix;
+			sh->setMatrix44Array(U_SHADOW_CASCADE_VIEWPROJS, viewprojs, used_cascades);
+		}
 	}
 
 	if (linearize) {
 		Vector3 l_color = Vector3(pow(color.x, hdr_gamma), pow(color.y, hdr_gamma), pow(color.z, hdr_gamma));
-		sh->setVector3("u_light_color", l_color);
-	}else{ sh->setVector3("u_light_color", color); }
+		sh->setUniform(U_LIGHT_COLOR, l_color);
+	}else{ sh->setUniform(U_LIGHT_COLOR, color); }
 
 	float cos_angle = cos(cone_angle * PI / 180);
-	sh->setUniform("u_light_cutoff", cos_angle);
-	sh->setUniform("u_light_exp", spot_exp);
-
-	sh->setVector3("u_light_vector", model.frontVector());
-	sh->setUniform("u_shadows", cast_shadows);
-	sh->setVector3("u_light_position", model.getTranslation());
-	sh->setUniform("u_light_maxdist", max_distance);
-	sh->setUniform("u_light_type", (int)light_type);
-	sh->setUniform("u_light_intensity", intensity);
+	sh->setUniform(U_LIGHT_CUTOFF, cos_angle);
+	sh->setUniform(U_LIGHT_EXP, spot_exp);
+
+	sh->setUniform(U_LIGHT_VECTOR, model.frontVector());
+	sh->setUniform(U_SHADOWS, cast_shadows);
+	sh->setUniform(U_LIGHT_POSITION, model.getTranslation());
+	sh->setUniform(U_LIGHT_MAXDIST, max_distance);
+	sh->setUniform(U_LIGHT_TYPE, (int)light_type);
+	sh->setUniform(U_LIGHT_INTENSITY, intensity);
 }
 
 GTR::ReflectionProbeEntity::ReflectionProbeEntity()
 {
 	entity_type = REFLECTION_PROBE;
+	baked = false;
 
 	cubemap = new Texture();
 	cubemap->createCubemap(
@@ -3,6 +3,7 @@
 
 #include "framework.h"
 #include <string>
+#include <atomic>
 #include "fbo.h"
 #include "camera.h"
 #include "sphericalharmonics.h"
@@ -33,6 +34,9 @@ namespace GTR {
 		NO_LIGHT
 	};
 
+	//must match u_shadow_cascade_viewprojs in the shader atlas
+	const int max_cascades = 4;
+
 	class Scene;
 	class Prefab;
 
@@ -40,13 +44,15 @@ namespace GTR {
 	class BaseEntity
 	{
 	public:
+		static std::atomic<int> s_EntityID;
+		int m_Id; //unique, a new entity can get the address of a deleted one
 		Scene* scene;
 		std::string name;
 		eEntityType entity_type;
 		Matrix44 model;
 		bool visible;
 
-		BaseEntity() { entity_type = NONE; visible = true; }
+		BaseEntity() { m_Id = s_EntityID++; entity_type = NONE; visible = true; }
 		virtual ~BaseEntity() {}
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {}
@@ -85,6 +91,7 @@ namespace GTR {
 		Matrix44 inv_model;
 		Vector3 dim; //number of points in each axis of the grid
 		int probe_scale;
+		bool baked; //the probes have their SH, computed or read from the bake file
 		
 
 		IrradianceGrid();
@@ -98,6 +105,7 @@ namespace GTR {
 	{
 	public:
 		Texture* cubemap;
+		bool baked; //the cubemap has been rendered or read from the bake file
 
 		ReflectionProbeEntity();
 		virtual void renderInMenu();
@@ -122,6 +130,14 @@ namespace GTR {
 		Camera* camera;
 		FBO* shadow_fbo;
 
+		//cascaded shadowmaps of directional lights, every cascade is a quarter of shadow_fbo
+		int num_cascades; //1 to use a single shadowmap
+		float cascade_lambda; //split scheme, 0 is uniform and 1 logarithmic
+		float cascade_distance; //how far from the camera the cascades reach, 0 to use area_size
+		Camera cascades[max_cascades];
+		Matrix44 cascades_model; //the model of the light when the cascades were rendered
+		int cascades_frame; //the further cascades are not rendered every frame
+
 		LightEntity();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
@@ -154,12 +170,19 @@ namespace GTR {
 
 		std::string filename;
 		std::vector<BaseEntity*> entities;
+		uint64 bake_key; //of the JSON and the files of its prefabs, the bake file is only valid for the same ones
 
 		void clear();
 		void addEntity(BaseEntity* entity);
 
 		bool load(const char* filename);
 		BaseEntity* createEntity(std::string type);
+		uint64 computeBakeKey(const std::string& content);
+
+		//the baked irradiance grid and reflection probes are stored next to the scene file,
+		//only after an explicit bake: the cubemaps are read back here and written in a worker
+		bool saveBake();
+		bool loadBake();
 	};
 
 };
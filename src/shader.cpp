@@ -8,9 +8,34 @@
 #include <locale>
 
 #include "texture.h"
+#include "glstate.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+//same order as eUniformBlock
+const char* Shader::s_block_names[UB_NUM_BLOCKS] = { "CameraBlock", "LightBlock" };
+
+//same order as eAttribute
+const char* Shader::s_attribute_names[A_NUM_ATTRIBUTES] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights", "u_model" };
+
+//same order as eUniform
+const char* Shader::s_uniform_names[U_NUM_UNIFORMS] = {
+	"u_model", "u_viewprojection", "u_viewmatrix", "u_camera_position",
+	"u_gamma", "u_inverse_viewprojection", "u_iRes", "u_color",
+	"u_emissive", "u_ambient_light", "u_metallic", "u_roughness",
+	"u_alpha_cutoff", "u_deferred", "u_back", "u_texture",
+	"u_texture_em", "u_texture_metallic_roughness", "u_texture_normals", "u_environment_texture",
+	"u_reflections", "u_color_texture", "u_normal_texture", "u_extra_texture",
+	"u_depth_texture", "u_ao", "u_ao_texture", "u_irr",
+	"u_irr_texture", "u_invmodel_grid", "u_irr_dims", "u_trilinear",
+	"u_texture_probes", "u_light_eq", "u_light_type", "u_light_position",
+	"u_light_color", "u_light_vector", "u_light_maxdist",
+	"u_light_intensity", "u_light_cutoff", "u_light_exp",
+	"u_pcf", "u_shadows", "u_shadow_bias", "u_shadow_viewproj",
+	"u_texture_atlas", "shadowmap", "u_shadow_cascades", "u_shadow_cascade_viewprojs",
+	"u_clustered", "u_cluster_grid", "u_cluster_items", "u_cluster_dims",
+	"u_cluster_zparams",
+};
 
 
 //typedef unsigned int GLhandle;
@@ -33,6 +58,7 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 	REGISTER_GLEXT( void, glGetInfoLog, GLhandle obj, GLsizei maxLength, GLsizei *length, GLchar *infoLog )
 	REGISTER_GLEXT( GLint, glGetUniformLocation, GLhandle programObj, const GLchar *name)
 	REGISTER_GLEXT( GLint, glGetAttribLocation, GLhandle programObj, const GLchar *name)
+	REGISTER_GLEXT( void, glBindAttribLocation, GLhandle programObj, GLuint index, const GLchar *name)
 	REGISTER_GLEXT( void, glUniform1i, GLint location, GLint v0 )
 	REGISTER_GLEXT( void, glUniform2i, GLint location, GLint v0, GLint v1 )
 	REGISTER_GLEXT( void, glUniform3i, GLint location, GLint v0, GLint v1, GLint v2 )
@@ -64,6 +90,11 @@ Shader::Shader()
 	vs = fs = 0;
 	compiled = false;
 	from_atlas = false;
+	last_pass = -1;
+	for (int i = 0; i < U_NUM_UNIFORMS; ++i)
+		uniform_locations[i] = -1;
+	for (int i = 0; i < UB_NUM_BLOCKS; ++i)
+		has_block[i] = false;
 }
 
 Shader::~Shader()
@@ -318,6 +349,10 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	//fixed locations, names not used by the program are ignored
+	for (int i = 0; i < A_NUM_ATTRIBUTES; ++i)
+		glBindAttribLocation(program, i, s_attribute_names[i]);
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -337,6 +372,7 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	validate();
 #endif
 
+	resolveUniforms();
 	compiled = true;
 
 	return true;
@@ -433,6 +469,10 @@ void Shader::release()
 	}
 
 	locations.clear();
+	for (int i = 0; i < U_NUM_UNIFORMS; ++i)
+		uniform_locations[i] = -1;
+	for (int i = 0; i < UB_NUM_BLOCKS; ++i)
+		has_block[i] = false;
 
 	compiled = false;
 }
@@ -440,6 +480,7 @@ void Shader::release()
 
 void Shader::enable()
 {
+	GLState::programChanged(current != this);
 	if (current == this)
 		return;
 
@@ -564,10 +605,8 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	GLState::bindTexture(slot, tex);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
@@ -741,6 +780,115 @@ void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+void Shader::resolveUniforms()
+{
+	for (int i = 0; i < U_NUM_UNIFORMS; ++i)
+		uniform_locations[i] = glGetUniformLocation(program, s_uniform_names[i]);
+
+	//blocks always use the same binding point, so the buffers only have to be bound once
+	for (int i = 0; i < UB_NUM_BLOCKS; ++i)
+	{
+		GLuint index = glGetUniformBlockIndex(program, s_block_names[i]);
+		has_block[i] = index != GL_INVALID_INDEX;
+		if (has_block[i])
+			glUniformBlockBinding(program, index, i);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(eUniform u, bool input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform1i(loc, input);
+}
+
+void Shader::setUniform(eUniform u, int input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform1i(loc, input);
+}
+
+void Shader::setUniform(eUniform u, float input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform1f(loc, input);
+}
+
+void Shader::setUniform(eUniform u, const Vector2& input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform2f(loc, input.x, input.y);
+}
+
+void Shader::setUniform(eUniform u, const Vector3& input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform3f(loc, input.x, input.y, input.z);
+}
+
+void Shader::setUniform(eUniform u, const Vector4& input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform4f(loc, input.x, input.y, input.z, input.w);
+}
+
+void Shader::setUniform(eUniform u, const Matrix44& input)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniformMatrix4fv(loc, 1, GL_FALSE, input.m);
+}
+
+void Shader::setUniform(eUniform u, Texture* texture, int slot)
+{
+	assert(current == this);
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	GLState::bindTexture(slot, texture);
+	glUniform1i(loc, slot);
+}
+
+void Shader::setUniform1Array(eUniform u, const float* input, const int count)
+{
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform1fv(loc, count, input);
+}
+
+void Shader::setUniform1Array(eUniform u, const int* input, const int count)
+{
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform1iv(loc, count, input);
+}
+
+void Shader::setUniform3Array(eUniform u, const float* input, const int count)
+{
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniform3fv(loc, count, input);
+}
+
+void Shader::setMatrix44Array(eUniform u, Matrix44* m_array, int num)
+{
+	GLint loc = uniform_locations[u];
+	CHECK_SHADER_VAR(loc, s_uniform_names[u]);
+	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
@@ -763,6 +911,7 @@ void Shader::init()
 		IMPORT_GLEXT( glGetInfoLog );
 		IMPORT_GLEXT( glGetUniformLocation );
 		IMPORT_GLEXT( glGetAttribLocation );
+		IMPORT_GLEXT( glBindAttribLocation );
 		IMPORT_GLEXT( glUniform1i );
 		IMPORT_GLEXT( glUniform2i );
 		IMPORT_GLEXT( glUniform3i );
@@ -20,6 +20,42 @@
 
 class Texture;
 
+//uniforms set by the hot paths of the renderer, their locations are resolved once after linking
+//so they can be set by handle instead of by name (see Shader::setUniform(eUniform, ...))
+enum eUniform {
+	U_MODEL, U_VIEWPROJECTION, U_VIEWMATRIX, U_CAMERA_POSITION,
+	U_GAMMA, U_INVERSE_VIEWPROJECTION, U_IRES, U_COLOR,
+	U_EMISSIVE, U_AMBIENT_LIGHT, U_METALLIC, U_ROUGHNESS,
+	U_ALPHA_CUTOFF, U_DEFERRED, U_BACK, U_TEXTURE,
+	U_TEXTURE_EM, U_TEXTURE_METALLIC_ROUGHNESS, U_TEXTURE_NORMALS, U_ENVIRONMENT_TEXTURE,
+	U_REFLECTIONS, U_COLOR_TEXTURE, U_NORMAL_TEXTURE, U_EXTRA_TEXTURE,
+	U_DEPTH_TEXTURE, U_AO, U_AO_TEXTURE, U_IRR,
+	U_IRR_TEXTURE, U_INVMODEL_GRID, U_IRR_DIMS, U_TRILINEAR,
+	U_TEXTURE_PROBES, U_LIGHT_EQ, U_LIGHT_TYPE, U_LIGHT_POSITION,
+	U_LIGHT_COLOR, U_LIGHT_VECTOR, U_LIGHT_MAXDIST,
+	U_LIGHT_INTENSITY, U_LIGHT_CUTOFF, U_LIGHT_EXP,
+	U_PCF, U_SHADOWS, U_SHADOW_BIAS, U_SHADOW_VIEWPROJ,
+	U_TEXTURE_ATLAS, U_SHADOWMAP, U_SHADOW_CASCADES, U_SHADOW_CASCADE_VIEWPROJS,
+	U_CLUSTERED, U_CLUSTER_GRID, U_CLUSTER_ITEMS, U_CLUSTER_DIMS,
+	U_CLUSTER_ZPARAMS,
+	U_NUM_UNIFORMS
+};
+
+//vertex attributes, their locations are bound before linking so they are the same in every program
+//and a mesh can keep its attribute setup in a VAO whatever the shader (see Mesh::render)
+enum eAttribute {
+	A_VERTEX, A_NORMAL, A_COORD, A_COORD1,
+	A_COLOR, A_BONES, A_WEIGHTS,
+	A_INSTANCE_MODEL, //mat4, it takes this location and the next three
+	A_NUM_ATTRIBUTES
+};
+
+//std140 uniform blocks shared by all the programs that declare them, the value is the binding point
+enum eUniformBlock {
+	UB_CAMERA, UB_LIGHTS,
+	UB_NUM_BLOCKS
+};
+
 class Shader
 {
 	int last_slot;
@@ -64,6 +100,22 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//upload by handle, the location was resolved when linking so there is no lookup
+	void setUniform(eUniform u, bool input);
+	void setUniform(eUniform u, int input);
+	void setUniform(eUniform u, float input);
+	void setUniform(eUniform u, const Vector2& input);
+	void setUniform(eUniform u, const Vector3& input);
+	void setUniform(eUniform u, const Vector4& input);
+	void setUniform(eUniform u, const Matrix44& input);
+	void setUniform(eUniform u, Texture* texture, int slot);
+	void setUniform1Array(eUniform u, const float* input, const int count);
+	void setUniform1Array(eUniform u, const int* input, const int count);
+	void setUniform3Array(eUniform u, const float* input, const int count);
+	void setMatrix44Array(eUniform u, Matrix44* m_array, int num);
+	bool IsUniform(eUniform u) { return uniform_locations[u] != -1; }
+	bool hasBlock(eUniformBlock b) { return has_block[b]; }
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -105,6 +157,7 @@ public:
 	std::string getInfoLog() const;
 	bool hasInfoLog() const;
 	bool compiled;
+	int last_pass; //last GLState pass in which the per pass uniforms were uploaded
 
 	void setMacros(const char * macros);
 
@@ -133,6 +186,7 @@ protected:
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
+	void resolveUniforms();
 
 	bool validate();
 
@@ -141,6 +195,12 @@ protected:
 	GLuint program;
 	std::string log;
 
+	GLint uniform_locations[U_NUM_UNIFORMS]; //-1 if the program doesn't use it
+	static const char* s_uniform_names[U_NUM_UNIFORMS];
+	static const char* s_attribute_names[A_NUM_ATTRIBUTES];
+	bool has_block[UB_NUM_BLOCKS];
+	static const char* s_block_names[UB_NUM_BLOCKS];
+
 //this is a hack to speed up shader usage (save info locally)
 private: 
 
@@ -1,5 +1,19 @@
 #include "sphericalharmonics.h"
 
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #include <xmmintrin.h>
+    #define SH_USE_SSE
+#endif
+
+//smaller faces are projected in the calling thread
+const int sh_parallel_size = 64;
+
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
     {{0, 0, -1} ,{0, -1, 0},{1, 0, 0} },  // posx
@@ -13,8 +27,15 @@ Vector3 cubemapFaceNormals[6][3] = {
 };
 
 const int sh_length = 9;
-std::vector< std::vector<Vector3> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+
+//basis of every texel of the six faces times its solid angle and the normalization, it only depends on the resolution
+struct sSHTable {
+    int size;
+    float scale; //normalization of the solid angles
+    std::vector<float> weights; //sh_length per texel, face after face
+};
+static std::shared_ptr<const sSHTable> sh_table;
+static std::mutex sh_table_mutex;
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,51 +61,177 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
+static std::shared_ptr<const sSHTable> getSHTable(int size)
+{
+    std::lock_guard<std::mutex> lock(sh_table_mutex);
+    if (sh_table && sh_table->size == size)
+        return sh_table;
+
+    sSHTable* table = new sSHTable();
+    table->size = size;
+    table->weights.resize(6 * size * size * sh_length);
+
+    //the solid angle is the same for every face
+    std::vector<float> solid_angles(size * size);
+    double weightAccum = 0; //in float it drifts on big faces
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            solid_angles[y * size + x] = texelSolidAngle(x, y, size, size);
+            weightAccum += solid_angles[y * size + x] * 3.0f * 6;
+        }
+    float scale = 4 * PI / weightAccum;
+    table->scale = scale;
+
+    float* w = &table->weights[0];
+    for (int index = 0; index < 6; ++index)
+        for (int v = 0; v < size; v++)
+            for (int u = 0; u < size; u++)
+            {
+                float fU = (2.0 * u / (size - 1.0)) - 1.0;
+                float fV = (2.0 * v / (size - 1.0)) - 1.0;
+                Vector3 texelVect = normalize(cubemapFaceNormals[index][0] * fU + cubemapFaceNormals[index][1] * fV + cubemapFaceNormals[index][2]);
+                float dx = texelVect[0];
+                float dy = texelVect[1];
+                float dz = texelVect[2];
+
+                // forsyths weights
+                float weight = solid_angles[v * size + u] * scale;
+                float weight1 = weight * 4 / 17;
+                float weight2 = weight * 8 / 17;
+                float weight3 = weight * 15 / 17;
+                float weight4 = weight * 5 / 68;
+                float weight5 = weight * 15 / 68;
+
+                w[0] = weight1;
+                w[1] = weight2 * dy;
+                w[2] = weight2 * dz;
+                w[3] = weight2 * dx;
+                w[4] = weight3 * dx * dy;
+                w[5] = weight3 * dy * dz;
+                w[6] = weight4 * (3.0f * dz * dz - 1.0f);
+                w[7] = weight3 * dx * dz;
+                w[8] = weight5 * (dx * dx - dy * dy);
+                w += sh_length;
+            }
+
+    sh_table.reset(table);
+    return sh_table;
+}
+
+//accumulates the texels of one face, the RGB of every texel goes in one SSE register
+//every row is added to a double sum, summing a whole big face in float loses about 1e-5
+static void projectFace(const FloatImage& face, bool degamma, const float* weights, float* result)
+{
+    int width = face.width;
+    int num_texels = face.width * face.height;
+    int channels = face.num_channels;
+    const float* pixels = face.data;
+    double sum[sh_length * 3];
+    memset(sum, 0, sizeof(sum));
+
+#ifdef SH_USE_SSE
+    __m128 acc[sh_length];
+    for (int row = 0; row < num_texels; row += width)
+    {
+        for (int k = 0; k < sh_length; ++k)
+            acc[k] = _mm_setzero_ps();
+        for (int i = row; i < row + width; ++i, pixels += channels, weights += sh_length)
+        {
+            __m128 value;
+            if (degamma)
+                value = _mm_setr_ps(pow(pixels[0], 2.2), pow(pixels[1], 2.2), pow(pixels[2], 2.2), 0.0f);
+            else if (channels == 4 || i + 1 < num_texels)
+                value = _mm_loadu_ps(pixels); //the 4th lane is not used, with 3 channels it is the next texel
+            else
+                value = _mm_setr_ps(pixels[0], pixels[1], pixels[2], 0.0f);
+            for (int k = 0; k < sh_length; ++k)
+                acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(value, _mm_set1_ps(weights[k])));
+        }
+        for (int k = 0; k < sh_length; ++k)
+        {
+            float lanes[4];
+            _mm_storeu_ps(lanes, acc[k]);
+            sum[k * 3] += lanes[0];
+            sum[k * 3 + 1] += lanes[1];
+            sum[k * 3 + 2] += lanes[2];
+        }
+    }
+#else
+    float acc[sh_length * 3];
+    for (int row = 0; row < num_texels; row += width)
+    {
+        memset(acc, 0, sizeof(acc));
+        for (int i = row; i < row + width; ++i, pixels += channels, weights += sh_length)
+        {
+            float value[3] = { pixels[0], pixels[1], pixels[2] };
+            if (degamma)
+                for (int j = 0; j < 3; ++j)
+                    value[j] = pow(value[j], 2.2);
+            for (int k = 0; k < sh_length; ++k)
+                for (int j = 0; j < 3; ++j)
+                    acc[k * 3 + j] += value[j] * weights[k];
+        }
+        for (int j = 0; j < sh_length * 3; ++j)
+            sum[j] += acc[j];
+    }
+#endif
+    for (int j = 0; j < sh_length * 3; ++j)
+        result[j] = (float)sum[j];
+}
+
+float getSHSolidAngleScale(int size) {
+    return getSHTable(size)->scale;
+}
+
 // give me a cubemap, its size and number of channels
 // and i'll give you spherical harmonics
-SphericalHarmonics computeSH(FloatImage images[], bool degamma) {
+SphericalHarmonics computeSH(FloatImage images[], bool degamma, bool parallel) {
     assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
     int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
+    std::shared_ptr<const sSHTable> table = getSHTable(size);
+    int face_weights = size * size * sh_length;
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
+    //faces in parallel when they are big enough to pay for the threads, the sum is always done in the same order
+    float partial[6][sh_length * 3];
+    if (parallel && size >= sh_parallel_size)
     {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
+        std::thread threads[6];
         for (int index = 0; index < 6; ++index)
-        {
-            std::vector<Vector3> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
-                {
-                    float fU = (2.0 * u / (size - 1.0)) - 1.0;
-                    float fV = (2.0 * v / (size - 1.0)) - 1.0;
-
-                    Vector3 vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3 vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3 vecZ = cubemapFaceNormals[index][2];
-
-                    Vector3 res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
-                }
-            }
-            cubeMapVecs.push_back(faceVecs);
-        }
+            threads[index] = std::thread(projectFace, std::cref(images[index]), degamma, &table->weights[index * face_weights], partial[index]);
+        for (int index = 0; index < 6; ++index)
+            threads[index].join();
     }
+    else
+        for (int index = 0; index < 6; ++index)
+            projectFace(images[index], degamma, &table->weights[index * face_weights], partial[index]);
+
+    SphericalHarmonics sh;
+    for (int index = 0; index < 6; ++index)
+        for (int k = 0; k < sh_length; k++)
+            sh.coeffs[k] += Vector3(partial[index][k * 3], partial[index][k * 3 + 1], partial[index][k * 3 + 2]);
+    return sh;
+}
+
+// the scalar projection computeSH replaced, texel by texel, kept to check the fast one against it
+// the sums are done in double, in float they drift about 1e-4 on big faces
+SphericalHarmonics computeSHReference(FloatImage images[], bool degamma) {
+    assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+    int size = images[0].width;
+    double sh[sh_length][3];
+    memset(sh, 0, sizeof(sh));
 
     // generate spherical harmonics
-    float weightAccum = 0;
+    double weightAccum = 0;
 
     for (int index = 0; index < 6; ++index)
     {
         FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
         for (int y = 0; y < size; y++) {
             for (int x = 0; x < size; x++) {
-                Vector3 texelVect = cubeMapVecs[index][y * size + x];
+                float fU = (2.0 * x / (size - 1.0)) - 1.0;
+                float fV = (2.0 * y / (size - 1.0)) - 1.0;
+                Vector3 texelVect = normalize(cubemapFaceNormals[index][0] * fU + cubemapFaceNormals[index][1] * fV + cubemapFaceNormals[index][2]);
                 float weight = texelSolidAngle(x, y, size, size);
                 // forsyths weights
                 float weight1 = weight * 4 / 17;
@@ -98,20 +245,25 @@ SphericalHarmonics computeSH(FloatImage images[], bool degamma) {
                 float dz = texelVect[2];
 
                 Vector3 value = face.getPixel(x, y).xyz();
-                if (gammaCorrect)
+                if (degamma)
                     value = Vector3(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
 
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
+                float basis[sh_length] = {
+                    weight1,
+                    weight2 * dy,
+                    weight2 * dz,
+                    weight2 * dx,
 
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
+                    weight3 * dx * dy,
+                    weight3 * dy * dz,
+                    weight4 * (3.0f * dz * dz - 1.0f),
 
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
+                    weight3 * dx * dz,
+                    weight5 * (dx * dx - dy * dy)
+                };
+                for (int k = 0; k < sh_length; k++)
+                    for (int c = 0; c < 3; c++)
+                        sh[k][c] += (double)value[c] * basis[k];
 
                 weightAccum += weight * 3.0f;
             }
@@ -120,6 +272,6 @@ SphericalHarmonics computeSH(FloatImage images[], bool degamma) {
 
     SphericalHarmonics linear_sh;
     for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
+        linear_sh.coeffs[i] = Vector3(sh[i][0], sh[i][1], sh[i][2]) * (4 * PI / weightAccum);
     return linear_sh;
-}
\ No newline at end of file
+}
@@ -10,4 +10,11 @@ struct SphericalHarmonics {
 	Vector3 coeffs[9];
 };
 
-SphericalHarmonics computeSH(FloatImage images[], bool degamma = false);
\ No newline at end of file
+//parallel uses a thread per face on big cubemaps, pass false when already called from a worker
+SphericalHarmonics computeSH(FloatImage images[], bool degamma = false, bool parallel = true);
+
+//the scalar version, slow, only to check computeSH
+SphericalHarmonics computeSHReference(FloatImage images[], bool degamma = false);
+
+//4PI over the sum of the solid angles of the texels (times 3), for the projection done in the sh_rows shader
+float getSHSolidAngleScale(int size);
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "texture.h"
 #include "fbo.h"
 #include "utils.h"
+#include "glstate.h"
+#include "loader.h"
+#include "bcn.h"
 
 #include <iostream> //to output
 #include <cmath>
@@ -57,9 +60,13 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 
 
 std::map<std::string, Texture*> Texture::sTexturesLoaded;
+static LoadingSet loading_textures; //its mutex protects sTexturesLoaded, textures can be loaded from the Loader threads
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
+bool Texture::compress_textures = true;
+
+static GLuint upload_pbo = 0; //pixel buffer used to upload the images
 
 Texture::Texture()
 {
@@ -67,6 +74,7 @@ Texture::Texture()
 	height = 0;
 	depth = 0;
 	texture_id = 0;
+	upload_pending = false;
 	mipmaps = false;
 	format = 0;
 	type = 0;
@@ -76,12 +84,14 @@ Texture::Texture()
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	texture_id = 0;
+	upload_pending = false;
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
 
 Texture::Texture(Image* img)
 {
 	texture_id = 0;
+	upload_pending = false;
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
 
@@ -93,18 +103,23 @@ Texture::~Texture()
 void Texture::clear()
 {
 	glBindTexture(this->texture_type, 0);
+	GLState::forgetActiveTexture();
 
 	//external textures are handled by an outside system (like Android OS)
 	if (texture_type != GL_TEXTURE_EXTERNAL_OES)
+	{
+		GLState::forgetTexture(texture_id);
 		glDeleteTextures(1, &texture_id);
+	}
 
 	stdlog("Destroy texture: " + filename);
 	texture_id = 0;
 
 	if (filename.size())
 	{
+		std::lock_guard<std::mutex> lock(loading_textures.mutex);
 		auto it = sTexturesLoaded.find(filename);
-		if (it != sTexturesLoaded.end())
+		if (it != sTexturesLoaded.end() && it->second == this)
 			sTexturesLoaded.erase(it);
 	}
 }
@@ -203,36 +218,55 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::forgetActiveTexture();
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
 Texture* Texture::Find(const char* filename)
 {
 	assert(filename);
+	std::lock_guard<std::mutex> lock(loading_textures.mutex);
 	auto it = sTexturesLoaded.find(filename);
 	if (it != sTexturesLoaded.end())
 		return it->second;
 	return NULL;
 }
 
-Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
+void Texture::setName(const char* name)
 {
-	//load it
-	Texture* texture = Find(filename);
-	if (texture)
-		return texture;
+	filename = name;
+	std::lock_guard<std::mutex> lock(loading_textures.mutex);
+	sTexturesLoaded[filename] = this;
+}
 
-	texture = new Texture();
-	if (!texture->load(filename, mipmaps, wrap))
+Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap, bool normal_map)
+{
+	//if another thread is loading it, wait for it instead of loading it twice
+	{
+		std::unique_lock<std::mutex> lock(loading_textures.mutex);
+		do
+		{
+			auto it = sTexturesLoaded.find(filename);
+			if (it != sTexturesLoaded.end())
+				return it->second;
+		} while (!loading_textures.claim(lock, filename));
+	}
+
+	//load it
+	Texture* texture = new Texture();
+	if (!texture->load(filename, mipmaps, wrap, GL_UNSIGNED_BYTE, normal_map))
 	{
 		delete texture;
-		return NULL;
+		texture = NULL;
 	}
 
+	loading_textures.release(filename);
 	return texture;
 }
 
-bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
+static const char* block_format_names[] = { "BC1", "BC3", "BC4", "BC5" };
+
+bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type, bool normal_map)
 {
 	std::string str = filename;
 	std::string ext = str.substr(str.size() - 4, 4);
@@ -241,6 +275,27 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 
 	std::cout << " + Texture loading: " << filename << " ... ";
 
+	//compressed textures are cooked once to a .ctex next to the original, and used while it doesn't change
+	bool compress = compress_textures && mipmaps && type == GL_UNSIGNED_BYTE;
+	std::string cooked_filename = str + ".ctex";
+	uint64 source_time = 0, source_size = 0;
+	if (compress && !getFileInfo(filename, source_time, source_size))
+		compress = false; //without the size and time of the source the .ctex could never be checked, it is loaded uncompressed
+	if (compress)
+	{
+		CompressedImage* cooked = new CompressedImage();
+		if (cooked->load(cooked_filename.c_str(), source_time, source_size, normal_map))
+		{
+			std::cout << "[OK COOKED] Size: " << cooked->width << "x" << cooked->height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+			streamFromCompressed(cooked, wrap);
+			this->filename = filename;
+			setName(filename);
+			this->image.clear();
+			return true;
+		}
+		delete cooked;
+	}
+
 	image = new Image();
 	bool found = false;
 
@@ -253,20 +308,33 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 	else
 	{
 		std::cout << "[ERROR]: unsupported format" << std::endl;
+		delete image;
 		return false; //unsupported file type
 	}
 
 	if (!found) //file not found
 	{
 		std::cout << " [ERROR]: Texture not found " << std::endl;
+		delete image;
 		return false;
 	}
 
-	loadFromImage(image, mipmaps, wrap, type);
+	if (compress)
+	{
+		CompressedImage* cooked = new CompressedImage();
+		cooked->compress(image, chooseBlockFormat(image, normal_map));
+		cooked->save(cooked_filename.c_str(), source_time, source_size, normal_map);
+		std::cout << "[OK] Size: " << image->width << "x" << image->height << " " << block_format_names[cooked->format] << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		delete image;
+		streamFromCompressed(cooked, wrap);
+	}
+	else
+	{
+		std::cout << "[OK] Size: " << image->width << "x" << image->height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		streamFromImage(image, mipmaps, wrap, type);
+	}
 	this->filename = filename;
 	setName(filename);
-
-	std::cout << "[OK] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	this->image.clear();
 	return true;
 }
@@ -278,11 +346,25 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	if (type == GL_FLOAT)
 		internal_format = (image->num_channels == 3 ? GL_RGB32F : GL_RGBA32F);
 
-	//upload to VRAM
-	// We have to synchronously upload for now because Image class is not ref-counted
-	create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+	//upload to VRAM, the storage is created empty and the pixels go through a pixel buffer,
+	//so the driver can copy them to the texture without stalling
+	unsigned int format = image->num_channels == 3 ? GL_RGB : GL_RGBA;
+	create(image->width, image->height, format, type, mipmaps, NULL, internal_format);
+
+	int bytes = image->width * image->height * image->num_channels * (type == GL_FLOAT ? 4 : 1);
+	if (!upload_pbo)
+		glGenBuffers(1, &upload_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, image->data, GL_STREAM_DRAW); //orphans the previous upload
+	glBindTexture(this->texture_type, texture_id);
+	glTexSubImage2D(this->texture_type, 0, 0, 0, image->width, image->height, format, type, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (this->mipmaps)
+		generateMipmaps();
+	upload_pending = false;
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::forgetActiveTexture();
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -290,6 +372,70 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	//if (mipmaps)
 	//	generateMipmaps();
 	glBindTexture(GL_TEXTURE_2D, 0);
+	GLState::forgetActiveTexture();
+}
+
+void Texture::streamFromImage(Image* image, bool mipmaps, bool wrap, unsigned int type)
+{
+	//until the main thread uploads it, it is drawn with a placeholder
+	upload_pending = true;
+	width = (float)image->width;
+	height = (float)image->height;
+	int bytes = image->width * image->height * image->num_channels * (type == GL_FLOAT ? 4 : 1);
+	Loader::stream(bytes, [this, image, mipmaps, wrap, type]() {
+		loadFromImage(image, mipmaps, wrap, type);
+		delete image;
+	});
+}
+
+void Texture::loadFromCompressed(CompressedImage* image, bool wrap)
+{
+	assert(image->num_levels && image->data.size());
+
+	this->width = (float)image->width;
+	this->height = (float)image->height;
+	this->depth = 0;
+	this->format = GL_RGBA;
+	this->type = GL_UNSIGNED_BYTE;
+	this->internal_format = blockGLFormat(image->format);
+	this->mipmaps = image->num_levels > 1;
+
+	if (this->texture_id != 0)
+		clear();
+	this->texture_type = GL_TEXTURE_2D;
+	glGenTextures(1, &texture_id);
+
+	//the blocks can't be generated by GL, so every level is uploaded, all of them in one pixel buffer
+	if (!upload_pbo)
+		glGenBuffers(1, &upload_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, image->data.size(), &image->data[0], GL_STREAM_DRAW);
+	glBindTexture(this->texture_type, texture_id);
+	GLState::forgetActiveTexture();
+	for (int i = 0; i < image->num_levels; ++i)
+		glCompressedTexImage2D(this->texture_type, i, internal_format, image->levelWidth(i), image->levelHeight(i), 0,
+			image->levelBytes(i), (void*)(intptr_t)image->levelOffset(i));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, image->num_levels - 1);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(this->texture_type, 0);
+	upload_pending = false;
+	assert(checkGLErrors() && "Error uploading compressed texture");
+}
+
+void Texture::streamFromCompressed(CompressedImage* image, bool wrap)
+{
+	upload_pending = true;
+	width = (float)image->width;
+	height = (float)image->height;
+	Loader::stream((int)image->data.size(), [this, image, wrap]() {
+		loadFromCompressed(image, wrap);
+		delete image;
+	});
 }
 
 void Texture::upload(Image* img)
@@ -311,6 +457,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, Uint8
 	assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::forgetActiveTexture();
 
 	if (internal_format == 0)
 	{
@@ -332,6 +479,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, Uint8
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
 	glBindTexture(this->texture_type, 0);
+	GLState::forgetActiveTexture();
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
@@ -360,6 +508,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint
 	//assert(glGetError() == GL_NO_ERROR);
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::forgetActiveTexture();
 
 	int w = ((int)this->width) >> level;
 	int h = ((int)this->height) >> level;
@@ -400,6 +549,7 @@ void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint
 	}
 
 	glBindTexture(this->texture_type, 0);
+	GLState::forgetActiveTexture();
 	assert(glGetError() == GL_NO_ERROR && "Error creating texture");
 }
 
@@ -460,6 +610,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 	if (texture_id == 0)
 		glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+	GLState::forgetActiveTexture();
 	glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -483,12 +634,14 @@ void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
 	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	GLState::forgetActiveTexture();
 }
 
 void Texture::unbind()
 {
 	//glDisable(this->texture_type); //disable the textures 
 	glBindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
+	GLState::forgetActiveTexture();
 }
 
 void Texture::UnbindAll()
@@ -499,6 +652,7 @@ void Texture::UnbindAll()
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 	glBindTexture(GL_TEXTURE_3D, 0);
+	GLState::forgetActiveTexture();
 }
 
 void Texture::generateMipmaps()
@@ -508,6 +662,7 @@ void Texture::generateMipmaps()
 		return;
 
 	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	GLState::forgetActiveTexture();
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter); //set the mag filter
 	if (this->texture_type == GL_TEXTURE_CUBE_MAP)
 	{
@@ -517,6 +672,7 @@ void Texture::generateMipmaps()
 	glGenerateMipmapEXT(this->texture_type);
 #else
 	glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+	GLState::forgetActiveTexture();
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 	glGenerateMipmap(this->texture_type);
 #endif
@@ -532,8 +688,8 @@ void Texture::toViewport(Shader* shader)
 	if (shader->getUniformLocation("u_texture") != -1)
 		shader->setUniform("u_texture", this, 0);
 	assert(glGetError() == GL_NO_ERROR);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_CULL_FACE, false);
 	quad->render(GL_TRIANGLES);
 	assert(glGetError() == GL_NO_ERROR);
 	shader->disable();
@@ -583,8 +739,8 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 	{
 		if (format == GL_DEPTH_COMPONENT) //to clone depth buffer
 		{
-			glEnable(GL_DEPTH_TEST); //we need to use the depth buffer
-			glDepthFunc(GL_ALWAYS); //but ignore the test, every fragment should update the depth
+			GLState::setCapability(GL_DEPTH_TEST, true); //we need to use the depth buffer
+			GLState::depthFunc(GL_ALWAYS); //but ignore the test, every fragment should update the depth
 			glColorMask(false, false, false, false); //block drawing to colors
 			if (!shader)
 				shader = Shader::getDefaultShader("screen_depth");
@@ -595,28 +751,28 @@ void Texture::copyTo(Texture* destination, Shader* shader)
 		shader->enable();
 		shader->setUniform("u_texture", this, 0);
 		shader->setUniform("u_color", Vector4(1, 1, 1, 1));
-		glDisable(GL_CULL_FACE);
+		GLState::setCapability(GL_CULL_FACE, false);
 		quad->render(GL_TRIANGLES);
 		glColorMask(true, true, true, true);
-		glDisable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+		GLState::setCapability(GL_DEPTH_TEST, false);
+		GLState::depthFunc(GL_LESS);
 		return;
 	}
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_BLEND, false);
 	FBO* fbo = getGlobalFBO(destination);
 	fbo->bind();
 	if (!shader && format == GL_DEPTH_COMPONENT)
 	{
 		shader = Shader::getDefaultShader("screen_depth");
-		glDepthFunc(GL_ALWAYS);
-		glEnable(GL_DEPTH_TEST);
+		GLState::depthFunc(GL_ALWAYS);
+		GLState::setCapability(GL_DEPTH_TEST, true);
 	}
 	toViewport(shader);
 	fbo->unbind();
-	glDisable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::depthFunc(GL_LESS);
 }
 
 void Image::fromScreen(int width, int height)
@@ -647,6 +803,7 @@ void Image::fromTexture(Texture* texture)
 		height = texture->height;
 		data = new uint8[width * height * 4];
 	}
+	num_channels = 4;
 
 	texture->bind();
 	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
@@ -13,6 +13,7 @@
 class Shader;
 class FBO;
 class Texture;
+class CompressedImage;
 
 #ifndef OPENGL_ES3
 #define GL_RGBA32F 0x8814
@@ -103,6 +104,7 @@ public:
 	static int default_mag_filter;
 	static int default_min_filter;
 	static FBO* global_fbo;
+	static bool compress_textures; //the textures loaded with mipmaps are block compressed and cooked to disk (see bcn.h)
 
 	//a general struct to store all the information about a TGA file
 	bool filtered;
@@ -111,6 +113,7 @@ public:
 	static std::map<std::string, Texture*> sTexturesLoaded;
 
 	GLuint texture_id; // GL id to identify the texture in opengl, every texture must have its own id
+	bool upload_pending; //its pixels are queued in the Loader, GLState binds a placeholder meanwhile
 	float width;
 	float height;
 	float depth;	//Optional for 3dTexture or 2dTexture array
@@ -158,17 +161,17 @@ public:
 
 	void operator = (const Texture& tex) { assert("textures cannot be cloned like this!");  }
 
-	//load without using the manager
-	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	//load without using the manager, normal maps are compressed as BC5 (only X and Y)
+	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE, bool normal_map = false);
 	void loadFromImage(Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	void streamFromImage(Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE); //takes the image and deletes it once uploaded
+	void loadFromCompressed(CompressedImage* image, bool wrap = true); //with all the levels it has
+	void streamFromCompressed(CompressedImage* image, bool wrap = true); //takes the image and deletes it once uploaded
 
-	//load using the manager (caching loaded ones to avoid reloading them)
-	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
+	//load using the manager (caching loaded ones to avoid reloading them), it can be called from the Loader threads
+	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true, bool normal_map = false);
 	static Texture* Find(const char* filename);
-	void setName(const char* name) {
-		filename = name;
-		sTexturesLoaded[filename] = this;
-	}
+	void setName(const char* name); //registers it with that name
 
 	void generateMipmaps();
 
@@ -4,6 +4,10 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
 #endif
 
 #include "includes.h"
@@ -12,6 +16,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "glstate.h"
 
 #include "extra/stb_easy_font.h"
 
@@ -137,6 +142,81 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+sMappedFile* mapFile(const char* filename)
+{
+	const char* data = NULL;
+	size_t size = 0;
+	void* handle = NULL;
+
+	#ifdef WIN32
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return NULL;
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size = (size_t)file_size.QuadPart;
+		handle = size ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		CloseHandle(file); //the mapping keeps the file open
+		if (!handle)
+			return NULL;
+		data = (const char*)MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+		{
+			CloseHandle(handle);
+			return NULL;
+		}
+	#else
+		int fd = open(filename, O_RDONLY);
+		if (fd == -1)
+			return NULL;
+		struct stat st;
+		if (fstat(fd, &st) == 0)
+			size = (size_t)st.st_size;
+		void* mapping = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd); //the mapping keeps the file open
+		if (mapping == MAP_FAILED)
+			return NULL;
+		data = (const char*)mapping;
+	#endif
+
+	sMappedFile* mapped = new sMappedFile();
+	mapped->data = data;
+	mapped->size = size;
+	mapped->handle = handle;
+	return mapped;
+}
+
+void unmapFile(sMappedFile* file)
+{
+	if (!file)
+		return;
+	#ifdef WIN32
+		UnmapViewOfFile(file->data);
+		CloseHandle((HANDLE)file->handle);
+	#else
+		munmap((void*)file->data, file->size);
+	#endif
+	delete file;
+}
+
+bool getFileInfo(const char* filename, uint64& modification_time, uint64& size)
+{
+	#ifdef WIN32
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+			return false;
+		modification_time = ((uint64)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+		size = ((uint64)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	#else
+		struct stat st;
+		if (stat(filename, &st) != 0)
+			return false;
+		modification_time = (uint64)st.st_mtime;
+		size = (uint64)st.st_size;
+	#endif
+	return true;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -214,8 +294,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	Matrix44 projection_matrix;
 	projection_matrix.ortho(0, Application::instance->window_width / scale, Application::instance->window_height / scale, 0, -1, 1);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::setCapability(GL_DEPTH_TEST, false);
+	GLState::setCapability(GL_CULL_FACE, false);
 
 	glMatrixMode(GL_MODELVIEW);
 	glPushMatrix();
@@ -234,8 +314,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::setCapability(GL_DEPTH_TEST, true);
+	GLState::setCapability(GL_CULL_FACE, true);
 
 	return true;
 }
@@ -324,9 +404,9 @@ void drawGrid()
 	}
 
 	glLineWidth(1);
-	glEnable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, true);
 	glDepthMask(false);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	Shader* grid_shader = Shader::getDefaultShader("grid");
 	grid_shader->enable();
 	Matrix44 m;
@@ -336,7 +416,7 @@ void drawGrid()
 	grid_shader->setUniform("u_camera_position", Camera::current->eye);
 	grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 	grid->render(GL_LINES); //background grid
-	glDisable(GL_BLEND);
+	GLState::setCapability(GL_BLEND, false);
 	glDepthMask(true);
 	grid_shader->disable();
 }
@@ -19,6 +19,17 @@ float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 
+//read only view of a whole file, the OS loads the pages when they are touched (no copies)
+struct sMappedFile {
+	const char* data;
+	size_t size;
+	void* handle; //platform mapping handle
+};
+sMappedFile* mapFile(const char* filename); //NULL if it can't be mapped
+void unmapFile(sMappedFile* file);
+//last modification (in platform units, only useful to compare) and size, false if the file doesn't exist
+bool getFileInfo(const char* filename, uint64& modification_time, uint64& size);
+
 //generic purposes fuctions
 void drawGrid();
 bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);